@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "../tests/server_cluster.c"
+
+// starts the cluster of ./raft_config and measures the transactions (acquire, append, release) of 16, 32, ... clients
+// that all take the same lock: the clients waiting for the lock keep handler threads of the leader busy, and past
+// MAX_IN_FLIGHT of them the leader turns the new requests away with E_BUSY (see Server_RPC_listen), and the clients
+// come back after the hinted wait. prints the transactions per second, the 99th percentile of their latency,
+// the transactions whose lease ran out before the append (E_LOCK_EXP), and the E_BUSY responses per transaction
+// usage: bench_admission [seconds per run] [max clients]
+
+#define MAX_CLIENTS 256
+#define MAX_SAMPLES 100000
+
+raft_configuration_t config;
+rpc_conn_t rpc[MAX_CLIENTS];
+
+typedef struct bench_thread {
+	rpc_conn_t *rpc;
+	volatile int *stop;
+	volatile int *measure;
+	long ops;
+	long expired;
+} bench_thread_t;
+
+long latencies[MAX_SAMPLES];
+int n_latencies;
+pthread_mutex_t latencies_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* bench_client(void *arg) {
+    bench_thread_t *t = (bench_thread_t*)arg;
+    char buffer[BUFFER_SIZE] = "A";
+    while(!*t->stop) {
+	double start = now_sec();
+	int rc = RPC_acquire_lock(t->rpc);
+	assert(rc == 0 || rc == E_LOCK);
+	rc = RPC_append_file(t->rpc, "file_0", buffer);
+	assert(rc == 0 || rc == E_LOCK_EXP); // the lease ran out while the server was overloaded
+	assert(RPC_release_lock(t->rpc) == 0);
+	if(!*t->measure) continue;
+	if(rc < 0) {
+	    t->expired ++;
+	    continue;
+	}
+	t->ops ++;
+	pthread_mutex_lock(&latencies_lock);
+	if(n_latencies < MAX_SAMPLES) latencies[n_latencies++] = (now_sec() - start) * 1e6;
+	pthread_mutex_unlock(&latencies_lock);
+    }
+    return NULL;
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(long*)a, y = *(long*)b;
+    return (x > y) - (x < y);
+}
+
+void run_transactions(int n_clients, double seconds) {
+    start_server_cluster(0);
+
+    static int run = 0;
+    static bench_thread_t threads[MAX_CLIENTS];
+    pthread_t tids[MAX_CLIENTS];
+    volatile int stop = 0, measure = 0;
+    for(int i = 0; i < n_clients; ++i) {
+	RPC_init(&rpc[i], 10 + i, 2000 + 300*run + i, config);
+	threads[i].rpc = &rpc[i];
+	threads[i].stop = &stop;
+	threads[i].measure = &measure;
+	threads[i].ops = 0;
+	threads[i].expired = 0;
+    }
+    run ++;
+    n_latencies = 0;
+
+    for(int i = 0; i < n_clients; ++i) pthread_create(&tids[i], NULL, bench_client, &threads[i]);
+    sleep(2);
+    int busy_start = 0;
+    for(int i = 0; i < n_clients; ++i) busy_start += rpc[i].busy_responses;
+    measure = 1;
+    double start = now_sec();
+    usleep(seconds * 1e6);
+    measure = 0;
+    double elapsed = now_sec() - start;
+    long total = 0, expired = 0;
+    int busy = -busy_start;
+    for(int i = 0; i < n_clients; ++i) {
+	total += threads[i].ops;
+	expired += threads[i].expired;
+	busy += rpc[i].busy_responses;
+    }
+    stop = 1;
+    for(int i = 0; i < n_clients; ++i) pthread_join(tids[i], NULL);
+    kill_all_servers();
+    sleep(1);
+
+    qsort(latencies, n_latencies, sizeof(long), compare_long);
+    long p99 = (n_latencies > 0) ? latencies[n_latencies * 99 / 100] : 0;
+    printf("%7i  %14.0f  %8.1f  %7li  %18.2f\n", n_clients, total / elapsed, p99 / 1000.0, expired, total > 0 ? (double)busy / total : 0);
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 5;
+    int max_clients = (argc > 2) ? atoi(argv[2]) : MAX_CLIENTS;
+    if(max_clients > MAX_CLIENTS) max_clients = MAX_CLIENTS;
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    printf("clients  transactions/s  p99 msec  expired  E_BUSY/transaction\n");
+    for(int n = 16; n <= max_clients; n *= 2) run_transactions(n, seconds);
+    exit(0);
+}
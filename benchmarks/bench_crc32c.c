@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../crc32c.h"
+#include "../raft.h"
+
+// measures the cost of checksumming 1 GB with CRC32C: with the crc32 instruction, with the portable
+// implementation, and as it is used by the log files (one checksum per log entry record)
+// usage: bench_crc32c [size in GB]
+
+#define BUFFER_MB 64
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// returns seconds per GB
+double bench(unsigned int (*checksum)(unsigned int, const void*, long), char *buffer, long buffer_size, long block_size, double gb) {
+    long total = (long)(gb * (1L << 30));
+    unsigned int crc = 0;
+    double start = now_sec();
+    for(long done = 0; done < total; done += buffer_size) {
+	for(long offset = 0; offset < buffer_size; offset += block_size) {
+	    crc ^= checksum(0, buffer + offset, block_size);
+	}
+    }
+    double elapsed = now_sec() - start;
+    if(crc == 0x12345678) printf(" "); // keep the loop
+    return elapsed / gb;
+}
+
+int main(int argc, char* argv[]) {
+    double gb = (argc > 1) ? atof(argv[1]) : 1;
+    long buffer_size = BUFFER_MB * 1024L * 1024L;
+    char *buffer = malloc(buffer_size);
+    for(long i = 0; i < buffer_size; ++i) buffer[i] = rand();
+
+    long entry_size = sizeof(raft_log_entry_t) / MAX_TRANSACTION_ENTRIES; // roughly an entry with one transaction
+    printf("crc32 instruction: %s\n", crc32c_hw_available() ? "yes" : "no");
+    printf("crc32c, 32 KB blocks (snapshot chunks):	%.3f s/GB\n", bench(crc32c, buffer, buffer_size, SNAPSHOT_CHUNK_SIZE, gb));
+    printf("crc32c, %li B blocks (log records):	%.3f s/GB\n", entry_size, bench(crc32c, buffer, buffer_size - buffer_size % entry_size, entry_size, gb));
+    printf("portable crc32c, 32 KB blocks:		%.3f s/GB\n", bench(crc32c_sw, buffer, buffer_size, SNAPSHOT_CHUNK_SIZE, gb));
+    free(buffer);
+    exit(0);
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "../tests/server_cluster.c"
+
+// starts the cluster of ./raft_config and counts the UDP datagrams sent (by the servers and the client, from
+// /proc/net/snmp) while it is idle, and while one client commits a transaction every LIGHT_LOAD_INTERVAL msec.
+// the idle followers get a heartbeat IDLE_HEARTBEATS_PER_ELECTION_TIMEOUT times per election timeout instead of
+// every heartbeat interval (see Raft_replicate); each heartbeat is two datagrams, the append and its response
+// usage: bench_idle_heartbeats [seconds per run]
+
+#define LIGHT_LOAD_INTERVAL 200
+
+raft_configuration_t config;
+rpc_conn_t rpc;
+
+long udp_out_datagrams() {
+    FILE *f = fopen("/proc/net/snmp", "r");
+    char line[512];
+    long value = -1;
+    int n_udp = 0;
+    while(fgets(line, sizeof(line), f) != NULL) {
+	if(strncmp(line, "Udp:", 4) != 0 || ++n_udp != 2) continue;
+	long in_datagrams, no_ports, in_errors;
+	sscanf(line, "Udp: %li %li %li %li", &in_datagrams, &no_ports, &in_errors, &value); // the header line comes first
+    }
+    fclose(f);
+    return value;
+}
+
+void transaction() {
+    char buffer[BUFFER_SIZE] = "A";
+    int rc = RPC_acquire_lock(&rpc);
+    assert(rc == 0 || rc == E_LOCK);
+    assert(RPC_append_file(&rpc, "file_0", buffer) == 0);
+    assert(RPC_release_lock(&rpc) == 0);
+}
+
+double count_datagrams(double seconds, int light_load) {
+    long start = udp_out_datagrams();
+    for(int msec = 0; msec < seconds * 1000; msec += LIGHT_LOAD_INTERVAL) {
+	if(light_load) transaction();
+	usleep(LIGHT_LOAD_INTERVAL * 1000);
+    }
+    return (udp_out_datagrams() - start) / seconds;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 10;
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    start_server_cluster(0);
+    RPC_init(&rpc, 1, 2000, config);
+    transaction();
+    sleep(3); // the leader measures the round trips and settles on its timeouts
+
+    printf("load                                 datagrams/s  per follower/s\n");
+    double idle = count_datagrams(seconds, 0);
+    printf("idle                                 %11.1f  %14.1f\n", idle, idle / (N_SERVERS - 1));
+    double light = count_datagrams(seconds, 1);
+    printf("a transaction every %4i msec        %11.1f  %14.1f\n", LIGHT_LOAD_INTERVAL, light, light / (N_SERVERS - 1));
+
+    kill_all_servers();
+    exit(0);
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../raft.h"
+#include "../raft_log.h"
+#include "../raft_utils.h"
+#include "../raft_storage_manager.h"
+
+// measures how long a server holding N_ENTRIES log entries takes to restart,
+// and how long it then takes to read every entry (the sealed log files are mapped, so the entries are read lazily)
+// usage: bench_log_restart [number of entries] [transaction entries per log entry]
+
+#define N_ENTRIES 1000000
+#define N_TRANSACTIONS 1
+
+#define PORT 31010
+
+raft_state_t raft, restored;
+
+void bench_commit_handler(raft_state_t *raft, raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]) {}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    int n_entries = (argc > 1) ? atoi(argv[1]) : N_ENTRIES;
+    int n_transactions = (argc > 2) ? atoi(argv[2]) : N_TRANSACTIONS;
+
+    raft_configuration_t config;
+    bzero(&config, sizeof(config));
+    for(int i = 0; i < N_SERVERS; ++i) config.servers[i].id = -1;
+    config.servers[0].id = 1;
+    UDP_FillSockAddr(&config.servers[0].raft_socket, "localhost", PORT);
+    strcpy(config.servers[0].file_directory, "/tmp/raft_bench_restart/");
+    mkdir(config.servers[0].file_directory, 0777);
+
+    char files_dir[256];
+    strcpy(files_dir, config.servers[0].file_directory);
+    Raft_server_init(&raft, config, files_dir, bench_commit_handler, 1, PORT);
+
+    // fill the log; nothing is committed, so the restart does not replay the log
+    double start = now_sec();
+    raft_log_entry_t *entry = calloc(1, sizeof(raft_log_entry_t));
+    entry->term = 1;
+    entry->type = CLIENT_LOG;
+    for(int i = 0; i < n_entries; ++i) {
+	entry->id = i;
+	for(int j = 0; j < n_transactions && j < MAX_TRANSACTION_ENTRIES; ++j) {
+	    sprintf(entry->data[j].filename, "file_%i", (i + j) % 100);
+	    sprintf(entry->data[j].buffer, "entry %i\n", i);
+	}
+	raft.log_count ++;
+	Raft_log_put(&raft.log, i, entry);
+	Raft_save_log_entry(&raft, i);
+    }
+    raft.current_term = 1;
+    Raft_save_state(&raft);
+    printf("wrote %i log entries in %.2f s\n", n_entries, now_sec() - start);
+    close(raft.rpc_sd);
+
+    start = now_sec();
+    Raft_server_restore(&restored, files_dir, bench_commit_handler, 1, PORT);
+    double restart_time = now_sec() - start;
+
+    if(restored.log_count != n_entries) {
+	printf("restart FAILED: %i entries in the log instead of %i\n", restored.log_count, n_entries);
+	exit(1);
+    }
+
+    start = now_sec();
+    for(int i = 0; i < n_entries; ++i) {
+	raft_log_entry_t *log = Raft_get_log(&restored, i);
+	if(log == NULL || log->id != i || log->term != 1) {
+	    printf("restart FAILED: wrong entry %i\n", i);
+	    exit(1);
+	}
+    }
+    double read_time = now_sec() - start;
+
+    printf("restarted with %i log entries in %.3f s; reading all of them took %.3f s\n", n_entries, restart_time, read_time);
+
+    Raft_reset_log_files(&restored);
+    exit(0);
+}
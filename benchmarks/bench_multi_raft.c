@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "../tests/server_cluster.c"
+
+// starts the cluster of ./raft_config with 1, 2, 4, ... raft groups per server ("groups=<n>") and measures the
+// transactions (acquire, append, release) of N_CLIENTS clients, spread over the groups: each client takes a lock
+// of its group and appends to a file of the same group. the groups commit independently, and their leaders are
+// spread over the servers, so the transactions of different groups do not wait for each other
+// usage: bench_multi_raft [seconds per run] [max groups]
+
+#define N_CLIENTS 8
+
+raft_configuration_t config;
+rpc_conn_t rpc[N_CLIENTS];
+
+typedef struct bench_thread {
+	rpc_conn_t *rpc;
+	char file_name[256];
+	volatile int *stop;
+	long ops;
+} bench_thread_t;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a name with the prefix owned by the group
+void group_name(char *name, char *prefix, int group, int n_groups) {
+    for(int k = 0; ; ++k) {
+	sprintf(name, "%s%i", prefix, k);
+	if(name_group(name, n_groups) == group) return;
+    }
+}
+
+void* bench_client(void *arg) {
+    bench_thread_t *t = (bench_thread_t*)arg;
+    char buffer[BUFFER_SIZE] = "A";
+    while(!*t->stop) {
+	int rc = RPC_acquire_lock(t->rpc);
+	assert(rc == 0 || rc == E_LOCK);
+	assert(RPC_append_file(t->rpc, t->file_name, buffer) == 0);
+	assert(RPC_release_lock(t->rpc) == 0);
+	t->ops ++;
+    }
+    return NULL;
+}
+
+double run_transactions(int n_groups, double seconds, int *n_leaders) {
+    char option[32];
+    sprintf(option, "groups=%i", n_groups);
+    server_option = option;
+    start_server_cluster(0);
+
+    static int run = 0;
+    bench_thread_t threads[N_CLIENTS];
+    pthread_t tids[N_CLIENTS];
+    volatile int stop = 0;
+    for(int i = 0; i < N_CLIENTS; ++i) {
+	RPC_init(&rpc[i], 10 + i, 2000 + 100*run + i, config);
+	assert(rpc[i].n_groups == n_groups);
+	char lock_name[256];
+	group_name(lock_name, "lock_", i % n_groups, n_groups);
+	RPC_select_lock(&rpc[i], lock_name);
+	threads[i].rpc = &rpc[i];
+	group_name(threads[i].file_name, "file_", i % n_groups, n_groups);
+	threads[i].stop = &stop;
+	threads[i].ops = 0;
+    }
+    run ++;
+
+    // the first transactions find the leaders, and the balancer spreads them
+    for(int i = 0; i < N_CLIENTS; ++i) pthread_create(&tids[i], NULL, bench_client, &threads[i]);
+    sleep(3);
+    for(int i = 0; i < N_CLIENTS; ++i) threads[i].ops = 0;
+    double start = now_sec();
+    usleep(seconds * 1e6);
+    long total = 0;
+    for(int i = 0; i < N_CLIENTS; ++i) total += threads[i].ops;
+    double elapsed = now_sec() - start;
+    stop = 1;
+    for(int i = 0; i < N_CLIENTS; ++i) pthread_join(tids[i], NULL);
+
+    // the servers the clients found the leaders of their groups at
+    int leaders[N_SERVERS];
+    bzero(leaders, sizeof(leaders));
+    for(int i = 0; i < N_CLIENTS; ++i) leaders[rpc[i].current_leader_index] = 1;
+    *n_leaders = 0;
+    for(int i = 0; i < N_SERVERS; ++i) *n_leaders += leaders[i];
+
+    kill_all_servers();
+    sleep(1);
+    return total / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 5;
+    int max_groups = (argc > 2) ? atoi(argv[2]) : 8;
+    if(max_groups > MAX_GROUPS) max_groups = MAX_GROUPS;
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    printf("groups  transactions/s  servers leading\n");
+    for(int n = 1; n <= max_groups; n *= 2) {
+	int n_leaders;
+	double ops = run_transactions(n, seconds, &n_leaders);
+	printf("%6i  %14.0f  %15i\n", n, ops, n_leaders);
+    }
+    exit(0);
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "../tests/server_cluster.c"
+
+// starts the cluster of ./raft_config and measures the reads of a file served by the leader under its lease
+// (one local file read per request) with 1 to MAX_CLIENTS clients, and, for comparison, the transactions
+// that go through the log (acquire, append, release). with read-index, the servers confirm their leadership
+// for the reads with heartbeat rounds instead (see Raft_read_index).
+// the reads are also spread over all the servers: linearizable (the followers ask the leader for the index),
+// and with a staleness bound of MAX_STALENESS msec (the followers answer on their own)
+// usage: bench_read_file [seconds per run] [max clients] [read-index]
+
+#define MAX_CLIENTS 8
+#define READ_SIZE 512
+#define FILE_NAME "file_0"
+#define MAX_STALENESS 100
+
+raft_configuration_t config;
+rpc_conn_t writer_rpc;
+rpc_conn_t reader_rpc[MAX_CLIENTS];
+char contents[READ_SIZE + 1];
+
+typedef enum read_kind {
+	LEADER_READ,
+	FOLLOWER_LINEARIZABLE_READ,
+	FOLLOWER_STALE_READ
+} read_kind_t;
+
+typedef struct bench_thread {
+	rpc_conn_t *rpc;
+	read_kind_t kind;
+	volatile int *stop;
+	long ops;
+	double latency;
+} bench_thread_t;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* bench_reader(void *arg) {
+    bench_thread_t *t = (bench_thread_t*)arg;
+    char buffer[READ_SIZE];
+    while(!*t->stop) {
+	double start = now_sec();
+	int n;
+	if(t->kind == LEADER_READ) {
+	    n = RPC_read_file(t->rpc, FILE_NAME, 0, READ_SIZE, buffer);
+	} else if(t->kind == FOLLOWER_LINEARIZABLE_READ) {
+	    n = RPC_read_file_follower(t->rpc, READ_LINEARIZABLE, 0, FILE_NAME, 0, READ_SIZE, buffer);
+	} else {
+	    n = RPC_read_file_follower(t->rpc, READ_BOUNDED_STALENESS, MAX_STALENESS, FILE_NAME, 0, READ_SIZE, buffer);
+	}
+	t->latency += now_sec() - start;
+	assert(n == READ_SIZE && memcmp(buffer, contents, READ_SIZE) == 0);
+	t->ops ++;
+    }
+    return NULL;
+}
+
+double run_reads(read_kind_t kind, int n_clients, double seconds, double *latency) {
+    bench_thread_t threads[MAX_CLIENTS];
+    pthread_t tids[MAX_CLIENTS];
+    volatile int stop = 0;
+    double start = now_sec();
+    for(int i = 0; i < n_clients; ++i) {
+	threads[i].rpc = &reader_rpc[i];
+	threads[i].kind = kind;
+	threads[i].stop = &stop;
+	threads[i].ops = 0;
+	threads[i].latency = 0;
+	pthread_create(&tids[i], NULL, bench_reader, &threads[i]);
+    }
+    usleep(seconds * 1e6);
+    stop = 1;
+    long total = 0;
+    double total_latency = 0;
+    for(int i = 0; i < n_clients; ++i) {
+	pthread_join(tids[i], NULL);
+	total += threads[i].ops;
+	total_latency += threads[i].latency;
+    }
+    *latency = total_latency / total;
+    return total / (now_sec() - start);
+}
+
+double run_transactions(double seconds) {
+    char buffer[BUFFER_SIZE] = "A";
+    long ops = 0;
+    double start = now_sec();
+    while(now_sec() - start < seconds) {
+	int rc = RPC_acquire_lock(&writer_rpc);
+	assert(rc == 0 || rc == E_LOCK);
+	assert(RPC_append_file(&writer_rpc, "file_1", buffer) == 0);
+	assert(RPC_release_lock(&writer_rpc) == 0);
+	ops ++;
+    }
+    return ops / (now_sec() - start);
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 2;
+    int max_clients = (argc > 2) ? atoi(argv[2]) : MAX_CLIENTS;
+    if(max_clients > MAX_CLIENTS) max_clients = MAX_CLIENTS;
+    if(argc > 3) server_option = argv[3];
+
+    start_server_cluster(0);
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    RPC_init(&writer_rpc, 1, 2000, config);
+    for(int i = 0; i < READ_SIZE; ++i) contents[i] = 'a' + i % 26;
+    int rc = RPC_acquire_lock(&writer_rpc);
+    assert(rc == 0 || rc == E_LOCK);
+    assert(RPC_append_file(&writer_rpc, FILE_NAME, contents) == 0);
+    assert(RPC_release_lock(&writer_rpc) == 0);
+    for(int i = 0; i < max_clients; ++i) RPC_init(&reader_rpc[i], 10 + i, 2010 + i, config);
+
+    printf("                      leader          any server, linearizable   any server, %i ms stale\n", MAX_STALENESS);
+    printf("clients  read ops/s  latency usec  read ops/s  latency usec  read ops/s  latency usec\n");
+    for(int n = 1; n <= max_clients; n *= 2) {
+	double ops[3], latency[3];
+	for(int kind = LEADER_READ; kind <= FOLLOWER_STALE_READ; ++kind) ops[kind] = run_reads(kind, n, seconds, &latency[kind]);
+	printf("%7i  %10.0f  %12.0f  %10.0f  %12.0f  %10.0f  %12.0f\n", n, ops[0], latency[0] * 1e6, ops[1], latency[1] * 1e6, ops[2], latency[2] * 1e6);
+    }
+    printf("transactions through the log (1 client): %.0f ops/s\n", run_transactions(seconds));
+
+    kill_all_servers();
+    exit(0);
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "../tmdspinlock.h"
+
+// measures how the read throughput of the lock scales with the number of concurrent holders:
+// each thread acquires the lock, reads for READ_USEC while holding it and releases it.
+// with shared holders the reads overlap, with exclusive ones they are serialized.
+// then measures how often a writer gets the lock among the readers with each wait queue policy
+// usage: bench_rwlock [seconds per run] [max threads]
+
+#define READ_USEC 1000
+#define WRITE_USEC 1000
+#define MAX_THREADS 64
+
+typedef struct bench_thread {
+	tmdspinlock_t *lock;
+	int id;
+	int mode;
+	int hold_usec;
+	volatile int *stop;
+	long ops;
+} bench_thread_t;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* bench_thread(void *arg) {
+    bench_thread_t *t = (bench_thread_t*)arg;
+    while(!*t->stop) {
+	tmdspinlock_acquire(t->lock, t->id, t->mode);
+	tmdspinlock_pause_if_owner(t->lock, t->id);
+	usleep(t->hold_usec);
+	tmdspinlock_reset_if_owner(t->lock, t->id);
+	tmdspinlock_release(t->lock, t->id);
+	t->ops ++;
+    }
+    return NULL;
+}
+
+// runs n_readers reading threads (and n_writers writing ones) for the duration; returns the operations of each kind
+void run(tmdspinlock_t *lock, int n_readers, int reader_mode, int n_writers, double seconds, long *reads, long *writes) {
+    bench_thread_t threads[MAX_THREADS + 1];
+    pthread_t tids[MAX_THREADS + 1];
+    volatile int stop = 0;
+    for(int i = 0; i < n_readers + n_writers; ++i) {
+	threads[i].lock = lock;
+	threads[i].id = i + 1;
+	threads[i].mode = (i < n_readers) ? reader_mode : LOCK_EXCLUSIVE;
+	threads[i].hold_usec = (i < n_readers) ? READ_USEC : WRITE_USEC;
+	threads[i].stop = &stop;
+	threads[i].ops = 0;
+	pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+    usleep(seconds * 1e6);
+    stop = 1;
+    *reads = *writes = 0;
+    for(int i = 0; i < n_readers + n_writers; ++i) {
+	pthread_join(tids[i], NULL);
+	if(i < n_readers) {
+	    *reads += threads[i].ops;
+	} else {
+	    *writes += threads[i].ops;
+	}
+    }
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 1;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : 32;
+    if(max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+    tmdspinlock_t *lock = malloc(sizeof(tmdspinlock_t));
+    tmdspinlock_init(lock, WRITER_PREFERENCE, NULL);
+
+    printf("holders  shared reads/s  exclusive reads/s\n");
+    for(int n = 1; n <= max_threads; n *= 2) {
+	long shared, exclusive, writes;
+	run(lock, n, LOCK_SHARED, 0, seconds, &shared, &writes);
+	run(lock, n, LOCK_EXCLUSIVE, 0, seconds, &exclusive, &writes);
+	printf("%7i  %14.0f  %17.0f\n", n, shared / seconds, exclusive / seconds);
+    }
+
+    char *policies[] = {"writer preference", "reader preference", "fifo"};
+    tmdspinlock_policy_t policy_values[] = {WRITER_PREFERENCE, READER_PREFERENCE, FIFO_ORDER};
+    int n_readers = (max_threads < 16) ? max_threads : 16;
+    printf("\n%i readers and 1 writer:\n", n_readers);
+    for(int p = 0; p < 3; ++p) {
+	lock->policy = policy_values[p];
+	long reads, writes;
+	run(lock, n_readers, LOCK_SHARED, 1, seconds, &reads, &writes);
+	printf("%-18s  %8.0f reads/s  %6.0f writes/s\n", policies[p], reads / seconds, writes / seconds);
+    }
+    exit(0);
+}
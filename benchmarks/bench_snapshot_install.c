@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../raft.h"
+#include "../raft_log.h"
+#include "../raft_storage_manager.h"
+#include "../raft_snapshot_sender.h"
+#include "../raft_snapshot_scheduler.h"
+
+// installs a SNAPSHOT_MB snapshot from an in-process leader onto a fresh follower over loopback
+// usage: bench_snapshot_install [size in MB]
+
+#define SNAPSHOT_MB 100
+#define SNAPSHOT_ID 50
+
+#define LEADER_PORT 31000
+#define FOLLOWER_PORT 31001
+
+raft_state_t leader, follower;
+
+void bench_commit_handler(raft_state_t *raft, raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]) {}
+
+void* bench_listener_thread(void* arg) {
+    Raft_RPC_listen((raft_state_t*)arg);
+    pthread_exit(0);
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    int snapshot_mb = (argc > 1) ? atoi(argv[1]) : SNAPSHOT_MB;
+
+    raft_configuration_t config;
+    bzero(&config, sizeof(config));
+    for(int i = 0; i < N_SERVERS; ++i) config.servers[i].id = -1;
+    config.servers[0].id = 1;
+    UDP_FillSockAddr(&config.servers[0].raft_socket, "localhost", LEADER_PORT);
+    strcpy(config.servers[0].file_directory, "/tmp/raft_bench_leader/");
+    config.servers[1].id = 2;
+    UDP_FillSockAddr(&config.servers[1].raft_socket, "localhost", FOLLOWER_PORT);
+    strcpy(config.servers[1].file_directory, "/tmp/raft_bench_follower/");
+
+    mkdir(config.servers[0].file_directory, 0777);
+    mkdir(config.servers[1].file_directory, 0777);
+
+    char leader_dir[256], follower_dir[256];
+    strcpy(leader_dir, config.servers[0].file_directory);
+    strcpy(follower_dir, config.servers[1].file_directory);
+    Raft_server_init(&leader, config, leader_dir, bench_commit_handler, 1, LEADER_PORT);
+    Raft_server_init(&follower, config, follower_dir, bench_commit_handler, 2, FOLLOWER_PORT);
+    // nobody sends heartbeats in this benchmark, so the election timeouts are disabled
+    UDP_SetReceiveTimeout(leader.rpc_sd, 0);
+    UDP_SetReceiveTimeout(follower.rpc_sd, 0);
+
+    // fabricate the leader's snapshot: 100 files of equal size
+    Raft_create_snapshot_dir(&leader, SNAPSHOT_ID);
+    long file_size = (long)snapshot_mb * 1024 * 1024 / 100;
+    char *buffer = malloc(file_size);
+    for(long i = 0; i < file_size; ++i) buffer[i] = 'a' + (i * 7 + i / 4096) % 26;
+    for(int i = 0; i < 100; ++i) {
+	char filename[256];
+	sprintf(filename, "file_%i", i);
+	Raft_write_snapshot_chunk(&leader, SNAPSHOT_ID, filename, 0, buffer, file_size);
+    }
+    Raft_seal_snapshot(&leader, SNAPSHOT_ID);
+
+    leader.current_term = 1;
+    leader.start_log_index = SNAPSHOT_ID;
+    Raft_add_snapshot_generation(&leader, SNAPSHOT_ID, &leader.snapshot_lock_state, &leader.snapshot_membership);
+    leader.log_count = SNAPSHOT_ID;
+    Raft_log_reset(&leader.log, SNAPSHOT_ID);
+    leader.commit_index = SNAPSHOT_ID - 1;
+    leader.last_applied_index = SNAPSHOT_ID - 1;
+    leader.state = LEADER;
+    Raft_publish_view(&leader);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, bench_listener_thread, &leader);
+    pthread_create(&tid, NULL, bench_listener_thread, &follower);
+
+    double start = now_sec();
+    int rc = Raft_send_snapshot(&leader, 2, &config.servers[1].raft_socket);
+    double elapsed = now_sec() - start;
+
+    if(rc != 0 || follower.start_log_index != SNAPSHOT_ID) {
+	printf("snapshot install FAILED (rc = %i, follower log start = %i)\n", rc, follower.start_log_index);
+	exit(1);
+    }
+
+    // check the installed files
+    long total = 0;
+    for(int i = 0; i < 100; ++i) {
+	char path[512];
+	sprintf(path, "%sfile_%i", config.servers[1].file_directory, i);
+	struct stat st;
+	if(stat(path, &st) != 0 || st.st_size != file_size) {
+	    printf("snapshot install FAILED: %s has wrong size\n", path);
+	    exit(1);
+	}
+	total += st.st_size;
+    }
+
+    printf("installed %.1f MB snapshot in %.2f s: %.1f MB/s\n", total / 1048576.0, elapsed, total / 1048576.0 / elapsed);
+
+    Raft_remove_snapshot(&leader, SNAPSHOT_ID);
+    Raft_remove_snapshot(&follower, SNAPSHOT_ID);
+    Raft_clean_main_files(&follower);
+    exit(0);
+}
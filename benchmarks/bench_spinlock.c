@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "../spinlock.h"
+
+// measures the throughput of the locks under contention with 1 to 64 threads, and the processor time
+// they burn doing it (cpu = processor seconds per second; waiters that spin keep it up).
+// the test-and-set lock is the one spinlock_t used to be.
+// in the first run the critical section is a few memory updates, in the second one the holder
+// blocks for BLOCK_USEC under the lock, as when it writes to a file
+// usage: bench_spinlock [seconds per run] [max threads]
+
+#define MAX_THREADS 64
+#define SHARED_WORDS 16
+#define BLOCK_USEC 100
+
+typedef enum lock_kind {
+	TEST_AND_SET,
+	ADAPTIVE,
+	MCS
+} lock_kind_t;
+
+typedef struct bench_lock {
+	lock_kind_t kind;
+	int tas_flag;
+	spinlock_t spinlock;
+	mcslock_t mcslock;
+	long shared[SHARED_WORDS];
+} bench_lock_t;
+
+typedef struct bench_thread {
+	bench_lock_t *lock;
+	int block_usec;
+	volatile int *stop;
+	long ops;
+} bench_thread_t;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_sec() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void bench_acquire(bench_lock_t *lock) {
+    switch(lock->kind) {
+	case TEST_AND_SET:
+	    while(!__sync_bool_compare_and_swap(&lock->tas_flag, 0, 1));
+	    break;
+	case ADAPTIVE:
+	    spinlock_acquire(&lock->spinlock);
+	    break;
+	case MCS:
+	    mcslock_acquire(&lock->mcslock);
+	    break;
+    }
+}
+
+void bench_release(bench_lock_t *lock) {
+    switch(lock->kind) {
+	case TEST_AND_SET:
+	    __sync_bool_compare_and_swap(&lock->tas_flag, 1, 0);
+	    break;
+	case ADAPTIVE:
+	    spinlock_release(&lock->spinlock);
+	    break;
+	case MCS:
+	    mcslock_release(&lock->mcslock);
+	    break;
+    }
+}
+
+void* bench_thread(void *arg) {
+    bench_thread_t *t = (bench_thread_t*)arg;
+    unsigned int seed = (unsigned long)t;
+    while(!*t->stop) {
+	bench_acquire(t->lock);
+	for(int i = 0; i < SHARED_WORDS; ++i) t->lock->shared[i] ++;
+	if(t->block_usec > 0) usleep(t->block_usec);
+	bench_release(t->lock);
+	t->ops ++;
+	// some work outside of the lock
+	for(int i = rand_r(&seed) % 200; i > 0; --i) __asm__ __volatile__("" ::: "memory");
+    }
+    return NULL;
+}
+
+void run(lock_kind_t kind, int n_threads, int block_usec, double seconds, double *ops, double *cpu) {
+    bench_lock_t *lock = calloc(1, sizeof(bench_lock_t));
+    lock->kind = kind;
+    spinlock_init(&lock->spinlock);
+    mcslock_init(&lock->mcslock);
+
+    bench_thread_t threads[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    volatile int stop = 0;
+    double start = now_sec(), start_cpu = cpu_sec();
+    for(int i = 0; i < n_threads; ++i) {
+	threads[i].lock = lock;
+	threads[i].block_usec = block_usec;
+	threads[i].stop = &stop;
+	threads[i].ops = 0;
+	pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+    usleep(seconds * 1e6);
+    stop = 1;
+    long total = 0;
+    for(int i = 0; i < n_threads; ++i) {
+	pthread_join(tids[i], NULL);
+	total += threads[i].ops;
+    }
+    double elapsed = now_sec() - start;
+    *ops = total / elapsed;
+    *cpu = (cpu_sec() - start_cpu) / elapsed;
+    free(lock);
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : MAX_THREADS;
+    if(max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+    printf("%li processors\n", sysconf(_SC_NPROCESSORS_ONLN));
+    int block_usec[] = {0, BLOCK_USEC};
+    for(int b = 0; b < 2; ++b) {
+	printf("\nholder blocks for %i usec\n", block_usec[b]);
+	printf("threads  test-and-set ops/s   cpu  adaptive ops/s   cpu  mcs ops/s   cpu\n");
+	for(int n = 1; n <= max_threads; n *= 2) {
+	    double ops[3], cpu[3];
+	    for(int kind = TEST_AND_SET; kind <= MCS; ++kind) run(kind, n, block_usec[b], seconds, &ops[kind], &cpu[kind]);
+	    printf("%7i  %18.0f  %4.2f  %14.0f  %4.2f  %9.0f  %4.2f\n", n, ops[0], cpu[0], ops[1], cpu[1], ops[2], cpu[2]);
+	}
+    }
+    exit(0);
+}
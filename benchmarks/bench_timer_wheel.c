@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "../timer.h"
+
+// measures the cost of setting, renewing and cancelling timers with millions of them pending,
+// then how late the timers fire when many of them expire within a second
+// usage: bench_timer_wheel [number of timers]
+
+#define EXPIRE_DELAY 1000 // msec before the first timer of the expiry run (all the timers are set by then)
+#define EXPIRE_SPREAD 1000 // msec over which the timers of the expiry run are spread
+
+typedef struct bench_timer {
+	wheel_timer_t timer;
+	long deadline;
+} bench_timer_t;
+
+atomic_long n_fired;
+atomic_long total_lateness;
+atomic_long max_lateness;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void handle_timer(void *arg) {
+    bench_timer_t *t = (bench_timer_t*)arg;
+    long lateness = timer_now() - t->deadline;
+    total_lateness += lateness;
+    long max = max_lateness;
+    while(lateness > max && !atomic_compare_exchange_weak(&max_lateness, &max, lateness));
+    n_fired ++;
+}
+
+int main(int argc, char* argv[]) {
+    int n = (argc > 1) ? atoi(argv[1]) : 1000000;
+    bench_timer_t *timers = malloc(n * sizeof(bench_timer_t));
+    for(int i = 0; i < n; ++i) timer_init(&timers[i].timer, handle_timer, &timers[i]);
+
+    // leases far in the future, as most of them are: none of them fires during the run
+    double start = now_sec();
+    for(int i = 0; i < n; ++i) timer_set(&timers[i].timer, 100000 + rand() % 10000000);
+    double set_time = now_sec() - start;
+
+    start = now_sec();
+    for(int i = 0; i < n; ++i) timer_set(&timers[i].timer, 100000 + rand() % 10000000);
+    double renew_time = now_sec() - start;
+
+    start = now_sec();
+    for(int i = 0; i < n; ++i) timer_cancel(&timers[i].timer);
+    double cancel_time = now_sec() - start;
+
+    printf("%i timers\n", n);
+    printf("set     %6.0f ns/timer\n", set_time * 1e9 / n);
+    printf("renew   %6.0f ns/timer\n", renew_time * 1e9 / n);
+    printf("cancel  %6.0f ns/timer\n", cancel_time * 1e9 / n);
+
+    // all the timers expire within EXPIRE_SPREAD
+    for(int i = 0; i < n; ++i) {
+	int msec = EXPIRE_DELAY + rand() % EXPIRE_SPREAD;
+	timers[i].deadline = timer_now() + msec;
+	timer_set(&timers[i].timer, msec);
+    }
+    while(n_fired < n) usleep(10000);
+    printf("\n%i timers expired within %i ms: lateness %.2f ms on average, %li ms at most\n",
+	    n, EXPIRE_SPREAD, (double)total_lateness / n, (long)max_lateness);
+    exit(0);
+}
@@ -4,11 +4,46 @@
 #include "udp.h"
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
-int send_packet(rpc_conn_t *rpc, packet_info_t *packet, response_info_t *response) {
+// busy_wait()
+// the wait before the n-th retry (from 0) of a request the server was too busy for: the hint of the server doubled with
+// every retry, up to RPC_BUSY_WAIT_MAX, and drawn from [wait/2, wait) so that the clients turned away together do not come back together
+void busy_wait(rpc_conn_t *rpc, int retry_after, int n) {
+    long wait = (retry_after > 0) ? retry_after : RPC_ELECTION_WAIT;
+    for(int i = 0; i < n && wait < RPC_BUSY_WAIT_MAX; ++i) wait *= 2;
+    if(wait > RPC_BUSY_WAIT_MAX) wait = RPC_BUSY_WAIT_MAX;
+    long jittered = wait / 2 + rand_r(&rpc->backoff_seed) % (wait - wait / 2);
+    usleep(jittered * 1000);
+}
+
+// leader_hint()
+// the index of the server a follower pointed to as the leader (E_FOLLOWER): it is added to the servers if it is not
+// one of them, and its address is updated if it is. the next server if the follower does not know the leader
+int leader_hint(rpc_conn_t *rpc, int server_index, response_info_t *response) {
+    raft_server_configuration_t leader;
+    memcpy(&leader, response->buffer, sizeof(raft_server_configuration_t));
+    if(response->index < 0 || leader.id != response->index) return (server_index + 1) % rpc->n_servers;
+    for(int i = 0; i < rpc->n_servers; ++i) {
+	if(rpc->servers[i].id != leader.id) continue;
+	rpc->servers[i].client_socket = leader.client_socket;
+	return i;
+    }
+    if(rpc->n_servers == MAX_MEMBERS) return (server_index + 1) % rpc->n_servers;
+    rpc->servers[rpc->n_servers] = leader;
+    return rpc->n_servers ++;
+}
+
+// send_packet_to()
+// sends the request to the server at *server_index until it is answered, moving on to the leader a follower points to
+// (E_FOLLOWER), or to the next server if it is down or is behind (E_STALE); a server that is overloaded (E_BUSY)
+// is asked again after the wait it hints at (see busy_wait)
+int send_packet_to(rpc_conn_t *rpc, int *server_index, packet_info_t *packet, response_info_t *response) {
     packet->vtime = rpc->vtime ++;
     packet->client_id = rpc->client_id;
-    int rc = UDP_Write(rpc->sd, &rpc->raft_config.servers[rpc->current_leader_index].client_socket, (char*)packet, PACKET_SIZE);
+    int rc = UDP_Write(rpc->sd, &rpc->servers[*server_index].client_socket, (char*)packet, PACKET_SIZE);
     if(rc < 0) {
 	printf("RPC:: failed to send packet");
 	exit(1);
@@ -18,14 +53,19 @@ int send_packet(rpc_conn_t *rpc, packet_info_t *packet, response_info_t *respons
     rc = UDP_Read(rpc->sd, &rpc->recv_addr, (char*)response, RESPONSE_SIZE);
     //printf("lock server: %s\n", response.message);
     int n_attempts = 1;
+    int n_stale = 0;
+    int n_redirects = 0;
+    int n_busy = 0;
+    rpc->resent = 0;
     while(1) {
 	if(rc < 0 && (errno == ETIMEDOUT || errno == EAGAIN)) {
 	    if(n_attempts >= RPC_RETRY_LIMIT) {
 		// if retried too many times, switch to another server
-		rpc->current_leader_index = (rpc->current_leader_index + 1) % N_SERVERS;
+		*server_index = (*server_index + 1) % rpc->n_servers;
 		n_attempts = 0;
 	    }
-	    rc = UDP_Write(rpc->sd, &rpc->raft_config.servers[rpc->current_leader_index].client_socket, (char*)packet, PACKET_SIZE);
+	    rpc->resent = 1;
+	    rc = UDP_Write(rpc->sd, &rpc->servers[*server_index].client_socket, (char*)packet, PACKET_SIZE);
 	    rc = UDP_Read(rpc->sd, &rpc->recv_addr, (char*)response, RESPONSE_SIZE);
 	    n_attempts ++;
 	    continue;
@@ -35,23 +75,48 @@ int send_packet(rpc_conn_t *rpc, packet_info_t *packet, response_info_t *respons
 
 	if(response->rc == E_IN_PROGRESS || response->vtime < packet->vtime) {
 	    rc = UDP_Read(rpc->sd, &rpc->recv_addr, (char*)response, RESPONSE_SIZE);
-	} else if(response->rc == E_FOLLOWER || response->rc == E_ELECTION) {
+	} else if(response->rc == E_FOLLOWER || response->rc == E_ELECTION || response->rc == E_STALE) {
 	    if(response->rc == E_FOLLOWER) {
-		rpc->current_leader_index = (rpc->current_leader_index + 1) % N_SERVERS;
+		*server_index = leader_hint(rpc, *server_index, response);
+		if(++n_redirects % rpc->n_servers == 0) usleep(RPC_ELECTION_WAIT * 1000); // the followers do not agree on the leader yet
+	    } else if(response->rc == E_STALE) {
+		*server_index = (*server_index + 1) % rpc->n_servers;
+		if(++n_stale % rpc->n_servers == 0) usleep(RPC_ELECTION_WAIT * 1000); // no server is up to date enough yet
+	    } else {
+		usleep(RPC_ELECTION_WAIT * 1000); // retrying right away would only keep the leader busy
 	    }
-	    rc = UDP_Write(rpc->sd, &rpc->raft_config.servers[rpc->current_leader_index].client_socket, (char*)packet, PACKET_SIZE);
+	    rpc->resent = 1;
+	    rc = UDP_Write(rpc->sd, &rpc->servers[*server_index].client_socket, (char*)packet, PACKET_SIZE);
+	    rc = UDP_Read(rpc->sd, &rpc->recv_addr, (char*)response, RESPONSE_SIZE);
+	} else if(response->rc == E_BUSY) {
+	    rpc->busy_responses ++;
+	    busy_wait(rpc, response->retry_after, n_busy++);
+	    rc = UDP_Write(rpc->sd, &rpc->servers[*server_index].client_socket, (char*)packet, PACKET_SIZE);
 	    rc = UDP_Read(rpc->sd, &rpc->recv_addr, (char*)response, RESPONSE_SIZE);
 	} else break;
     }
     return rc;
 }
 
+int send_packet(rpc_conn_t *rpc, packet_info_t *packet, response_info_t *response) {
+    packet->group = rpc->group;
+    return send_packet_to(rpc, &rpc->current_leader_index, packet, response);
+}
+
 void RPC_init(rpc_conn_t *rpc, int id, int src_port, raft_configuration_t raft_config){
     rpc->sd = UDP_Open(src_port);
     rpc->vtime = 0;
     rpc->client_id = id;
-    rpc->raft_config = raft_config;
+    for(int i = 0; i < N_SERVERS; ++i) rpc->servers[i] = raft_config.servers[i];
+    rpc->n_servers = N_SERVERS;
     rpc->current_leader_index = 0;
+    rpc->n_groups = 1;
+    rpc->group = 0;
+    bzero(rpc->group_leader_index, sizeof(rpc->group_leader_index));
+    rpc->read_server_index = id % rpc->n_servers;
+    rpc->last_write_index = -1;
+    rpc->backoff_seed = id ^ (unsigned int)time(NULL);
+    rpc->busy_responses = 0;
     UDP_SetReceiveTimeout(rpc->sd, RPC_READ_TIEMOUT);
 
     packet_info_t packet;
@@ -63,9 +128,10 @@ void RPC_init(rpc_conn_t *rpc, int id, int src_port, raft_configuration_t raft_c
 	printf("rpc error\n");
 	exit(1);
     } 
+    if(response.index >= 1 && response.index <= MAX_GROUPS) rpc->n_groups = response.index;
 }
 
-void RPC_restore(rpc_conn_t *rpc, char *filename, int id, int src_port) {
+void RPC_restore(rpc_conn_t *rpc, char filename[128], int id, int src_port) {
     FILE *f = fopen(filename, "rb");
     fread(rpc, sizeof(rpc_conn_t), 1, f);
     fclose(f);
@@ -75,18 +141,69 @@ void RPC_restore(rpc_conn_t *rpc, char *filename, int id, int src_port) {
     assert(rpc->client_id == id);
 }
 
-int RPC_acquire_lock(rpc_conn_t *rpc) {
+void RPC_select_lock(rpc_conn_t *rpc, char *lock_name) {
+    int group = name_group(lock_name, rpc->n_groups);
+    rpc->group_leader_index[rpc->group] = rpc->current_leader_index;
+    rpc->group = group;
+    rpc->current_leader_index = rpc->group_leader_index[group];
+}
+
+int send_acquire_packet(rpc_conn_t *rpc, lock_mode_t mode) {
     packet_info_t packet;
     bzero(&packet, PACKET_SIZE);
     packet.operation = LOCK_ACQUIRE;
+    packet.mode = mode;
    
     response_info_t response;
-    if(send_packet(rpc, &packet, &response) < 0 || response.rc < 0) {
+    int rc = send_packet(rpc, &packet, &response);
+    if(rc >= 0 && response.rc == E_LOCK && rpc->resent) {
+	// the grant is only answered once committed: the leader that granted it went away before answering,
+	// and the one asked again already has it from the log
+	response.rc = 0;
+    }
+    if(rc < 0 || response.rc < 0) {
 	printf("rpc error\n");
+	if(response.rc == E_LOCK) {
+	    memcpy(rpc->current_transaction, response.message, 2*sizeof(int)); // already held
+	}
 	return response.rc;
     } 
 
     memcpy(rpc->current_transaction, response.message, 2*sizeof(int));
+    bzero(rpc->transaction, sizeof(rpc->transaction));
+    rpc->transaction_size = 0;
+    return 0;
+}
+
+int RPC_acquire_lock(rpc_conn_t *rpc) {
+    return send_acquire_packet(rpc, LOCK_EXCLUSIVE);
+}
+
+int RPC_acquire_shared_lock(rpc_conn_t *rpc) {
+    return send_acquire_packet(rpc, LOCK_SHARED);
+}
+
+int send_append_packet(rpc_conn_t *rpc, char *file_name, char *buffer, int offset, response_info_t *response) {
+    packet_info_t packet;
+    bzero(&packet, PACKET_SIZE);
+    packet.operation = APPEND_FILE;
+    packet.token = rpc->current_transaction[1];
+    packet.offset = offset;
+    strcpy(packet.file_name, file_name);
+    memcpy(packet.buffer, buffer, BUFFER_SIZE);
+    return send_packet(rpc, &packet, response);
+}
+
+// the leader changed while the lock was held: the new leader knows the holder, but not the appends of the transaction
+// (the first append of the replay has offset -1: the server drops whatever it has of the transaction)
+int replay_transaction(rpc_conn_t *rpc) {
+    response_info_t response;
+    int offset = -1;
+    for(int i = 0; i < MAX_TRANSACTION_ENTRIES && rpc->transaction[i].filename[0] != 0; ++i) {
+	if(send_append_packet(rpc, rpc->transaction[i].filename, rpc->transaction[i].buffer, offset, &response) < 0) return -1;
+	if(response.rc < 0) return response.rc;
+	offset = (offset == -1) ? strlen(rpc->transaction[i].buffer) : offset + strlen(rpc->transaction[i].buffer);
+    }
     return 0;
 }
 
@@ -94,29 +211,106 @@ int RPC_release_lock(rpc_conn_t *rpc){
     packet_info_t packet;
     bzero(&packet, PACKET_SIZE);
     packet.operation = LOCK_RELEASE;
-    memcpy(packet.buffer, rpc->current_transaction, 2*sizeof(int));
+    packet.token = rpc->current_transaction[1];
+    packet.offset = rpc->transaction_size;
 
     response_info_t response;
     int rc = send_packet(rpc, &packet, &response);
+    while(rc >= 0 && response.rc == E_TRANSACTION_RESET && replay_transaction(rpc) == 0) {
+	rc = send_packet(rpc, &packet, &response);
+    }
     if(rc < 0 || (response.rc < 0 && response.rc != E_LOCK_EXP)) {
 	printf("rpc error: %i\n", (rc < 0) ? -1000 : response.rc);
 	return rc < 0 ? rc : response.rc;
     }
+    if(response.rc == 0 && response.index > rpc->last_write_index) rpc->last_write_index = response.index;
     return 0;
 }
 
 int RPC_append_file(rpc_conn_t *rpc, char *file_name, char *buffer) {
+    response_info_t response;
+    int rc = send_append_packet(rpc, file_name, buffer, rpc->transaction_size, &response);
+    while(rc >= 0 && response.rc == E_TRANSACTION_RESET && replay_transaction(rpc) == 0) {
+	rc = send_append_packet(rpc, file_name, buffer, rpc->transaction_size, &response);
+    }
+    if(rc < 0 || response.rc < 0) return response.rc;
+
+    for(int i = 0; i < MAX_TRANSACTION_ENTRIES; ++i) {
+	raft_transaction_entry_t *entry = &rpc->transaction[i];
+	if(entry->filename[0] == 0) {
+	    strcpy(entry->filename, file_name);
+	    strcpy(entry->buffer, buffer);
+	    break;
+	} else if(strcmp(entry->filename, file_name) == 0) {
+	    strcat(entry->buffer, buffer);
+	    break;
+	}
+    }
+    rpc->transaction_size += strlen(buffer);
+    return response.rc;
+} 
+
+int read_file(rpc_conn_t *rpc, int *server_index, read_consistency_t consistency, int bound, char *file_name, int offset, int length, char *buffer) {
     packet_info_t packet;
     bzero(&packet, PACKET_SIZE);
-    packet.operation = APPEND_FILE;
+    packet.operation = READ_FILE;
+    packet.group = name_group(file_name, rpc->n_groups);
+    packet.consistency = consistency;
+    packet.min_index = bound;
+    packet.max_staleness = bound;
     strcpy(packet.file_name, file_name);
-    memcpy(packet.buffer, buffer, BUFFER_SIZE);
 
     response_info_t response;
-    send_packet(rpc, &packet, &response);
+    int total = 0;
+    while(length == -1 || total < length) {
+	packet.offset = offset + total;
+	packet.length = (length == -1 || length - total > BUFFER_SIZE) ? BUFFER_SIZE : length - total;
+	if(send_packet_to(rpc, server_index, &packet, &response) < 0) return -1;
+	if(response.rc < 0) return response.rc;
+	memcpy(buffer + total, response.buffer, response.rc);
+	total += response.rc;
+	if(response.rc < packet.length) break; // the end of the file
+    }
+    return total;
+}
+
+int RPC_read_file(rpc_conn_t *rpc, char *file_name, int offset, int length, char *buffer) {
+    // the file might be of another group than the lock
+    int group = name_group(file_name, rpc->n_groups);
+    int *leader_index = (group == rpc->group) ? &rpc->current_leader_index : &rpc->group_leader_index[group];
+    return read_file(rpc, leader_index, READ_LINEARIZABLE, 0, file_name, offset, length, buffer);
+}
+
+int RPC_read_file_follower(rpc_conn_t *rpc, read_consistency_t consistency, int bound, char *file_name, int offset, int length, char *buffer) {
+    return read_file(rpc, &rpc->read_server_index, consistency, bound, file_name, offset, length, buffer);
+}
+
+int RPC_last_write_index(rpc_conn_t *rpc) {
+    return rpc->last_write_index;
+}
+
+int RPC_transfer_leadership(rpc_conn_t *rpc, int server_id) {
+    packet_info_t packet;
+    bzero(&packet, PACKET_SIZE);
+    packet.operation = TRANSFER_LEADERSHIP;
+    packet.target_id = server_id;
 
+    response_info_t response;
+    if(send_packet(rpc, &packet, &response) < 0) return -1;
     return response.rc;
-} 
+}
+
+int RPC_change_membership(rpc_conn_t *rpc, raft_server_configuration_t *server, member_role_t role) {
+    packet_info_t packet;
+    bzero(&packet, PACKET_SIZE);
+    packet.operation = CHANGE_MEMBERSHIP;
+    packet.role = role;
+    memcpy(packet.buffer, server, sizeof(raft_server_configuration_t));
+
+    response_info_t response;
+    if(send_packet(rpc, &packet, &response) < 0) return -1;
+    return response.rc;
+}
 
 void RPC_close(rpc_conn_t *rpc){
     packet_info_t packet;
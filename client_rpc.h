@@ -12,13 +12,36 @@ typedef struct rpc_conn {
 	int client_id;
 	atomic_int vtime;
 	
-	raft_configuration_t raft_config;
-	int current_leader_index;
-	int current_transaction[2];
+	// the servers the requests go to: those of raft_config (servers[i] is its servers[i]), followed by the leaders
+	// the followers pointed to that are not in it, such as the servers added later (see send_packet_to)
+	raft_server_configuration_t servers[MAX_MEMBERS];
+	int n_servers;
+	int current_leader_index; // into servers, of the group of the lock
+
+	// the lock names and the files are spread over the raft groups of the servers (see name_group),
+	// each of which elects its own leader
+	int n_groups;
+	int group; // the group of the lock (see RPC_select_lock)
+	int group_leader_index[MAX_GROUPS]; // of the other groups
+	int current_transaction[2]; // term in which the lock was acquired, and the fencing token
+
+	// the appends of the current transaction, merged per file as the server does;
+	// they are sent again if a new leader asks for them (E_TRANSACTION_RESET)
+	raft_transaction_entry_t transaction[MAX_TRANSACTION_ENTRIES];
+	int transaction_size;
+
+	int read_server_index; // the server the follower reads are sent to; the clients are spread over the servers
+	int last_write_index; // the index of the last transaction released, -1 if none
+
+	unsigned int backoff_seed; // the jitter of the waits after E_BUSY
+	int busy_responses; // E_BUSY responses so far
+	int resent; // the last request went out again after a timeout or to another server: a leader that went away may have handled it
 } rpc_conn_t;
 
 #define RPC_READ_TIEMOUT 100
 #define RPC_RETRY_LIMIT 10
+#define RPC_ELECTION_WAIT 20 // msec to wait before asking again a leader that is not ready (E_ELECTION)
+#define RPC_BUSY_WAIT_MAX 2000 // msec, the longest wait before asking again an overloaded server (E_BUSY)
 
 
 //This function should set up a socket and bind it to src_port
@@ -27,12 +50,54 @@ void RPC_init(rpc_conn_t *rpc, int id, int src_port, raft_configuration_t raft_c
 void RPC_restore(rpc_conn_t *rpc, char filename[128], int id, int src_port); 
 
 
+// select_lock()
+// the lock the requests are for, 0 by default: the servers keep one lock per raft group, so the lock names of a group
+// share it (see name_group). the files appended to in a transaction must be of the same group (E_FILE otherwise).
+// must not be called while holding a lock
+void RPC_select_lock(rpc_conn_t *rpc, char *lock_name);
+
+// acquire_lock()
+// the fencing token of the lock is saved to current_transaction[1]
 int RPC_acquire_lock(rpc_conn_t *rpc);
 
+// acquire_shared_lock()
+// any number of clients can hold the lock shared at once, but they cannot append to the files (E_LOCK_EXP);
+// the fencing token is -1. the lock is released with RPC_release_lock
+int RPC_acquire_shared_lock(rpc_conn_t *rpc);
+
 int RPC_release_lock(rpc_conn_t *rpc);
 
 int RPC_append_file(rpc_conn_t *rpc, char *file_name, char *buffer); 
 
+// read_file()
+// reads up to length bytes of the file from offset (to the end of the file if length is -1) into buffer, and returns
+// the number of bytes read. no lock is needed: each read of at most BUFFER_SIZE bytes is answered by the leader from
+// its own files (see Raft_has_read_lease) and sees every transaction released before it started; a longer range
+// is read in several requests, which may see later transactions as well
+int RPC_read_file(rpc_conn_t *rpc, char *file_name, int offset, int length, char *buffer);
+
+// read_file_follower()
+// reads the file like RPC_read_file, from any server: with READ_LINEARIZABLE a follower asks the leader for the
+// index to wait for; with READ_MIN_INDEX the server must have applied the entries up to bound (RPC_last_write_index
+// for the client's own transactions); with READ_BOUNDED_STALENESS it must have been up to date with the leader at most
+// bound msec ago. a server that does not qualify answers E_STALE, and the next one is asked
+int RPC_read_file_follower(rpc_conn_t *rpc, read_consistency_t consistency, int bound, char *file_name, int offset, int length, char *buffer);
+
+// last_write_index()
+// the index of the last transaction the client released: a follower read with READ_MIN_INDEX at it sees the client's writes
+int RPC_last_write_index(rpc_conn_t *rpc);
+
+// transfer_leadership()
+// asks the leader to hand the leadership over to the server (-1 for the most up-to-date one), e.g. before it is restarted;
+// returns 0 once the leader stepped down, or E_TRANSFER if the transfer failed
+int RPC_transfer_leadership(rpc_conn_t *rpc, int server_id);
+
+// change_membership()
+// asks the leader to make the server a voter or a learner, or to remove it from the cluster (a new server is started
+// with "join"); returns 0 once the new configuration is committed, or E_MEMBERSHIP if the change was refused
+// (e.g. another one is in progress) or did not complete in time
+int RPC_change_membership(rpc_conn_t *rpc, raft_server_configuration_t *server, member_role_t role);
+
 void RPC_close(rpc_conn_t *rpc); 
 
 #endif
@@ -0,0 +1,140 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78 // reflected Castagnoli polynomial
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+// shift a crc by CRC32C_LONG (CRC32C_SHORT) zero bytes, a byte of the crc at a time
+static uint32_t crc32c_long_shift[4][256];
+static uint32_t crc32c_short_shift[4][256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// product of two polynomials modulo the crc polynomial (bit-reflected, as the crc itself)
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for(;;) {
+	if(a & m) {
+	    p ^= b;
+	    if((a & (m - 1)) == 0) break;
+	}
+	m >>= 1;
+	b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+static void crc32c_init_shift(uint32_t shift[4][256], long len) {
+    uint32_t op = 1u << 31; // x^(8*len) mod P
+    for(long i = 0; i < len; ++i) op = crc32c_multmodp(op, 1u << 23);
+    for(int k = 0; k < 4; ++k) {
+	for(uint32_t i = 0; i < 256; ++i) shift[k][i] = crc32c_multmodp(op, i << (8 * k));
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t shift[4][256], uint32_t crc) {
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+static void crc32c_init() {
+    for(int i = 0; i < 256; ++i) {
+	uint32_t crc = i;
+	for(int j = 0; j < 8; ++j) crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+	crc32c_table[0][i] = crc;
+    }
+    // table k advances a byte followed by k zero bytes
+    for(int i = 0; i < 256; ++i) {
+	for(int k = 1; k < 8; ++k) {
+	    crc32c_table[k][i] = (crc32c_table[k-1][i] >> 8) ^ crc32c_table[0][crc32c_table[k-1][i] & 0xff];
+	}
+    }
+    crc32c_init_shift(crc32c_long_shift, CRC32C_LONG);
+    crc32c_init_shift(crc32c_short_shift, CRC32C_SHORT);
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+static uint32_t crc32c_sw_update(uint32_t crc, const unsigned char *p, long len) {
+    while(len > 0 && ((uintptr_t)p & 7)) {
+	crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	len--;
+    }
+    while(len >= 8) {
+	uint64_t word;
+	memcpy(&word, p, 8);
+	word ^= crc; // little endian: the crc is xored into the first 4 bytes
+	crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+	    crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+	    crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+	    crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+	p += 8;
+	len -= 8;
+    }
+    while(len-- > 0) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+// the crc32 instruction has a latency of 3 cycles but a throughput of 1 per cycle: three adjacent blocks
+// are checksummed in parallel, and their checksums are combined with the shift tables
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_blocks(uint32_t crc, const unsigned char **p, long *len, long block, uint32_t shift[4][256]) {
+    while(*len >= 3 * block) {
+	uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+	const unsigned char *end = *p + block;
+	do {
+	    crc0 = __builtin_ia32_crc32di(crc0, *(const uint64_t*)*p);
+	    crc1 = __builtin_ia32_crc32di(crc1, *(const uint64_t*)(*p + block));
+	    crc2 = __builtin_ia32_crc32di(crc2, *(const uint64_t*)(*p + 2 * block));
+	    *p += 8;
+	} while(*p < end);
+	crc = crc32c_shift(shift, crc32c_shift(shift, crc0) ^ crc1) ^ crc2;
+	*p += 2 * block;
+	*len -= 3 * block;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_update(uint32_t crc, const unsigned char *p, long len) {
+    while(len > 0 && ((uintptr_t)p & 7)) {
+	crc = __builtin_ia32_crc32qi(crc, *p++);
+	len--;
+    }
+    crc = crc32c_hw_blocks(crc, &p, &len, CRC32C_LONG, crc32c_long_shift);
+    crc = crc32c_hw_blocks(crc, &p, &len, CRC32C_SHORT, crc32c_short_shift);
+    uint64_t crc64 = crc;
+    while(len >= 8) {
+	crc64 = __builtin_ia32_crc32di(crc64, *(const uint64_t*)p);
+	p += 8;
+	len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while(len-- > 0) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+unsigned int crc32c(unsigned int crc, const void *buffer, long len) {
+    pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+    if(crc32c_hw) return ~crc32c_hw_update(~crc, buffer, len);
+#endif
+    return ~crc32c_sw_update(~crc, buffer, len);
+}
+
+unsigned int crc32c_sw(unsigned int crc, const void *buffer, long len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_sw_update(~crc, buffer, len);
+}
+
+int crc32c_hw_available() {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_hw;
+}
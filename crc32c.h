@@ -0,0 +1,15 @@
+#ifndef __CRC32C_h__
+#define __CRC32C_h__
+
+// CRC32C (Castagnoli): computed with the SSE4.2 crc32 instruction when the CPU has it,
+// with a table-driven (slicing-by-8) fallback otherwise.
+// crc is the checksum of the preceding data (0 for none): crc32c(crc32c(0, a), b) is the checksum of a followed by b
+unsigned int crc32c(unsigned int crc, const void *buffer, long len);
+
+// the portable implementation (for benchmarks)
+unsigned int crc32c_sw(unsigned int crc, const void *buffer, long len);
+
+// returns 1 if crc32c() uses the crc32 instruction
+int crc32c_hw_available();
+
+#endif
@@ -2,15 +2,44 @@
 #define __FORMAT_h__
 
 #define BUFFER_SIZE 1024
+#define MAX_ID 1000 // client ids are below it
+
+// name_group()
+// the raft group that owns the lock or the file with the name (see the "groups" option of the server)
+static inline int name_group(const char *name, int n_groups) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    for(; *name != 0; ++name) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash % n_groups;
+}
 
 typedef enum operation_type{
 	CLIENT_INIT,
 	LOCK_ACQUIRE,
 	LOCK_RELEASE,
 	APPEND_FILE,
-	CLIENT_CLOSE
+	CLIENT_CLOSE,
+	TRANSFER_LEADERSHIP,
+	READ_FILE,
+	CHANGE_MEMBERSHIP
 } operation_type_t;
 
+typedef enum lock_mode {
+	LOCK_EXCLUSIVE,
+	LOCK_SHARED
+} lock_mode_t;
+
+typedef enum read_consistency {
+	READ_LINEARIZABLE, // sees every transaction released before the read
+	READ_MIN_INDEX, // sees at least the entries up to min_index, e.g. the client's own transactions
+	READ_BOUNDED_STALENESS // sees every transaction released max_staleness msec before the read
+} read_consistency_t;
+
+typedef enum member_role {
+	MEMBER_REMOVED,
+	MEMBER_LEARNER, // gets the log and the snapshots, but does not vote and is not counted in any majority
+	MEMBER_VOTER
+} member_role_t;
+
 typedef enum response_code {
 	E_FILE = -1,
 	E_IN_PROGRESS = -2,
@@ -20,22 +49,40 @@ typedef enum response_code {
 	E_TRANSACTION_LIMIT = -6,
 	E_FOLLOWER = -7,
 	E_ELECTION = -8,
-	E_LOST = -9
+	E_LOST = -9,
+	E_TRANSACTION_RESET = -10,
+	E_TRANSFER = -11,
+	E_STALE = -12,
+	E_MEMBERSHIP = -13,
+	E_BUSY = -14
 } response_code_t;
 
 typedef struct packet_info{
 	int client_id; //unique number for each client
 	int vtime;
+	int group; //the raft group the request is for (see name_group)
 	operation_type_t operation; //RPC operation
+	lock_mode_t mode; //mode of the lock (LOCK_ACQUIRE)
+	int token; //fencing token of the lock (LOCK_RELEASE, APPEND_FILE)
+	int offset; //bytes appended in the transaction before this request, -1 to start it over (LOCK_RELEASE, APPEND_FILE); position in the file (READ_FILE)
+	int length; //bytes to read, at most BUFFER_SIZE (READ_FILE)
+	read_consistency_t consistency; //(READ_FILE)
+	int min_index; //the server must have applied the entries up to it (READ_FILE with READ_MIN_INDEX)
+	int max_staleness; //msec (READ_FILE with READ_BOUNDED_STALENESS)
+	int target_id; //server to hand the leadership over to, -1 for the most up-to-date one (TRANSFER_LEADERSHIP)
+	member_role_t role; //new role of the server whose configuration is in the buffer (CHANGE_MEMBERSHIP)
 	char file_name[256]; //file name
-	char buffer[BUFFER_SIZE]; //data appending to the file
+	char buffer[BUFFER_SIZE]; //data appending to the file; the server configuration (CHANGE_MEMBERSHIP)
 } packet_info_t;
 
 typedef struct response_info {
 	int client_id;
-	int rc;
+	int rc; //bytes read (READ_FILE)
 	int vtime;
+	int index; //the commit index the file was read at (READ_FILE), the index of the transaction (LOCK_RELEASE), the number of groups (CLIENT_INIT), the id of the leader, -1 if not known (E_FOLLOWER)
+	int retry_after; //msec before the request should be sent again (E_BUSY)
 	char message[256];
+	char buffer[BUFFER_SIZE]; //data read from the file (READ_FILE); the configuration of the leader (E_FOLLOWER)
 } response_info_t;
 
 #define PACKET_SIZE sizeof(packet_info_t)
@@ -1,205 +1,440 @@
 #include "raft.h"
 #include "raft_leader.h"
 #include "raft_utils.h"
+#include "raft_log.h"
 #include "raft_storage_manager.h"
 #include "raft_candidate.h"
 #include "raft_follower.h"
+#include "raft_snapshot_sender.h"
+#include "raft_snapshot_scheduler.h"
+#include "raft_lock.h"
+#include "raft_membership.h"
 #include "pthread.h"
 #include "spinlock.h"
 #include "udp.h"
 #include <stdlib.h>
 #include <time.h>
-#include <errno.h>
 
 typedef struct raft_packet_thread_arg {
     raft_state_t* raft;
     raft_packet_t packet;
     struct sockaddr_in addr; } raft_packet_thread_arg_t;
 
+int Raft_open_socket(int port) {
+    int sd = UDP_Open(port);
+    UDP_SetBufferSize(sd, RAFT_SOCKET_BUFFER_SIZE);
+    return sd;
+}
+
 void Raft_server_init(raft_state_t *raft, raft_configuration_t config, char filedir[256], raft_commit_handler commit_handler, int id, int port) {
+    Raft_server_init_group(raft, config, filedir, commit_handler, id, 0, Raft_open_socket(port));
+}
+
+void Raft_server_init_group(raft_state_t *raft, raft_configuration_t config, char filedir[256], raft_commit_handler commit_handler, int id, int group, int sd) {
     raft->id = id;
+    raft->group = group;
 
-    raft->rpc_sd = UDP_Open(port);
-    srand(time(0));
-    UDP_SetReceiveTimeout(raft->rpc_sd, ELECTION_TIMEOUT +  (rand() % 100)); // election timeout will depend on a process;
+    raft->rpc_sd = sd;
+    Raft_seed_random(raft);
     raft->commit_handler = commit_handler;
 
-    raft->config = config;
+    Raft_init_membership(&raft->snapshot_membership, &config);
+    raft->membership = raft->snapshot_membership;
+    raft->membership_index = -1;
     raft->state = FOLLOWER;
-    spinlock_init(&raft->lock);
+    raft->leader_id = -1;
+    mcslock_init(&raft->lock);
+    spinlock_init(&raft->wal_lock);
+    spinlock_init(&raft->apply_lock);
+    raft->wal_term = -1;
+    seqlock_init(&raft->view_lock);
+    eventcount_init(&raft->view_event);
+    raft->forward_request_id = 0;
+    spinlock_init(&raft->forward_lock);
+    raft->forward_answer_id = 0;
+    raft->forward_answer_index = -1;
     raft->voted_for = -1;
     raft->start_log_index = 0;
     raft->current_term = 0;
+    raft->saved_state.current_term = -1; // nothing is saved yet
     raft->snapshot_in_progress = 0;
-    raft->n_followers_receiving_snapshots = 0;
     
     raft->commit_index = -1;
     raft->log_count = 0;
     raft->last_applied_index = -1;
-    raft->nvoted = 0;
-    raft->nblocked = 0;
+    Raft_init_lock_state(&raft->snapshot_lock_state);
+    Raft_init_lock_state(&raft->lock_state);
+    raft->votes = 0;
+    raft->blocked = 0;
+    raft->pre_vote_term = -1;
+    raft->last_leader_contact = 0;
+    raft->synced_time = 0;
+    raft->transfer_target = -1;
+    raft->election_timeout = ELECTION_TIMEOUT;
+    raft->heartbeat_interval = HEARTBIT_TIME;
+    raft->lease_expiry = 0;
+    raft->lease_barrier = 0;
+    raft->quorum_contact_time = 0;
+    raft->read_request_time = 0;
+    spinlock_init(&raft->rtt.lock);
+    raft->rtt.n_samples = 0;
     strcpy(raft->files_dir, filedir);
+    Raft_log_init(&raft->log, 0);
+
+    Raft_reset_snapshot_install(raft);
+    Raft_init_snapshot_generations(raft);
+    for(int i = 0; i <= MAX_SERVER_ID; ++i) {
+	spinlock_init(&raft->snapshot_transfer[i].lock);
+	eventcount_init(&raft->snapshot_transfer[i].acked);
+	raft->snapshot_transfer[i].active = 0;
+	raft->snapshot_transfer[i].snapshot_id = -1;
+	spinlock_init(&raft->progress[i].lock);
+    }
 
-    raft->install_snapshot_id = -1;
-    raft->install_snapshot_index = -1;
-
-    for(int i = 0; i < 100; ++i) Raft_remove_snapshot(raft, i);
+    Raft_remove_snapshots_except(raft, -1, -1);
     Raft_clean_main_files(raft);
-
+    Raft_reset_apply_checkpoint(raft, -1);
+    Raft_init_log_files(raft);
+    Raft_save_install_progress(raft);
+
+    Raft_publish_view(raft);
+    raft->timer_work = 0;
+    eventcount_init(&raft->timer_event);
+    timer_init(&raft->election_timer, Raft_election_timer_fired, raft);
+    Raft_init_heartbeats(raft);
+    Raft_reset_election_timer(raft);
 }
 
 void Raft_server_restore(raft_state_t *raft, char filedir[256], raft_commit_handler commit_handler, int id, int port) {
-    Raft_load_state(raft, filedir); 
-    assert(raft->id == id);
+    Raft_server_restore_group(raft, filedir, commit_handler, id, 0, Raft_open_socket(port));
+}
+
+void Raft_server_restore_group(raft_state_t *raft, char filedir[256], raft_commit_handler commit_handler, int id, int group, int sd) {
+    if(Raft_load_state(raft, filedir) != 0) {
+	printf("the raft state in %s is missing or corrupted\n", filedir);
+	exit(1);
+    }
+    assert(raft->id == id && raft->group == group);
 
-    raft->rpc_sd = UDP_Open(port);
-    srand(time(0));
-    UDP_SetReceiveTimeout(raft->rpc_sd, ELECTION_TIMEOUT + (rand() % 100)); // election timeout will depend on a process;
+    raft->rpc_sd = sd;
+    Raft_seed_random(raft);
     raft->commit_handler = commit_handler;
     raft->state = FOLLOWER;
+    raft->leader_id = -1;
     raft->snapshot_in_progress = 0;
-    raft->n_followers_receiving_snapshots = 0;
 
-    spinlock_init(&raft->lock);
+    mcslock_init(&raft->lock);
+    spinlock_init(&raft->wal_lock);
+    spinlock_init(&raft->apply_lock);
+    raft->wal_term = -1;
+    seqlock_init(&raft->view_lock);
+    eventcount_init(&raft->view_event);
+    raft->forward_request_id = 0;
+    spinlock_init(&raft->forward_lock);
+    raft->forward_answer_id = 0;
+    raft->forward_answer_index = -1;
     
-    int prev_session_commit_index = raft->commit_index;
-    raft->commit_index = raft->start_log_index - 1;
+    raft->commit_index = raft->start_log_index - 1; // the leader tells how far the log is committed
     raft->last_applied_index = -1;
-    raft->nvoted = 0;
-    raft->nblocked = 0;
+    raft->votes = 0;
+    raft->blocked = 0;
+    raft->pre_vote_term = -1;
+    raft->last_leader_contact = Raft_get_time_msec(); // the server might have acknowledged a lease before it restarted
+    raft->synced_time = 0;
+    raft->transfer_target = -1;
+    raft->election_timeout = ELECTION_TIMEOUT;
+    raft->heartbeat_interval = HEARTBIT_TIME;
+    raft->lease_expiry = 0;
+    raft->lease_barrier = 0;
+    raft->quorum_contact_time = 0;
+    raft->read_request_time = 0;
+    spinlock_init(&raft->rtt.lock);
+    raft->rtt.n_samples = 0;
     strcpy(raft->files_dir, filedir);
-
-    raft->install_snapshot_id = -1;
-    raft->install_snapshot_index = -1;
-
-    Raft_clean_main_files(raft);
-    if(raft->start_log_index != 0) {
-	Raft_copy_snapshot(raft, raft->start_log_index, -1);
+    Raft_load_log(raft);
+    raft->membership_index = raft->start_log_index - 1;
+    Raft_refresh_membership(raft);
+
+    Raft_reset_snapshot_install(raft);
+    Raft_init_snapshot_generations(raft);
+    for(int i = 0; i <= MAX_SERVER_ID; ++i) {
+	spinlock_init(&raft->snapshot_transfer[i].lock);
+	eventcount_init(&raft->snapshot_transfer[i].acked);
+	raft->snapshot_transfer[i].active = 0;
+	raft->snapshot_transfer[i].snapshot_id = -1;
+	spinlock_init(&raft->progress[i].lock);
     }
-    Raft_commit_update(raft, prev_session_commit_index);
 
-    for(int i = 0; i < 100; ++i) {
-	if(i == raft->start_log_index) continue;
-	Raft_remove_snapshot(raft, i);
+    if(Raft_restore_main_files(raft) == 0) {
+	// the main files are consistent with the checkpoint: only the entries after it are applied
+	raft->commit_index = raft->apply_checkpoint.applied_index;
+	raft->lock_state = raft->apply_checkpoint.lock_state;
+	printf("resuming from the apply checkpoint: %i\n", raft->commit_index);
+    } else {
+	Raft_clean_main_files(raft);
+	if(raft->start_log_index != 0) {
+	    if(Raft_verify_snapshot(raft, raft->start_log_index) != 0) {
+		printf("snapshot %i in %s is corrupted\n", raft->start_log_index, filedir);
+		exit(1);
+	    }
+	    Raft_copy_snapshot(raft, raft->start_log_index, -1);
+	}
+	raft->lock_state = raft->snapshot_lock_state;
+	Raft_reset_apply_checkpoint(raft, raft->commit_index);
     }
+    raft->last_applied_index = raft->commit_index;
+
+    Raft_restore_snapshot_install(raft);
+    Raft_remove_snapshots_except(raft, raft->start_log_index, raft->install_snapshot_id);
+
+    Raft_publish_view(raft);
+    raft->timer_work = 0;
+    eventcount_init(&raft->timer_event);
+    timer_init(&raft->election_timer, Raft_election_timer_fired, raft);
+    Raft_init_heartbeats(raft);
+    Raft_reset_election_timer(raft);
 }
 
 
-int Raft_is_entry_committed(raft_state_t *raft, int term, int id) {
-    spinlock_acquire(&raft->lock);
-    for(int i = raft->start_log_index; i < raft->log_count; ++i) {
-	raft_log_entry_t *log = Raft_get_log(raft, i);
-	if(log->term == term && log->id == id) {
-	    int res = (raft->commit_index >= i) ? 1 : 0;
-	    spinlock_release(&raft->lock);
-	    return res;
-	} else if(log->term > term) {
-	    int res = (raft->commit_index >= i) ? -1 : 0;
-	    spinlock_release(&raft->lock);
-	    return res;
-	}
+void Raft_publish_view(raft_state_t *raft) {
+    int applied = raft->last_applied_index;
+    int commit_term = (applied >= raft->start_log_index) ? Raft_get_log_term(raft, applied) : -1;
+    seqlock_write_begin(&raft->view_lock);
+    __atomic_store_n(&raft->view.state, raft->state, __ATOMIC_RELAXED);
+    __atomic_store_n(&raft->view.current_term, raft->current_term, __ATOMIC_RELAXED);
+    __atomic_store_n(&raft->view.leader_id, raft->leader_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&raft->view.commit_index, raft->last_applied_index, __ATOMIC_RELAXED);
+    __atomic_store_n(&raft->view.commit_term, commit_term, __ATOMIC_RELAXED);
+    __atomic_store_n(&raft->view.transfer_target, raft->transfer_target, __ATOMIC_RELAXED);
+    __atomic_store_n(&raft->view.synced_time, raft->synced_time, __ATOMIC_RELAXED);
+    seqlock_write_end(&raft->view_lock);
+    eventcount_signal(&raft->view_event);
+}
+
+void Raft_read_view(raft_state_t *raft, raft_view_t *view) {
+    unsigned int sequence;
+    do {
+	sequence = seqlock_read_begin(&raft->view_lock);
+	view->state = __atomic_load_n(&raft->view.state, __ATOMIC_RELAXED);
+	view->current_term = __atomic_load_n(&raft->view.current_term, __ATOMIC_RELAXED);
+	view->leader_id = __atomic_load_n(&raft->view.leader_id, __ATOMIC_RELAXED);
+	view->commit_index = __atomic_load_n(&raft->view.commit_index, __ATOMIC_RELAXED);
+	view->commit_term = __atomic_load_n(&raft->view.commit_term, __ATOMIC_RELAXED);
+	view->transfer_target = __atomic_load_n(&raft->view.transfer_target, __ATOMIC_RELAXED);
+	view->synced_time = __atomic_load_n(&raft->view.synced_time, __ATOMIC_RELAXED);
+    } while(seqlock_read_retry(&raft->view_lock, sequence));
+}
+
+int Raft_has_read_lease(raft_state_t *raft) {
+    raft_view_t view;
+    Raft_read_view(raft, &view);
+    // the entry of the term is committed: the leader has applied every entry committed before it was elected
+    if(view.state != LEADER || view.commit_term != view.current_term || view.transfer_target != -1) return 0;
+    return Raft_get_time_usec() < __atomic_load_n(&raft->lease_expiry, __ATOMIC_ACQUIRE);
+}
+
+long Raft_get_staleness(raft_state_t *raft) {
+    raft_view_t view;
+    Raft_read_view(raft, &view);
+    if(view.state == LEADER) {
+	long contact = __atomic_load_n(&raft->quorum_contact_time, __ATOMIC_ACQUIRE);
+	if(view.commit_term != view.current_term || contact == 0) return -1;
+	return Raft_get_time_msec() - contact / 1000;
     }
-    spinlock_release(&raft->lock);
-    return 0;
+    return (view.synced_time == 0) ? -1 : Raft_get_time_msec() - view.synced_time;
+}
+
+int Raft_is_entry_committed(raft_state_t *raft, int index, int term) {
+    raft_view_t view;
+    Raft_read_view(raft, &view);
+    // an entry of the current term cannot be replaced while this server is its leader
+    if(view.state == LEADER && view.current_term == term && view.commit_index < index) return 0;
+
+    mcslock_acquire(&raft->lock);
+    int res = 0;
+    if(index < raft->start_log_index) {
+	res = 1; // compacted: only committed entries are compacted
+    } else if(index >= raft->log_count) {
+	res = -1; // the log was truncated
+    } else if(Raft_get_log_term(raft, index) != term) {
+	res = -1;
+    } else if(raft->last_applied_index >= index) {
+	res = 1;
+    }
+    mcslock_release(&raft->lock);
+    return res;
 }
 
 int Raft_append_entry(raft_state_t *raft, raft_log_entry_t *log) { 
-    spinlock_acquire(&raft->lock);
-    if(raft->state != LEADER || raft->log_count == raft->start_log_index + LOG_SIZE) {
-	spinlock_release(&raft->lock);
+    mcslock_acquire(&raft->lock);
+    if(raft->state != LEADER || raft->transfer_target != -1) {
+	mcslock_release(&raft->lock);
 	return -1;
     } 
 
     raft->log_count ++;
     log->term = raft->current_term;
-    log->n_servers_replicated = 1;
-    log->type = CLIENT_LOG;
-    memcpy(Raft_get_log(raft, raft->log_count-1), log, sizeof(raft_log_entry_t));
-    Raft_save_state(raft);
-
-    spinlock_release(&raft->lock);
-    return 0;
+    int index = raft->log_count - 1;
+    int term = raft->current_term;
+    Raft_log_put(&raft->log, index, log);
+    Raft_send_new_entry(raft, index);
+
+    mcslock_release(&raft->lock);
+    // the followers get the entry while it is written to the log files
+    Raft_persist_log(raft, term, index + 1);
+    return index;
 }
 
+int Raft_admission_delay(raft_state_t *raft) {
+    mcslock_acquire(&raft->lock);
+    int done = (raft->last_applied_index < raft->durable_index) ? raft->last_applied_index : raft->durable_index;
+    int backlog = raft->log_count - 1 - done;
+    int heartbeat_interval = raft->heartbeat_interval;
+    mcslock_release(&raft->lock);
+    if(backlog <= ADMIT_MAX_BACKLOG) return 0;
+    // the backlog drains by about a window per heartbeat interval
+    long delay = (long)heartbeat_interval * backlog / ADMIT_MAX_BACKLOG;
+    return (delay > ADMIT_MAX_RETRY_AFTER) ? ADMIT_MAX_RETRY_AFTER : delay;
+}
 
 void Raft_commit_update(raft_state_t *raft, int new_commit_index) {
-    for(int i = raft->commit_index + 1; i <= new_commit_index; ++i) {
-	if(Raft_get_log(raft, i)->type == LEADER_LOG) continue;
-	raft->commit_handler(Raft_get_log(raft, i)->data);
-    }
+    if(new_commit_index <= raft->commit_index) return;
     raft->commit_index = new_commit_index;
+    Raft_publish_view(raft); // wakes the applier up
 }
 
-int Raft_create_snapshot(raft_state_t *raft, int new_log_start) {
-    spinlock_acquire(&raft->lock);
-    if(raft->snapshot_in_progress || raft->n_followers_receiving_snapshots > 0 || new_log_start <= raft->start_log_index || new_log_start > raft->commit_index + 1) {
-	spinlock_release(&raft->lock);
-	return -1;
-    }
-    raft->snapshot_in_progress = 1; // set the flag that the snapshot is in progress
-    spinlock_release(&raft->lock);
-
-    Raft_create_snapshot_dir(raft, new_log_start);
+void Raft_post_timer_work(raft_state_t *raft, int bit) {
+    __atomic_or_fetch(&raft->timer_work, 1u << bit, __ATOMIC_RELEASE);
+    eventcount_signal(&raft->timer_event);
+}
 
-    int prev_snap_id = raft->start_log_index;
-    if(raft->start_log_index != 0) {
-	Raft_copy_snapshot(raft, raft->start_log_index, new_log_start);
-    }
+void Raft_election_timer_fired(void *arg) {
+    Raft_post_timer_work((raft_state_t*)arg, TIMER_WORK_ELECTION);
+}
 
+void Raft_heartbeat_timer_fired(void *arg) {
+    raft_heartbeat_t *heartbeat = (raft_heartbeat_t*)arg;
+    Raft_post_timer_work(heartbeat->raft, heartbeat->follower_id);
+}
 
-    for(int i = raft->start_log_index; i < new_log_start; ++i) {
-	raft_log_entry_t *log = Raft_get_log(raft, i);
-	if(log->type == LEADER_LOG) continue;
-	for(int j = 0; j < MAX_TRANSACTION_ENTRIES; ++j) {
-	    if(log->data[j].filename[0] == 0) break;
-	    Raft_add_to_snapshot(raft, new_log_start, 0, log->data[j].filename, log->data[j].buffer);
+void* Raft_timer_worker_thread(void *arg) {
+    raft_state_t *raft = (raft_state_t*)arg;
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->timer_event);
+	unsigned int work = __atomic_exchange_n(&raft->timer_work, 0, __ATOMIC_ACQ_REL);
+	if(work == 0) {
+	    eventcount_wait(&raft->timer_event, key, -1);
+	    continue;
+	}
+	if(work & (1u << TIMER_WORK_ELECTION)) Raft_handle_election_timeout(raft);
+	for(int id = 0; id <= MAX_SERVER_ID; ++id) {
+	    if(work & (1u << id)) Raft_handle_heartbeat_timer(&raft->heartbeats[id]);
 	}
     }
+    pthread_exit(0);
+}
 
-    spinlock_acquire(&raft->lock);
-    raft->snapshot_in_progress = 0;
-    for(int i = new_log_start; i < raft->log_count; ++i) {
-	raft->log[i - new_log_start] = raft->log[i - raft->start_log_index];
-    }
-    raft->start_log_index = new_log_start;
-    Raft_save_state(raft);
+void Raft_start_timer_worker(raft_state_t *raft) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, Raft_timer_worker_thread, raft);
+    pthread_detach(tid);
+}
 
-    spinlock_release(&raft->lock);
+void* Raft_applier_thread(void *arg) {
+    raft_state_t *raft = (raft_state_t*)arg;
+    raft_log_entry_t *entries[LOG_SEGMENT_SIZE];
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->view_event);
+	spinlock_acquire(&raft->apply_lock);
+	mcslock_acquire(&raft->lock);
+	// a segment at a time: the pointers are taken under the lock, as in Raft_create_snapshot. the committed entries
+	// are not changed, and the log is not compacted past last_applied_index, so they stay valid once the lock is let go
+	int first = raft->last_applied_index + 1;
+	int n = LOG_SEGMENT_SIZE - first % LOG_SEGMENT_SIZE;
+	if(n > raft->commit_index + 1 - first) n = raft->commit_index + 1 - first;
+	if(n <= 0) {
+	    mcslock_release(&raft->lock);
+	    spinlock_release(&raft->apply_lock);
+	    eventcount_wait(&raft->view_event, key, -1);
+	    continue;
+	}
+	for(int i = 0; i < n; ++i) entries[i] = Raft_get_log(raft, first + i);
+	raft_log_mapping_t *mapping = Raft_log_get_mapping(&raft->log, first);
+	if(mapping != NULL) Raft_log_hold_mapping(mapping);
+	raft_lock_state_t lock_state = raft->lock_state;
+	mcslock_release(&raft->lock);
+
+	for(int i = 0; i < n; ++i) {
+	    raft_log_entry_t *log = entries[i];
+	    if(!Raft_apply_lock_entry(&lock_state, first + i, log)) continue;
+	    raft->commit_handler(raft, log->data);
+	    for(int j = 0; j < MAX_TRANSACTION_ENTRIES && log->data[j].filename[0] != 0; ++j) {
+		Raft_update_main_file_size(raft, log->data[j].filename);
+	    }
+	}
 
-    if(prev_snap_id != 0) {
-	Raft_remove_snapshot(raft, prev_snap_id);
+	mcslock_acquire(&raft->lock);
+	if(mapping != NULL) Raft_log_release_mapping(mapping);
+	raft->lock_state = lock_state;
+	raft->last_applied_index = first + n - 1;
+	Raft_publish_view(raft);
+	mcslock_release(&raft->lock);
+	Raft_save_apply_checkpoint(raft, first + n - 1);
+	spinlock_release(&raft->apply_lock);
     }
-    
-    return 0;
+    pthread_exit(0);
 }
 
+void Raft_start_applier(raft_state_t *raft) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, Raft_applier_thread, raft);
+    pthread_detach(tid);
+}
 
 void Raft_handle_response(raft_state_t *raft, raft_response_packet_t *response) {
-    spinlock_acquire(&raft->lock);
+    if(response->pre_vote_term > 0) {
+	// the granted pre-votes come from servers of an earlier term
+	mcslock_acquire(&raft->lock);
+	if(raft->current_term < response->term) {
+	    Raft_convert_to_follower(raft, response->term);
+	    Raft_save_state(raft);
+	} else {
+	    Raft_handle_pre_vote_response(raft, response);
+	}
+	mcslock_release(&raft->lock);
+	return;
+    }
+
+    raft_view_t view;
+    Raft_read_view(raft, &view);
+    if(view.current_term > response->term) return;
+    if(view.state == LEADER && view.current_term == response->term) {
+	// the append responses only need the progress of the follower
+	Raft_handle_append_response(raft, response);
+	return;
+    }
+
+    mcslock_acquire(&raft->lock);
     //printf("	[%i -> %i] responded %i (terms %i -> %i)\n", response->id, raft->id, response->success, response->term, raft->current_term);
     if(raft->current_term > response->term) {
-	spinlock_release(&raft->lock);
+	mcslock_release(&raft->lock);
 	return;
     }
     if(raft->current_term < response->term) {
 	Raft_convert_to_follower(raft, response->term);
 	Raft_save_state(raft);
-	spinlock_release(&raft->lock);
+	mcslock_release(&raft->lock);
 	return;
     }
 
-    raft->last_request_response[response->id] = response->success;
-
     if(raft->state == CANDIDATE) {
 	if(Raft_handle_vote_response(raft, response)) return;	
-    } else if(raft->state == LEADER && response->request_id == raft->last_request_id[response->id]) {
-	if(raft->next_index[response->id] < raft->start_log_index) {
-	    Raft_handle_install_response(raft, response);
-	} else {
-	    Raft_handle_append_response(raft, response);
-	}
+    } else if(raft->state == LEADER) {
+	mcslock_release(&raft->lock);
+	Raft_handle_append_response(raft, response);
+	return;
     }
-    spinlock_release(&raft->lock);
+    mcslock_release(&raft->lock);
 }
 
 void* Raft_handle_packet(void* arg) {
@@ -220,10 +455,18 @@ void* Raft_handle_packet(void* arg) {
 	case INSTALL_SNAPSHOT:
 	    Raft_handle_install_snapshot_request(raft, addr, &packet->data.install_r);
 	    break;
-    }
-
-    if(raft->commit_index - raft->start_log_index + 1 >= COMMITS_TO_SNAPSHOT) {
-	Raft_create_snapshot(raft, raft->start_log_index + SNAPSHOT_SIZE);
+	case INSTALL_SNAPSHOT_RESPONSE:
+	    Raft_handle_install_response(raft, &packet->data.install_response);
+	    break;
+	case TIMEOUT_NOW:
+	    Raft_handle_timeout_now(raft, &packet->data.timeout_now_r);
+	    break;
+	case READ_INDEX:
+	    Raft_handle_read_index_request(raft, addr, &packet->data.read_index_r);
+	    break;
+	case READ_INDEX_RESPONSE:
+	    Raft_handle_read_index_response(raft, &packet->data.read_index_r);
+	    break;
     }
 
     free(arg);
@@ -231,22 +474,26 @@ void* Raft_handle_packet(void* arg) {
 }
 
 void Raft_RPC_listen(raft_state_t *raft) {
+    Raft_RPC_listen_groups(&raft, 1);
+}
+
+void Raft_RPC_listen_groups(raft_state_t **groups, int n_groups) {
     pthread_t req_thread_id;
+    for(int i = 0; i < n_groups; ++i) {
+	Raft_start_timer_worker(groups[i]);
+	Raft_start_applier(groups[i]);
+	Raft_start_snapshot_scheduler(groups[i]);
+    }
     
     //printf("(%i[%i]) starting server\n", raft->id, raft->current_term);
     while(1) {
 	raft_packet_thread_arg_t *arg = malloc(sizeof(raft_packet_thread_arg_t));
 	bzero(arg, sizeof(raft_packet_thread_arg_t));
-	arg->raft = raft;
-	int rc = UDP_Read(raft->rpc_sd, &arg->addr, (char*)&arg->packet, sizeof(raft_packet_t));
-	if(rc < 0 && (errno == ETIMEDOUT || errno == EAGAIN) && raft->state == FOLLOWER) {
-	    //printf("(%i[%i]) follower timeout -- starting election\n", raft->id, raft->current_term);
-	    spinlock_acquire(&raft->lock);
-	    free(arg);
-	    Raft_convert_to_candidate(raft);
-	} else if(rc < 0) {
+	int rc = UDP_Read(groups[0]->rpc_sd, &arg->addr, (char*)&arg->packet, sizeof(raft_packet_t));
+	if(rc < 0 || arg->packet.group < 0 || arg->packet.group >= n_groups) {
 	    free(arg);
 	} else {
+	    arg->raft = groups[arg->packet.group];
 	    pthread_create(&req_thread_id, NULL, Raft_handle_packet, arg);
 	    pthread_detach(req_thread_id);
 	}
@@ -4,20 +4,66 @@
 #include "spinlock.h"
 #include "udp.h"
 #include "packet_format.h"
+#include "timer.h"
 
 #define __RAFT_h__
 
 #define N_SERVERS 5 
 #define MAX_SERVER_ID 10
-
-#define LOG_SIZE 100
+#define MAX_GROUPS 16 // raft groups per server (see Raft_RPC_listen_groups)
+
+#define LOG_SIZE 100 // not a hard limit: the snapshot scheduler tries to keep the log about this size
+#define LOG_RETAIN_SIZE (10*LOG_SIZE) // the leader keeps up to this many entries for the followers catching up
+#define LOG_SEGMENT_SIZE 64
+#define LOG_SLAB_SIZE (256*1024)
+#define LOG_RECLAIM_BATCH 2
+#define LOG_FILE_ENTRIES 4096
+#define LOG_FILE_MAGIC 0x52414654
+#define LOG_WRITE_BATCH 64 // entries the leader writes to the log files per round
 #define MAX_TRANSACTION_ENTRIES 10
+#define MAX_MEMBERS MAX_TRANSACTION_ENTRIES // a configuration entry holds one member per transaction entry
+#define N_MAIN_FILES 100
 
 #define COMMITS_TO_SNAPSHOT 60
 #define SNAPSHOT_SIZE 50
-
-#define ELECTION_TIMEOUT 1000
-#define HEARTBIT_TIME 100
+#define SNAPSHOT_KEEP_ENTRIES (COMMITS_TO_SNAPSHOT - SNAPSHOT_SIZE)
+#define SNAPSHOT_MIN_ENTRIES 10
+#define SNAPSHOT_FILL_TIME 1000
+#define SNAPSHOT_SCHEDULER_INTERVAL 20
+#define SNAPSHOT_GENERATIONS (MAX_MEMBERS + 1)
+
+#define ELECTION_TIMEOUT 1000 // the longest base election timeout, used until the leader measured the round trips
+#define ELECTION_TIMEOUT_MIN 300
+#define ELECTION_RTT_FACTOR 20 // the base election timeout is this many 99th percentile round trips
+#define HEARTBEATS_PER_ELECTION_TIMEOUT 10
+#define HEARTBIT_TIME (ELECTION_TIMEOUT / HEARTBEATS_PER_ELECTION_TIMEOUT)
+#define IDLE_HEARTBEATS_PER_ELECTION_TIMEOUT 4 // to a follower that has everything (see Raft_replicate); within the read lease
+#define RTT_SAMPLES 256 // the latest round trips the percentile is taken over
+#define RTT_MIN_SAMPLES 16
+#define MEMBERSHIP_CHANGE_TIMEOUT (10*ELECTION_TIMEOUT)
+#define TIMER_WORK_ELECTION (MAX_SERVER_ID + 1) // the bit of the election timer in timer_work (the heartbeat timers come first)
+#define LEASE_CLOCK_DRIFT 10 // percent the clocks of two servers may drift apart within a lease (see Raft_has_read_lease)
+
+#define SNAPSHOT_CHUNK_SIZE 32768
+#define SNAPSHOT_WINDOW 32
+#define SNAPSHOT_SACK_BITS 64
+#define SNAPSHOT_RETRANSMIT_TIMEOUT 100
+#define SNAPSHOT_FAST_RETRANSMIT_TIMEOUT 10
+#define SNAPSHOT_TRANSFER_TIMEOUT (10*ELECTION_TIMEOUT)
+#define SNAPSHOT_PROGRESS_INTERVAL (1024*1024)
+
+#define RAFT_SOCKET_BUFFER_SIZE (4*1024*1024)
+
+// flow control of the replication to each follower (see raft_follower_progress_t)
+#define FLOW_WINDOW_MIN 4 // entries in flight
+#define FLOW_WINDOW_MAX 64
+#define FLOW_WINDOW_BYTES (RAFT_SOCKET_BUFFER_SIZE / 8) // in flight to one follower, so that all of them fit in its socket buffer
+#define FLOW_BURST 16 // requests sent to one follower at a time, before the timers of the others run
+#define FLOW_SENT_SLOTS (2*FLOW_WINDOW_MAX) // send times of the latest requests, for the round trips
+
+// admission of new work on the leader (see Raft_admission_delay)
+#define ADMIT_MAX_BACKLOG (2*FLOW_WINDOW_MAX) // entries appended but not yet committed and written by the leader
+#define ADMIT_MAX_RETRY_AFTER 1000 // msec
 
 typedef struct raft_server_configuration {
 	struct sockaddr_in client_socket;
@@ -37,10 +83,14 @@ typedef struct raft_transaction_entry {
 
 typedef struct raft_log_entry {
 	int term;
-	int n_servers_replicated;
 	enum log_entry_type {
 		CLIENT_LOG,
-		LEADER_LOG
+		LEADER_LOG,
+		LOCK_GRANT_LOG,
+		LOCK_EXPIRE_LOG,
+		CONFIG_LOG,
+		LOCK_SHARED_GRANT_LOG,
+		LOCK_SHARED_RELEASE_LOG // released by the shared holder, or its lease expired
 	} type;
 	int id;
 	int client;
@@ -49,18 +99,207 @@ typedef struct raft_log_entry {
 } raft_log_entry_t;
 
 
-typedef void (*raft_commit_handler)(raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]);
+// a server of the cluster configuration (see raft_membership.h)
+typedef struct raft_member {
+	raft_server_configuration_t server;
+	member_role_t role;
+	member_role_t old_role; // in the old configuration of a joint one; the same as role otherwise
+} raft_member_t;
+
+typedef struct raft_membership {
+	int n_members;
+	int joint; // the voters of both the old and the new configuration have to agree
+	raft_member_t members[MAX_MEMBERS];
+} raft_membership_t;
+
+// replicated lock state (see raft_lock.h)
+typedef struct raft_lock_state {
+	int holder; // client id, -1 if the lock is free
+	int token; // fencing token of the holder: the index of the entry that granted the lock
+	unsigned char shared[(MAX_ID + 7) / 8]; // bitmap of the clients holding the lock shared
+} raft_lock_state_t;
+
+// header of a log file record; the entry follows it
+typedef struct raft_log_record_header {
+	int index;
+	int size;
+	unsigned int crc; // CRC32C of index, size, and the entry
+	int padding;
+} raft_log_record_header_t;
+
+// a sealed log file mapped to memory; its entries are read in place
+typedef struct raft_log_mapping {
+	char *addr;
+	long size;
+	long *offsets;
+	int first_index;
+	int n_entries;
+	int refcount;
+} raft_log_mapping_t;
+
+// segmented in-memory log (see raft_log.h)
+//		entry i is stored in segment i / LOG_SEGMENT_SIZE, and segment s is kept at segments[s % capacity]
+//		an entry missing from entries[] is read from the mapping (if any)
+typedef struct raft_log_segment {
+	raft_log_entry_t *entries[LOG_SEGMENT_SIZE];
+	raft_log_mapping_t *mapping;
+	struct raft_log_segment *next_free;
+} raft_log_segment_t;
+
+typedef struct raft_log {
+	raft_log_segment_t **segments;
+	int capacity;
+	int first_segment;
+	int n_segments;
+	int start_index;
+	int reclaim_index; // entries in [reclaim_index, start_index) are truncated, but not freed yet
+	raft_log_segment_t *free_segments;
+	void *free_entries[MAX_TRANSACTION_ENTRIES+1]; // slab free lists, one per number of transaction entries
+} raft_log_t;
+
+// the log file being appended to (see raft_storage_manager.h)
+//		file log_<k> holds the entries of [k, k + LOG_FILE_ENTRIES) for k divisible by LOG_FILE_ENTRIES
+typedef struct raft_log_file {
+	int base; // k of the file, -1 if there is none (the last one is sealed)
+	int first_index;
+	int n_entries;
+	long size;
+	long *offsets;
+	int oldest_base; // k of the oldest log file
+	int end_index; // all the entries before it are in the log files
+} raft_log_file_t;
+
+// per-follower state of a snapshot transfer (leaders only)
+//		active is protected by the raft lock, all the other fields by the transfer lock
+typedef struct raft_snapshot_transfer {
+	spinlock_t lock;
+	int active;
+	int snapshot_id;
+	int acked_seq;
+	long acked_offset;
+	unsigned long long sack;
+	unsigned int checksum;
+	int n_acks;
+	int done;
+	int failed;
+	long last_ack_time;
+	eventcount_t acked; // signaled by every response; the sender parks on it between the retransmits
+} raft_snapshot_transfer_t;
+
+// a snapshot retained on disk (see raft_snapshot_scheduler.h)
+typedef struct raft_snapshot_generation {
+	int snapshot_id;
+	int refcount;
+	raft_lock_state_t lock_state;
+	raft_membership_t membership;
+} raft_snapshot_generation_t;
+
+// progress of the snapshot install (followers only); the contiguous prefix of the stream
+// is persisted every SNAPSHOT_PROGRESS_INTERVAL bytes, so that the install can be resumed after a restart
+typedef struct raft_install_progress {
+	int snapshot_id;
+	int seq;
+	long offset;
+	unsigned int checksum;
+} raft_install_progress_t;
+
+// the state of the main files after the entries up to applied_index were applied (see raft_storage_manager.h)
+typedef struct raft_apply_checkpoint {
+	int applied_index;
+	raft_lock_state_t lock_state;
+	long file_size[N_MAIN_FILES];
+} raft_apply_checkpoint_t;
+
+// the part of raft_state_t that is saved to the raft_state file: the term and the vote, and the snapshot the log starts
+// after (the log itself is in the log files). everything else is rebuilt when the server restarts
+typedef struct raft_persistent_state {
+	int id;
+	int group;
+	int current_term;
+	int voted_for;
+	int start_log_index;
+	raft_lock_state_t snapshot_lock_state;
+	raft_membership_t snapshot_membership;
+} raft_persistent_state_t;
+
+typedef enum replication_state {
+	REPLICATION_PROBE, // one request per round trip, until one matches the follower's log
+	REPLICATION_PIPELINE, // the entries are sent without waiting for the responses, up to the window
+	REPLICATION_SNAPSHOT // the follower is behind the log: the snapshot sender talks to it
+} replication_state_t;
+
+// send time of an append request
+typedef struct raft_sent_request {
+	int request_id;
+	long time; // usec
+} raft_sent_request_t;
+
+// progress of the replication to one follower (leaders only), protected by its own lock;
+// it is taken after the raft lock when both are needed
+//		in the pipeline state, the entries of [match_index + 1, next_index) are in flight: at most window of them,
+//		and at most FLOW_WINDOW_BYTES. the window grows by the entries each response acknowledges, and is halved
+//		when the follower rejects a request or stops acknowledging (a loss); the replication then restarts
+//		from match_index + 1
+typedef struct raft_follower_progress {
+	spinlock_t lock;
+	int term; // of the leader that reset it; the responses of the other terms are dropped (see Raft_handle_append_response)
+	replication_state_t state;
+	int next_index;
+	int match_index;
+	int window;
+	long progress_time; // msec, when match_index last advanced in the pipeline state (or it was entered)
+	int last_request_id; // of the last request sent; every request gets a new one
+	int acked_request_id; // the highest one the follower responded to
+	long last_send_time; // usec, of the last request sent
+	int sent_commit_index; // the leader's commit index in the last request sent
+	int commit_index; // the follower's, from its latest response
+	raft_sent_request_t sent[FLOW_SENT_SLOTS]; // request i at i % FLOW_SENT_SLOTS
+	long last_response_time; // of the last append response in the term (see Raft_check_quorum)
+	long ack_request_time; // usec, when the latest request the follower responded to was sent (see Raft_update_quorum_contact)
+} raft_follower_progress_t;
+
+// round trips of the append requests, measured by the leader (see Raft_update_timeouts)
+typedef struct raft_rtt_stats {
+	spinlock_t lock;
+	long samples[RTT_SAMPLES]; // usec, a ring: sample i is at i % RTT_SAMPLES
+	int n_samples;
+} raft_rtt_stats_t;
+
+// the read-mostly part of the state, published for the readers that do not take the raft lock (see Raft_read_view)
+typedef struct raft_view {
+	int state;
+	int current_term;
+	int leader_id; // -1 if not known
+	int commit_index; // the last applied entry: the entries up to it are committed, and the main files have them
+	int commit_term; // term of the entry at commit_index, -1 if it is compacted
+	int transfer_target; // the server the leadership is being transferred to, -1 if none
+	long synced_time; // msec, when the commit index last caught up with the leader's (see Raft_get_staleness), 0 if never
+} raft_view_t;
+
+// heartbeat timer of the leader for one follower (see raft_leader.h)
+typedef struct raft_heartbeat {
+	struct raft_state *raft;
+	int follower_id;
+	struct sockaddr_in addr;
+	wheel_timer_t timer;
+} raft_heartbeat_t;
+
+typedef void (*raft_commit_handler)(struct raft_state *raft, raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]);
 
 typedef struct raft_state {
 	// persistent state (updated on stable storage)
-	raft_configuration_t config;
 	int id;
+	int group; // the raft group (see Raft_RPC_listen_groups)
 	int current_term;
 	int voted_for;
-	raft_log_entry_t log[LOG_SIZE];
+	raft_log_t log;
+	raft_log_file_t log_file;
 	int start_log_index;
+	raft_lock_state_t snapshot_lock_state; // the lock state of the snapshot (after the entries before start_log_index)
+	raft_membership_t snapshot_membership; // the configuration of the snapshot
 	int log_count;
 	char files_dir[256];
+	raft_persistent_state_t saved_state; // as last saved (see Raft_save_state)
 
 	// volatile state on all servers
 	enum node_state {
@@ -68,64 +307,152 @@ typedef struct raft_state {
 		CANDIDATE,
 		FOLLOWER
 	} state;
-	int rpc_sd;
-	spinlock_t lock;
+	int rpc_sd; // shared by the groups of the server
+	mcslock_t lock;
+	spinlock_t wal_lock; // the log files are changed with it held; taken after the raft lock
+	int wal_term; // the term of the leader while it writes its entries without the raft lock, -1 if not the leader
+	int leader_id; // -1 if not known
+	seqlock_t view_lock; // written under the raft lock
+	raft_view_t view;
+	eventcount_t view_event; // advanced when the view is published, a majority is heard from, or a read index comes back
+	// the read index requests the follower sends to the leader (see Raft_forward_read_index)
+	int forward_request_id; // of the latest one sent; accessed atomically
+	spinlock_t forward_lock;
+	int forward_answer_id; // of the latest one answered
+	int forward_answer_index; // the answer to it
 	raft_commit_handler commit_handler;
+	raft_membership_t membership; // the latest configuration in the log, committed or not
+	int membership_index; // of its entry, start_log_index - 1 if it is the one of the snapshot
 	int commit_index;
-	int last_applied_index;
+	int last_applied_index; // the applier applies the entries up to commit_index after it (see Raft_start_applier)
+	spinlock_t apply_lock; // held by the applier while it applies without the raft lock; taken before the raft lock
+	raft_lock_state_t lock_state; // after the entries up to last_applied_index
+	raft_apply_checkpoint_t apply_checkpoint;
 	int snapshot_in_progress;
+	raft_snapshot_generation_t snapshots[SNAPSHOT_GENERATIONS];
+	wheel_timer_t election_timer; // the election timeout, or the quorum check on the leader
+	// the timers only post their work on the wheel thread, and the timer worker runs it (see Raft_start_timer_worker)
+	unsigned int timer_work; // bit i: the heartbeat timer of server i fired, bit TIMER_WORK_ELECTION: the election timer; accessed atomically
+	eventcount_t timer_event;
+	long last_leader_contact; // time of the last request from the leader
+	long synced_time; // msec, when an append from the leader last found the commit index up to its own
+	int election_timeout; // the base election timeout: the leader's, taken over by its followers
+	unsigned long long random_state; // see Raft_random
 
-	int install_snapshot_index;
 	int install_snapshot_id;
+	int install_snapshot_seq;
+	long install_snapshot_offset;
+	unsigned int install_snapshot_checksum;
+	long install_snapshot_saved_offset;
+	unsigned long long install_snapshot_sack;
+	int install_snapshot_sack_len[SNAPSHOT_SACK_BITS];
+	unsigned int install_snapshot_sack_checksum[SNAPSHOT_SACK_BITS];
 
 	// volatile state on candidates (initialized at the start of an election)
-	int nvoted;
-	int nblocked;
+	unsigned int votes; // bit i is set if server i granted the vote
+	unsigned int blocked; // bit i is set if server i has a more up-to-date log
+	int pre_vote_term; // the term proposed by the pre-vote in progress, -1 if none
+	unsigned int pre_votes;
 
 	// volatile state on leaders (initialized after an election)
-	int next_index[MAX_SERVER_ID+1];
-	int match_index[MAX_SERVER_ID+1];
-	int last_request_id[MAX_SERVER_ID+1];
-	int last_request_response[MAX_SERVER_ID+1];
-	int n_followers_receiving_snapshots;
+	int durable_index; // the entries up to it are in the log files
+	int transfer_target; // the follower the leadership is being transferred to, -1 if none (see Raft_transfer_leadership)
+	long transfer_deadline;
+	int heartbeat_interval;
+	long lease_expiry; // usec, the reads are served locally until then; accessed atomically
+	long lease_barrier; // usec, the requests sent before it do not extend the lease; accessed atomically
+	long quorum_contact_time; // usec, a majority responded to requests sent after it; accessed atomically
+	long read_request_time; // usec, of the latest read waiting for a heartbeat round (see Raft_read_index); accessed atomically
+	raft_rtt_stats_t rtt;
+	raft_follower_progress_t progress[MAX_SERVER_ID+1];
+	raft_snapshot_transfer_t snapshot_transfer[MAX_SERVER_ID+1];
+	raft_heartbeat_t heartbeats[MAX_SERVER_ID+1];
 } raft_state_t;
 
+// the entry is the last field: only its meaningful part is sent
 typedef struct raft_append_request {
 	int term;
 	int leader_id;
 	int prev_log_index;
 	int prev_log_term;
-	raft_log_entry_t entry;
 	int entries_n;
 	int leader_commit;
 	int request_id;
+	int election_timeout; // the base election timeout of the leader
+	raft_log_entry_t entry;
 } raft_append_request_t;
 
+// tells the follower to start an election right away (the last step of a leadership transfer)
+typedef struct raft_timeout_now {
+	int term;
+	int leader_id;
+} raft_timeout_now_t;
+
+// a follower asks the leader to confirm its commit index for a read (see Raft_forward_read_index);
+// the leader answers to the raft socket the request came from
+typedef struct raft_read_index {
+	int term;
+	int index; // of the answer: the confirmed commit index, -1 if the leader could not confirm it
+	int request_id; // chosen by the follower, and sent back with the answer
+} raft_read_index_t;
+
+// a pre-vote asks whether the vote would be granted in term, without anyone changing its term
 typedef struct raft_vote_request {
 	int term;
 	int candidate_id;
 	int last_log_index;
 	int last_log_term;
+	int pre_vote;
 } raft_vote_request_t;
 
+// one chunk of the snapshot stream: the snapshot files are concatenated in order,
+// and each file is split into chunks of at most SNAPSHOT_CHUNK_SIZE bytes
+// a probe carries no data and asks the follower for its install progress (restart discards the progress)
 typedef struct raft_install_snapshot_request {
 	int term;
 	int leader_id;
 	int snapshot_id;
-	int index;
+	int seq;
+	int n_chunks;
 	int done;
-	int request_id;
+	int probe;
+	int restart;
+	long offset;
+	long file_offset;
+	int len;
+	unsigned int crc; // CRC32C of the buffer
+	raft_lock_state_t lock_state; // of the snapshot
+	raft_membership_t membership; // of the snapshot
 
 	char filename[256];
-	char buffer[BUFFER_SIZE];
+	char buffer[SNAPSHOT_CHUNK_SIZE];
 } raft_install_snapshot_request_t;
 
+// acknowledges the first next_seq chunks (offset bytes) of the snapshot stream;
+// bit i of sack is set if chunk next_seq+1+i was received out of order.
+// checksum is the chained checksum of the acknowledged chunks (see Raft_chain_checksum)
+typedef struct raft_install_snapshot_response {
+	int id;
+	int term;
+	int snapshot_id;
+	int success;
+	int done;
+	int next_seq;
+	long offset;
+	unsigned long long sack;
+	unsigned int checksum;
+} raft_install_snapshot_response_t;
+
 
 typedef enum request_type {
 	APPEND,
 	VOTE,
 	INSTALL_SNAPSHOT,
-	RESPONSE
+	RESPONSE,
+	INSTALL_SNAPSHOT_RESPONSE,
+	TIMEOUT_NOW,
+	READ_INDEX,
+	READ_INDEX_RESPONSE
 } request_type_t;
 
 typedef struct raft_response_packet {
@@ -134,29 +461,122 @@ typedef struct raft_response_packet {
 	int success;
 
 	int request_id;
+	int match_index; // append responses: the last index known to match the leader's log
+	int last_log_index; // rejected append requests: the last index of the follower's log, so the leader can skip ahead
+	int commit_index; // append responses: the commit index of the follower
+	int pre_vote_term; // pre-vote responses: the term proposed by the pre-vote; 0 for the other responses
 } raft_response_packet_t;
 
 typedef struct raft_packet {
 	request_type_t request_type;
+	int group; // the packets of all the groups of a server come to the same socket
 	union data {
 		raft_append_request_t append_r;
 		raft_vote_request_t vote_r;
 		raft_install_snapshot_request_t install_r;
 		raft_response_packet_t response;
+		raft_install_snapshot_response_t install_response;
+		raft_timeout_now_t timeout_now_r;
+		raft_read_index_t read_index_r;
 	} data;
 } raft_packet_t;
 
 
+// open_socket()
+// opens the raft socket of a server on the port
+int Raft_open_socket(int port);
+
 void Raft_server_restore(raft_state_t *raft, char filedir[256], raft_commit_handler commit_handler, int id, int port);
 
 void Raft_server_init(raft_state_t *raft, raft_configuration_t config, char filedir[256], raft_commit_handler commit_handler, int id, int port);
 
+// server_init_group(), server_restore_group()
+// one of several raft groups hosted by the server: each has its own log, state, and files_dir, and they all
+// send from the raft socket sd (see Raft_open_socket); the server above is group 0 on its own socket
+void Raft_server_init_group(raft_state_t *raft, raft_configuration_t config, char filedir[256], raft_commit_handler commit_handler, int id, int group, int sd);
+
+void Raft_server_restore_group(raft_state_t *raft, char filedir[256], raft_commit_handler commit_handler, int id, int group, int sd);
+
 void Raft_RPC_listen(raft_state_t *raft);
 
-int Raft_append_entry(raft_state_t *raft, raft_log_entry_t *log); 
+// RPC_listen_groups()
+// receives the packets of all the groups of the server on their shared socket and hands each one to its group:
+// groups[i] is group i. the groups share the handler threads and the timers as well
+void Raft_RPC_listen_groups(raft_state_t **groups, int n_groups);
 
-int Raft_is_entry_committed(raft_state_t *raft, int term, int id);
+// append_entry()
+// appends the entry to the log of the leader; returns its index, or -1 if this server is not the leader (or it is transferring the leadership)
+int Raft_append_entry(raft_state_t *raft, raft_log_entry_t *log); 
 
+// admission_delay()
+// the new work (e.g. a lock grant) the leader should not take yet: returns 0 if an entry can be appended, or msec after which
+// it should be asked again if the backlog of the log (the entries not yet applied, or not yet written by the leader)
+// is over ADMIT_MAX_BACKLOG. the entries that finish work (a release) are always appended
+int Raft_admission_delay(raft_state_t *raft);
+
+// transfer_leadership()
+// hands the leadership over to the follower (the most up-to-date one if target_id is -1): the leader stops
+// taking new client requests, brings the follower up to date, and tells it to start an election right away.
+// returns 0 once this server is not the leader anymore, or -1 if it was not the leader or the transfer timed out
+int Raft_transfer_leadership(raft_state_t *raft, int target_id);
+
+// is_live_voter()
+// on the leader: returns 1 if the server is a voter of the configuration that responded within an election timeout
+int Raft_is_live_voter(raft_state_t *raft, int id);
+
+// has_read_lease()
+// returns 1 if the leader can serve a read from its own state without a log round trip: a majority acknowledged
+// requests sent less than ELECTION_TIMEOUT_MIN ago (shortened by LEASE_CLOCK_DRIFT), and none of them grants a pre-vote
+// before an election timeout passes since, so no other leader can have been elected yet. does not take the raft lock
+int Raft_has_read_lease(raft_state_t *raft);
+
+// read_index()
+// confirms the leadership without the clocks: the commit index is recorded, and a majority has to respond to
+// heartbeats sent after that. the reads that come in while a round is in flight share the next one.
+// returns the commit index once confirmed and its entries are applied, or -1 if this server is not the leader
+// of a term with a committed entry
+int Raft_read_index(raft_state_t *raft);
+
+// forward_read_index()
+// the read index for a follower: asks the leader for it (see Raft_read_index), and waits until the entries up to it
+// are applied here too. returns it, or -1 if the leader is not known or did not answer within an election timeout
+int Raft_forward_read_index(raft_state_t *raft);
+
+// get_staleness()
+// msec since this server was last known to have applied every committed entry: since the follower caught up with
+// the commit index of the leader, or since a majority last heard from the leader. -1 if never
+long Raft_get_staleness(raft_state_t *raft);
+
+// returns 1 if the entry of this term at the index is committed and applied, -1 if it was replaced by another one, 0 if not known yet
+int Raft_is_entry_committed(raft_state_t *raft, int index, int term);
+
+// commit_update()
+// advances the commit index and wakes the applier up; the raft lock must be held
 void Raft_commit_update(raft_state_t *raft, int new_commit_index);
 
+// election_timer_fired(), heartbeat_timer_fired()
+// the handlers of the raft timers on the wheel thread: they post the work to the timer worker of the group
+void Raft_election_timer_fired(void *arg);
+void Raft_heartbeat_timer_fired(void *arg);
+
+// start_timer_worker()
+// starts the thread that runs the election timeout and the heartbeats of the group when their timers fire.
+// the wheel thread is shared by all the groups and by the lock leases, and these take the raft lock, which is held
+// across disk writes: on the wheel thread, one slow group would hold up the timers of all the others
+void Raft_start_timer_worker(raft_state_t *raft);
+
+// start_applier()
+// starts the thread that applies the committed entries to the lock state and (with the commit handler) to the main files,
+// and saves the apply checkpoint after them. it applies a segment of the log at a time without the raft lock held,
+// and publishes the view once they are applied
+void Raft_start_applier(raft_state_t *raft);
+
+// publish_view()
+// publishes the role, term, leader and commit index; the raft lock must be held, and it must be called whenever any of them changes
+void Raft_publish_view(raft_state_t *raft);
+
+// read_view()
+// copies the published view without taking the raft lock
+void Raft_read_view(raft_state_t *raft, raft_view_t *view);
+
 #endif
@@ -4,69 +4,160 @@
 #include "raft_storage_manager.h"
 #include "raft_follower.h"
 #include "raft_leader.h"
+#include "raft_membership.h"
 
-#include <pthread.h>
+#include <stdlib.h>
 
-int Raft_attempt_to_elect(raft_state_t *raft) {
-    // the lock must be held before calling that function!!!!!!
-    raft->current_term ++;
-    raft->voted_for = raft->id;
-    raft->state = CANDIDATE;
-    raft->nvoted = 1;
-    raft->nblocked = 0;
-    Raft_save_state(raft);
-    
+void Raft_reset_election_timer(raft_state_t *raft) {
+    // randomized in [T, 1.5T), so that the servers rarely time out together
+    timer_set(&raft->election_timer, raft->election_timeout + Raft_random(raft) % (raft->election_timeout / 2));
+}
+
+void Raft_send_vote_requests(raft_state_t *raft, int term, int pre_vote) {
     raft_packet_t packet;
     bzero(&packet, sizeof(packet));
     packet.request_type = VOTE;
-    packet.data.vote_r.term = raft->current_term;
+    packet.data.vote_r.term = term;
     packet.data.vote_r.candidate_id = raft->id;
     packet.data.vote_r.last_log_index = raft->log_count-1; 
     packet.data.vote_r.last_log_term = Raft_get_log_term(raft, raft->log_count-1);
+    packet.data.vote_r.pre_vote = pre_vote;
 
-    for(int i = 0; i < N_SERVERS; ++i) {
-	if(raft->config.servers[i].id == raft->id) continue;
-	UDP_Write(raft->rpc_sd, &raft->config.servers[i].raft_socket, (char*)&packet, sizeof(packet));
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	raft_member_t *member = &raft->membership.members[i];
+	if(member->server.id == raft->id || !Raft_is_voter(&raft->membership, member->server.id)) continue;
+	Raft_send_packet(raft, &member->server.raft_socket, &packet);
     }
+}
 
-    spinlock_release(&raft->lock);
-
-    clock_t election_start = clock();
-    //printf("(%i[%i]) about to start loop\n", raft->id, raft->current_term);
-    int timeout = ELECTION_TIMEOUT + (rand() % 100);
-    while(1) {
-	spinlock_acquire(&raft->lock);
-	if(raft->state != CANDIDATE) {
-	    //printf("(%i[%i]) not a candidate anymore\n", raft->id, raft->current_term);
-	    spinlock_release(&raft->lock);
-	    return 0;
-	}
-	clock_t time_diff = clock() - election_start;
-	int time_diff_msec = time_diff * 1000 / CLOCKS_PER_SEC;
-	if(time_diff_msec > timeout && raft->nblocked*2 < N_SERVERS) {
-	    //printf("(%i[%i]) vote timeout -- restarting election\n", raft->id, raft->current_term);
-	    return -1;
-	}
-	spinlock_release(&raft->lock);
-	sched_yield();
+void Raft_start_pre_vote(raft_state_t *raft) {
+    raft->pre_vote_term = raft->current_term + 1;
+    raft->pre_votes = 1u << raft->id;
+    Raft_send_vote_requests(raft, raft->pre_vote_term, 1);
+
+    // the pre-vote is restarted if it is not won by the timeout
+    Raft_reset_election_timer(raft);
+}
+
+void Raft_attempt_to_elect(raft_state_t *raft) {
+    // the lock must be held before calling that function!!!!!!
+    raft->current_term ++;
+    raft->voted_for = raft->id;
+    raft->state = CANDIDATE;
+    raft->leader_id = -1;
+    Raft_publish_view(raft);
+    raft->votes = 1u << raft->id;
+    raft->blocked = 0;
+    raft->pre_vote_term = -1;
+    Raft_save_state(raft);
+    
+    Raft_send_vote_requests(raft, raft->current_term, 0);
+
+    // the election is restarted if it is not won by the timeout
+    Raft_reset_election_timer(raft);
+}
+
+int Raft_is_alive(raft_state_t *raft, int id) {
+    long now = Raft_get_time_msec();
+    spinlock_acquire(&raft->progress[id].lock);
+    int alive = now - raft->progress[id].last_response_time < raft->election_timeout;
+    spinlock_release(&raft->progress[id].lock);
+
+    // a follower receiving a snapshot acknowledges the chunks instead
+    raft_snapshot_transfer_t *transfer = &raft->snapshot_transfer[id];
+    spinlock_acquire(&transfer->lock);
+    if(raft->snapshot_transfer[id].active && now - transfer->last_ack_time < raft->election_timeout) alive = 1;
+    spinlock_release(&transfer->lock);
+    return alive;
+}
+
+int Raft_is_live_voter(raft_state_t *raft, int id) {
+    if(id < 0 || id > MAX_SERVER_ID) return 0;
+    mcslock_acquire(&raft->lock);
+    int live = raft->state == LEADER && Raft_is_voter(&raft->membership, id) && (id == raft->id || Raft_is_alive(raft, id));
+    mcslock_release(&raft->lock);
+    return live;
+}
+
+int Raft_check_quorum(raft_state_t *raft) {
+    unsigned int alive_ids = 1u << raft->id;
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int id = raft->membership.members[i].server.id;
+	if(id != raft->id && Raft_is_alive(raft, id)) alive_ids |= 1u << id;
     }
+    return Raft_is_quorum(&raft->membership, alive_ids);
 }
 
-void* Raft_election_thread(void* arg) {
+void Raft_handle_election_timeout(void *arg) {
     raft_state_t *raft = (raft_state_t*)arg;
-    while(Raft_attempt_to_elect(raft) != 0);
-    pthread_exit(0);
+    mcslock_acquire(&raft->lock);
+    if(raft->state == LEADER) {
+	if(raft->transfer_target != -1 && Raft_get_time_msec() > raft->transfer_deadline) {
+	    printf("(%i[%i]) the leadership transfer to %i timed out\n", raft->id, raft->current_term, raft->transfer_target);
+	    raft->transfer_target = -1;
+	    Raft_publish_view(raft);
+	}
+	if(Raft_check_quorum(raft)) {
+	    Raft_update_timeouts(raft);
+	    timer_set(&raft->election_timer, raft->election_timeout);
+	} else {
+	    // the leader is probably partitioned from the majority, which elects a new one anyway
+	    printf("(%i[%i]) no response from a majority -- stepping down\n", raft->id, raft->current_term);
+	    Raft_convert_to_follower(raft, raft->current_term);
+	}
+	mcslock_release(&raft->lock);
+	return;
+    }
+    if(!Raft_is_voter(&raft->membership, raft->id)) {
+	// learners (and the servers not in the configuration) never start an election
+	Raft_reset_election_timer(raft);
+	mcslock_release(&raft->lock);
+	return;
+    }
+    if(raft->state == CANDIDATE && Raft_is_quorum(&raft->membership, raft->blocked)) {
+	// a majority has more up-to-date logs than we do: wait for one of them to be elected
+	Raft_reset_election_timer(raft);
+	mcslock_release(&raft->lock);
+	return;
+    }
+    //printf("(%i[%i]) election timeout -- starting pre-vote\n", raft->id, raft->current_term);
+    Raft_start_pre_vote(raft);
+    mcslock_release(&raft->lock);
 }
 
-void Raft_convert_to_candidate(raft_state_t *raft) {
-    pthread_t tid;
-    pthread_create(&tid, NULL, Raft_election_thread, raft);
-    pthread_detach(tid);
-}
 
+// the pre-vote is granted if the vote would be, and no leader was heard from within an election timeout:
+// a server that only lost touch with a healthy leader does not get to depose it
+void Raft_handle_pre_vote_request(raft_state_t *raft, struct sockaddr_in *addr, raft_vote_request_t *vote_r) {
+    raft_packet_t packet;
+    bzero(&packet, sizeof(raft_packet_t));
+    packet.request_type = RESPONSE;
+    packet.data.response.id = raft->id;
+    packet.data.response.success = 0;
+    packet.data.response.request_id = -1;
+    packet.data.response.match_index = -1;
+    packet.data.response.pre_vote_term = vote_r->term;
+
+    mcslock_acquire(&raft->lock);
+    packet.data.response.term = raft->current_term;
+    int leader_alive = raft->state == LEADER || Raft_get_time_msec() - raft->last_leader_contact < raft->election_timeout;
+    int last_log_term = Raft_get_log_term(raft, raft->log_count - 1); 
+    int last_log_index = raft->log_count - 1; 
+    if(vote_r->term > raft->current_term && !leader_alive && (vote_r->last_log_term > last_log_term ||
+		(vote_r->last_log_term == last_log_term && vote_r->last_log_index >= last_log_index))) {
+	packet.data.response.success = 1;
+    }
+
+    mcslock_release(&raft->lock);
+    Raft_send_packet(raft, addr, &packet);
+}
 
 void Raft_handle_vote_request(raft_state_t *raft, struct sockaddr_in *addr, raft_vote_request_t *vote_r) {
-    spinlock_acquire(&raft->lock);
+    if(vote_r->pre_vote) {
+	Raft_handle_pre_vote_request(raft, addr, vote_r);
+	return;
+    }
+    mcslock_acquire(&raft->lock);
 
     //printf("	[%i -> %i] request vote\n", vote_r->candidate_id, raft->id);
     if(raft->current_term < vote_r->term) {
@@ -81,6 +172,7 @@ void Raft_handle_vote_request(raft_state_t *raft, struct sockaddr_in *addr, raft
     packet.data.response.term = raft->current_term;
     packet.data.response.success = 0;
     packet.data.response.request_id = -1;
+    packet.data.response.match_index = -1;
     
     if(raft->current_term == vote_r->term && raft->voted_for == -1) {
 	int last_log_term = Raft_get_log_term(raft, raft->log_count - 1); 
@@ -88,26 +180,28 @@ void Raft_handle_vote_request(raft_state_t *raft, struct sockaddr_in *addr, raft
 	if(vote_r->last_log_term > last_log_term) {
 	    packet.data.response.success = 1;
 	    raft->voted_for = vote_r->candidate_id;
+	    Raft_reset_election_timer(raft);
 	} else if(vote_r->last_log_term == last_log_term && vote_r->last_log_index >= last_log_index) {
 	    packet.data.response.success = 1;
 	    raft->voted_for = vote_r->candidate_id;
+	    Raft_reset_election_timer(raft);
 	} else {
 	    packet.data.response.success = -1;
 	}
 	Raft_save_state(raft);
     }
 
-    UDP_Write(raft->rpc_sd, addr, (char*)&packet, sizeof(raft_packet_t));
-
-    spinlock_release(&raft->lock);
+    mcslock_release(&raft->lock);
+    Raft_send_packet(raft, addr, &packet);
 }
 
 int Raft_handle_vote_response(raft_state_t *raft, raft_response_packet_t *response) {
+    if(response->id < 0 || response->id > MAX_SERVER_ID) return 0;
     if(response->success <= 0) {
-	if(response->success == -1) raft->nblocked ++;
+	if(response->success == -1) raft->blocked |= 1u << response->id;
     } else {
-	raft->nvoted ++;
-	if(raft->nvoted*2 > N_SERVERS) {
+	raft->votes |= 1u << response->id;
+	if(Raft_is_quorum(&raft->membership, raft->votes)) {
 	    Raft_convert_to_leader(raft);
 	    return 1;
 	}
@@ -115,3 +209,11 @@ int Raft_handle_vote_response(raft_state_t *raft, raft_response_packet_t *respon
     return 0;
 }
 
+void Raft_handle_pre_vote_response(raft_state_t *raft, raft_response_packet_t *response) {
+    if(response->success != 1 || raft->state == LEADER || response->pre_vote_term != raft->pre_vote_term) return;
+    if(response->id < 0 || response->id > MAX_SERVER_ID) return;
+    raft->pre_votes |= 1u << response->id;
+    if(Raft_is_quorum(&raft->membership, raft->pre_votes)) {
+	Raft_attempt_to_elect(raft);
+    }
+}
@@ -3,10 +3,36 @@
 
 #include "raft.h"
 
-void Raft_convert_to_candidate(raft_state_t *raft);
+// reset_election_timer()
+// (re)starts the election timeout: a follower or a candidate that does not hear from a leader until it runs out starts a pre-vote
+void Raft_reset_election_timer(raft_state_t *raft);
+
+// attempt_to_elect()
+// starts an election in the next term; the raft lock must be held
+void Raft_attempt_to_elect(raft_state_t *raft);
+
+// start_pre_vote()
+// asks the others whether they would vote for us in the next term; the term is only incremented,
+// and the election started, once a majority would (so a server that was cut off does not disrupt the cluster when it is back)
+void Raft_start_pre_vote(raft_state_t *raft);
+
+// is_alive()
+// on the leader: returns 1 if the follower responded within the last election timeout
+int Raft_is_alive(raft_state_t *raft, int id);
+
+// check_quorum()
+// returns 1 if a majority (the leader included) responded within the last election timeout
+int Raft_check_quorum(raft_state_t *raft);
+
+// election timer handler (run by the timer worker); on the leader, it steps down if check_quorum fails
+void Raft_handle_election_timeout(void *arg);
 
 void Raft_handle_vote_request(raft_state_t *raft, struct sockaddr_in *addr, raft_vote_request_t *vote_r);
 
 int Raft_handle_vote_response(raft_state_t *raft, raft_response_packet_t *response); 
 
+// handle_pre_vote_response()
+// starts the election once a majority granted the pre-vote; the raft lock must be held
+void Raft_handle_pre_vote_response(raft_state_t *raft, raft_response_packet_t *response);
+
 #endif
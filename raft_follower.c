@@ -1,29 +1,93 @@
 #include "raft.h"
 #include "raft_follower.h"
+#include "raft_candidate.h"
 #include "raft_utils.h"
+#include "raft_log.h"
 #include "raft_storage_manager.h"
+#include "raft_snapshot_scheduler.h"
+#include "raft_membership.h"
+
+void Raft_reset_snapshot_install(raft_state_t *raft) {
+    raft->install_snapshot_id = -1;
+    raft->install_snapshot_seq = 0;
+    raft->install_snapshot_offset = 0;
+    raft->install_snapshot_checksum = 0;
+    raft->install_snapshot_saved_offset = 0;
+    raft->install_snapshot_sack = 0;
+}
+
+void Raft_begin_snapshot_install(raft_state_t *raft, int snapshot_id) {
+    Raft_discard_snapshot_install(raft);
+    Raft_remove_snapshot(raft, snapshot_id);
+    Raft_create_snapshot_dir(raft, snapshot_id);
+    raft->install_snapshot_id = snapshot_id;
+    Raft_save_install_progress(raft);
+}
+
+void Raft_discard_snapshot_install(raft_state_t *raft) {
+    if(raft->install_snapshot_id == -1) return;
+    Raft_remove_snapshot(raft, raft->install_snapshot_id);
+    Raft_reset_snapshot_install(raft);
+    Raft_save_install_progress(raft);
+}
+
+void Raft_restore_snapshot_install(raft_state_t *raft) {
+    Raft_reset_snapshot_install(raft);
+
+    raft_install_progress_t progress;
+    if(Raft_load_install_progress(raft, &progress) != 0) return;
+    if(progress.snapshot_id <= raft->start_log_index) {
+	// the install was completed before the crash
+	Raft_save_install_progress(raft);
+	return;
+    }
+
+    raft->install_snapshot_id = progress.snapshot_id;
+    raft->install_snapshot_seq = progress.seq;
+    raft->install_snapshot_offset = progress.offset;
+    raft->install_snapshot_checksum = progress.checksum;
+    raft->install_snapshot_saved_offset = progress.offset;
+    printf("(%i) resuming install of snapshot %i from byte %li\n", raft->id, progress.snapshot_id, progress.offset);
+}
 
 void Raft_convert_to_follower(raft_state_t *raft, int term) {
+    // a former leader finishes writing its entries: the log files of the others have all the log
+    spinlock_acquire(&raft->wal_lock);
+    for(int i = raft->log_file.end_index; i < raft->log_count; ++i) Raft_save_log_entry(raft, i);
+    Raft_sync_log_files(raft);
+    raft->wal_term = -1;
+    spinlock_release(&raft->wal_lock);
+
+    if(term > raft->current_term) raft->voted_for = -1; // a leader stepping down keeps the vote of its term
     raft->current_term = term;
-    raft->nvoted = 0;
-    raft->nblocked = 0;
-    raft->voted_for = -1;
+    raft->votes = 0;
+    raft->blocked = 0;
+    raft->pre_vote_term = -1;
+    raft->transfer_target = -1;
     raft->state = FOLLOWER;
-
-    if(raft->install_snapshot_id != -1) {
-	Raft_remove_snapshot(raft, raft->install_snapshot_id);
-	raft->install_snapshot_id = -1;
-	raft->install_snapshot_index = -1;
-    }
+    raft->leader_id = -1;
+    Raft_publish_view(raft);
+    Raft_reset_election_timer(raft);
+    // a partially installed snapshot is kept: the new leader is likely to send the same one
 }
 
 void Raft_handle_append_request(raft_state_t *raft, struct sockaddr_in *addr, raft_append_request_t *append_r) {
-    spinlock_acquire(&raft->lock);
+    mcslock_acquire(&raft->lock);
 
     //printf("	[%i -> %i] append request\n", append_r->leader_id, raft->id);
     //printf("(%i[%i]) entering infinite loop\n", raft->id, raft->current_term);
+    if(raft->current_term <= append_r->term && append_r->election_timeout > 0) {
+	raft->election_timeout = append_r->election_timeout; // the leader knows the round trips
+    }
     if(raft->current_term < append_r->term) {
 	Raft_convert_to_follower(raft, append_r->term);
+    } else if(raft->current_term == append_r->term) {
+	Raft_reset_election_timer(raft); // the leader of the term is alive
+    }
+    if(raft->current_term == append_r->term) {
+	raft->leader_id = append_r->leader_id;
+	raft->last_leader_contact = Raft_get_time_msec();
+	raft->pre_vote_term = -1;
     }
 
     raft_packet_t packet;
@@ -32,99 +96,283 @@ void Raft_handle_append_request(raft_state_t *raft, struct sockaddr_in *addr, ra
     packet.data.response.id = raft->id;
     packet.data.response.term = raft->current_term;
     packet.data.response.request_id = append_r->request_id;
+    packet.data.response.match_index = -1;
 
     
     if(raft->current_term > append_r->term || 
 		(append_r->prev_log_index >= raft->log_count) || 
 		(Raft_get_log_term(raft, append_r->prev_log_index) != append_r->prev_log_term)) {
 	packet.data.response.success = 0;
+	packet.data.response.last_log_index = raft->log_count - 1;
 	//printf("    (%i) consistency check failed for prev_index = %i (term %i)\n", raft->id, append_r->prev_log_index, append_r->prev_log_term);
     } else if(append_r->entries_n == 0) { // this means we are consistent 
 	raft->state = FOLLOWER;
+	Raft_discard_snapshot_install(raft); // the leader does not need to send us a snapshot anymore
 	packet.data.response.success = 1;
-	if(append_r->leader_commit > raft->commit_index) {
-	    Raft_commit_update(raft, append_r->leader_commit);
+	packet.data.response.match_index = append_r->prev_log_index;
+	// the entries after prev_log_index might be in flight, or left from another term
+	int commit = (append_r->leader_commit > append_r->prev_log_index) ? append_r->prev_log_index : append_r->leader_commit;
+	if(commit > raft->commit_index) {
+	    Raft_commit_update(raft, commit);
 	}
     } else {
 	raft->state = FOLLOWER;
+	Raft_discard_snapshot_install(raft);
 	int index = append_r->prev_log_index + 1;
+	int written = 0;
 	if(index < raft->log_count && Raft_get_log_term(raft, index) != append_r->entry.term) { // rewrite log entries contradicting with new one
 	    raft->log_count = index + 1;
+	    Raft_log_put(&raft->log, index, &append_r->entry);
+	    written = 1;
     	} else if (raft->log_count == index) {
 	    raft->log_count ++;
+	    Raft_log_put(&raft->log, index, &append_r->entry);
+	    written = 1;
 	}
-	*Raft_get_log(raft, index) = append_r->entry;
-	if(append_r->leader_commit > raft->commit_index) {
-	    Raft_commit_update(raft, (append_r->leader_commit > index) ? index : append_r->leader_commit);
+	int saved = 1;
+	if(written) {
+	    // the entry is only acknowledged once it is on disk
+	    spinlock_acquire(&raft->wal_lock);
+	    saved = Raft_save_log_entry(raft, index) == 0 && Raft_sync_log_files(raft) == 0;
+	    spinlock_release(&raft->wal_lock);
+	    if(!saved) raft->log_count = index; // the leader sends it again
+	}
+	if(written && (append_r->entry.type == CONFIG_LOG || raft->membership_index >= index)) {
+	    Raft_refresh_membership(raft); // a configuration was appended, or the one in use was replaced
+	}
+	if(!saved) {
+	    packet.data.response.success = 0;
+	    packet.data.response.last_log_index = raft->log_count - 1;
+	} else {
+	    if(append_r->leader_commit > raft->commit_index) {
+		Raft_commit_update(raft, (append_r->leader_commit > index) ? index : append_r->leader_commit);
+	    }
+	    //printf("    (%i) replicated position %i with term value %i\n", raft->id, append_r->prev_log_index + 1, raft->log[index].term);
+	    packet.data.response.success = 1;
+	    packet.data.response.match_index = index;
 	}
-	//printf("    (%i) replicated position %i with term value %i\n", raft->id, append_r->prev_log_index + 1, raft->log[index].term);
-	packet.data.response.success = 1;
     } 
 
+    packet.data.response.commit_index = raft->commit_index;
+    if(packet.data.response.success && raft->commit_index >= append_r->leader_commit) {
+	raft->synced_time = Raft_get_time_msec(); // everything the leader had committed when it sent the request is applied
+    }
+
     //Raft_print_state(raft);
     Raft_save_state(raft);
-    
-    UDP_Write(raft->rpc_sd, addr, (char*)&packet, sizeof(raft_packet_t));
+    Raft_publish_view(raft);
+
+    mcslock_release(&raft->lock);
+    Raft_send_packet(raft, addr, &packet);
+}
+
+// write the chunk and advance the contiguous prefix of the received stream;
+// chunks ahead of the prefix are remembered in the sack bitmap
+void Raft_install_snapshot_chunk(raft_state_t *raft, raft_install_snapshot_request_t *install_r) {
+    int rel = install_r->seq - raft->install_snapshot_seq;
+    if(rel < 0 || rel > SNAPSHOT_SACK_BITS) return; // duplicate or too far ahead
+    if(rel > 0 && ((raft->install_snapshot_sack >> (rel - 1)) & 1)) return; // duplicate
+
+    unsigned int chunk_checksum = Raft_checksum(0, install_r->buffer, install_r->len);
+    if(chunk_checksum != install_r->crc) return; // corrupted: dropped like a lost chunk
+    Raft_write_snapshot_chunk(raft, install_r->snapshot_id, install_r->filename, install_r->file_offset, install_r->buffer, install_r->len);
+
+    if(rel > 0) {
+	raft->install_snapshot_sack |= 1ULL << (rel - 1);
+	raft->install_snapshot_sack_len[install_r->seq % SNAPSHOT_SACK_BITS] = install_r->len;
+	raft->install_snapshot_sack_checksum[install_r->seq % SNAPSHOT_SACK_BITS] = chunk_checksum;
+	return;
+    }
+
+    raft->install_snapshot_seq ++;
+    raft->install_snapshot_offset += install_r->len;
+    raft->install_snapshot_checksum = Raft_chain_checksum(raft->install_snapshot_checksum, chunk_checksum);
+    // now bit i of sack corresponds to the chunk seq+i
+    while(raft->install_snapshot_sack & 1) {
+	int ind = raft->install_snapshot_seq % SNAPSHOT_SACK_BITS;
+	raft->install_snapshot_offset += raft->install_snapshot_sack_len[ind];
+	raft->install_snapshot_checksum = Raft_chain_checksum(raft->install_snapshot_checksum, raft->install_snapshot_sack_checksum[ind]);
+	raft->install_snapshot_seq ++;
+	raft->install_snapshot_sack >>= 1;
+    }
+    raft->install_snapshot_sack >>= 1;
 
-    spinlock_release(&raft->lock);
+    if(raft->install_snapshot_offset - raft->install_snapshot_saved_offset >= SNAPSHOT_PROGRESS_INTERVAL) {
+	Raft_save_install_progress(raft);
+    }
 }
 
 void Raft_handle_install_snapshot_request(raft_state_t *raft, struct sockaddr_in *addr, raft_install_snapshot_request_t *install_r) {
-    spinlock_acquire(&raft->lock);
+    // the last request replaces the main files and the log: the applier must not be using them meanwhile
+    if(install_r->done) spinlock_acquire(&raft->apply_lock);
+    mcslock_acquire(&raft->lock);
 
     if(raft->current_term < install_r->term) {
 	Raft_convert_to_follower(raft, install_r->term);
 	Raft_save_state(raft);
+    } else if(raft->current_term == install_r->term) {
+	Raft_reset_election_timer(raft);
+    }
+    if(raft->current_term == install_r->term) {
+	raft->leader_id = install_r->leader_id;
+	raft->last_leader_contact = Raft_get_time_msec();
+	raft->pre_vote_term = -1;
     }
 
- 
     raft_packet_t packet;
     bzero(&packet, sizeof(raft_packet_t));
-    packet.request_type = RESPONSE;
-    packet.data.response.id = raft->id;
-    packet.data.response.term = raft->current_term;
-    packet.data.response.request_id = install_r->request_id;
+    packet.request_type = INSTALL_SNAPSHOT_RESPONSE;
+    raft_install_snapshot_response_t *response = &packet.data.install_response;
+    response->id = raft->id;
+    response->term = raft->current_term;
+    response->snapshot_id = install_r->snapshot_id;
+    response->success = 1;
 
-    int outdated_snapshot = 0;
-    
-    if(raft->current_term > install_r->term || 
-	(raft->install_snapshot_id != -1 && raft->install_snapshot_id != install_r->snapshot_id) || 
-	raft->install_snapshot_index + 1 != install_r->index) {
-	    printf("PROBLEM WITH INSTALL REQUEST: terms [%i -> %i], snap ids [%i -> %i], snap_inds [%i -> %i]\n", raft->current_term, install_r->term, raft->install_snapshot_id, install_r->snapshot_id, raft->install_snapshot_index, install_r->index);
-	    packet.data.response.success = 0;
-    } else if(install_r->done) {
-	raft->snapshot_in_progress = 0;
-	outdated_snapshot = raft->start_log_index;
-	printf("outdated snapshot: %i\n", outdated_snapshot);
-	raft->start_log_index = install_r->snapshot_id;
-	raft->log_count = raft->start_log_index;
-	raft->commit_index = raft->start_log_index - 1;
-	raft->last_applied_index = raft->start_log_index - 1;
-
-	raft->install_snapshot_index = -1;
-	raft->install_snapshot_id = -1;
-	
-	Raft_copy_snapshot(raft, raft->start_log_index, -1);
-	Raft_save_state(raft);
+    int outdated_snapshot = 0, remove_outdated = 0;
 
-	packet.data.response.success = 1;
+    if(raft->current_term > install_r->term) {
+	response->success = 0;
+    } else if(install_r->snapshot_id <= raft->start_log_index && raft->install_snapshot_id != install_r->snapshot_id) {
+	// the snapshot is already installed (the leader did not get the response yet), or we have a newer one
+	response->done = (install_r->snapshot_id == raft->start_log_index);
+	response->success = response->done;
+	response->next_seq = install_r->n_chunks;
+	response->offset = install_r->offset;
+    } else if(raft->snapshot_in_progress && (raft->install_snapshot_id != install_r->snapshot_id || install_r->restart || install_r->done)) {
+	// the snapshot scheduler is compacting the log right now: let the leader retransmit
+	Raft_publish_view(raft);
+	mcslock_release(&raft->lock);
+	if(install_r->done) spinlock_release(&raft->apply_lock);
+	return;
     } else {
-	Raft_add_to_snapshot(raft, install_r->snapshot_id, (raft->install_snapshot_id == -1), install_r->filename, install_r->buffer);	
-	raft->snapshot_in_progress = 1;
-	raft->install_snapshot_id = install_r->snapshot_id;
-	raft->install_snapshot_index++;
+	raft->state = FOLLOWER;
+	if(raft->install_snapshot_id != install_r->snapshot_id || install_r->restart) {
+	    // a new snapshot (or the leader does not trust our progress): drop the partially received one and start from scratch
+	    Raft_begin_snapshot_install(raft, install_r->snapshot_id);
+	}
 
-	Raft_save_state(raft);
+	if(install_r->probe) {
+	    // only report the progress
+	} else if(!install_r->done) {
+	    Raft_install_snapshot_chunk(raft, install_r);
+	} else if(raft->install_snapshot_seq != install_r->n_chunks) {
+	    printf("PROBLEM WITH INSTALL REQUEST: snapshot %i done after %i chunks, received %i\n", install_r->snapshot_id, install_r->n_chunks, raft->install_snapshot_seq);
+	    response->success = 0;
+	} else {
+	    outdated_snapshot = raft->start_log_index;
+	    printf("outdated snapshot: %i\n", outdated_snapshot);
+	    raft->start_log_index = install_r->snapshot_id;
+	    raft->snapshot_lock_state = install_r->lock_state;
+	    raft->snapshot_membership = install_r->membership;
+	    raft->lock_state = install_r->lock_state;
+	    raft->log_count = raft->start_log_index;
+	    Raft_log_reset(&raft->log, raft->start_log_index);
+	    Raft_refresh_membership(raft);
+	    raft->commit_index = raft->start_log_index - 1;
+	    raft->last_applied_index = raft->start_log_index - 1;
 
-	packet.data.response.success = 1;
+	    Raft_reset_snapshot_install(raft);
+	    Raft_save_install_progress(raft);
+	    Raft_add_snapshot_generation(raft, raft->start_log_index, &raft->snapshot_lock_state, &raft->snapshot_membership);
+	    remove_outdated = Raft_release_snapshot(raft, outdated_snapshot);
+
+	    Raft_seal_snapshot(raft, raft->start_log_index);
+	    Raft_remove_apply_checkpoint(raft);
+	    Raft_copy_snapshot(raft, raft->start_log_index, -1);
+	    Raft_save_state(raft);
+	    spinlock_acquire(&raft->wal_lock);
+	    Raft_reset_log_files(raft);
+	    spinlock_release(&raft->wal_lock);
+	    Raft_reset_apply_checkpoint(raft, raft->commit_index);
+
+	    response->done = 1;
+	}
+
+	if(!response->done) {
+	    response->next_seq = raft->install_snapshot_seq;
+	    response->offset = raft->install_snapshot_offset;
+	    response->sack = raft->install_snapshot_sack;
+	    response->checksum = raft->install_snapshot_checksum;
+	} else {
+	    response->next_seq = install_r->n_chunks;
+	    response->offset = install_r->offset;
+	}
     }
-    
-    UDP_Write(raft->rpc_sd, addr, (char*)&packet, sizeof(raft_packet_t));    
 
-    spinlock_release(&raft->lock);
+    Raft_publish_view(raft);
+    mcslock_release(&raft->lock);
+    if(install_r->done) spinlock_release(&raft->apply_lock);
+    Raft_send_packet(raft, addr, &packet);
 
-    if(outdated_snapshot != 0) {
+    if(remove_outdated) {
 	Raft_remove_snapshot(raft, outdated_snapshot);
     }
 }
 
+void Raft_handle_timeout_now(raft_state_t *raft, raft_timeout_now_t *timeout_now_r) {
+    mcslock_acquire(&raft->lock);
+    // the leader brought us up to date: no pre-vote, the others grant the vote even though they heard from it
+    if(raft->current_term == timeout_now_r->term && raft->state == FOLLOWER && Raft_is_voter(&raft->membership, raft->id)) {
+	printf("(%i[%i]) the leadership is transferred by %i\n", raft->id, raft->current_term, timeout_now_r->leader_id);
+	Raft_attempt_to_elect(raft);
+    }
+    mcslock_release(&raft->lock);
+}
+
+int Raft_forward_read_index(raft_state_t *raft) {
+    raft_view_t view;
+    Raft_read_view(raft, &view);
+    if(view.state != FOLLOWER || view.leader_id == -1) return -1;
+    mcslock_acquire(&raft->lock);
+    raft_member_t *leader = Raft_find_member(&raft->membership, view.leader_id);
+    struct sockaddr_in leader_addr;
+    if(leader != NULL) leader_addr = leader->server.raft_socket;
+    mcslock_release(&raft->lock);
+    if(leader == NULL) return -1;
+
+    // the answer comes back to the raft socket (see Raft_handle_read_index_response)
+    int request_id = __atomic_add_fetch(&raft->forward_request_id, 1, __ATOMIC_ACQ_REL);
+    raft_packet_t packet;
+    bzero(&packet, sizeof(raft_packet_t));
+    packet.request_type = READ_INDEX;
+    packet.data.read_index_r.term = view.current_term;
+    packet.data.read_index_r.index = -1;
+    packet.data.read_index_r.request_id = request_id;
+    Raft_send_packet(raft, &leader_addr, &packet);
+
+    // the answer to a request sent after this one confirms the index for this read too
+    long deadline = Raft_get_time_msec() + ELECTION_TIMEOUT;
+    int index = -1;
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->view_event);
+	spinlock_acquire(&raft->forward_lock);
+	int answered = raft->forward_answer_id >= request_id;
+	if(answered) index = raft->forward_answer_index;
+	spinlock_release(&raft->forward_lock);
+	if(answered) break;
+	long left = deadline - Raft_get_time_msec();
+	if(left <= 0) return -1;
+	eventcount_wait(&raft->view_event, key, left);
+    }
+    if(index < 0) return -1;
+
+    // the heartbeats that confirmed the index carry it as the commit index
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->view_event);
+	Raft_read_view(raft, &view);
+	if(view.commit_index >= index) return index;
+	long left = deadline - Raft_get_time_msec();
+	if(left <= 0) return -1;
+	eventcount_wait(&raft->view_event, key, left);
+    }
+}
+
+void Raft_handle_read_index_response(raft_state_t *raft, raft_read_index_t *read_index_r) {
+    spinlock_acquire(&raft->forward_lock);
+    if(read_index_r->request_id > raft->forward_answer_id) {
+	raft->forward_answer_id = read_index_r->request_id;
+	raft->forward_answer_index = read_index_r->index;
+    }
+    spinlock_release(&raft->forward_lock);
+    eventcount_signal(&raft->view_event);
+}
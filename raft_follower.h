@@ -3,11 +3,29 @@
 
 #include "raft.h"
 
+void Raft_reset_snapshot_install(raft_state_t *raft);
+
+void Raft_begin_snapshot_install(raft_state_t *raft, int snapshot_id);
+
+void Raft_discard_snapshot_install(raft_state_t *raft);
+
+// restore_snapshot_install()
+// picks up the progress of the snapshot install persisted before a restart
+void Raft_restore_snapshot_install(raft_state_t *raft);
+
 void Raft_convert_to_follower(raft_state_t *raft, int term);
 
 void Raft_handle_append_request(raft_state_t *raft, struct sockaddr_in *addr, raft_append_request_t *append_r);
 
 void Raft_handle_install_snapshot_request(raft_state_t *raft, struct sockaddr_in *addr, raft_install_snapshot_request_t *install_r);
 
+// handle_timeout_now()
+// starts an election right away, skipping the pre-vote (the leader is transferring the leadership to us)
+void Raft_handle_timeout_now(raft_state_t *raft, raft_timeout_now_t *timeout_now_r);
+
+// handle_read_index_response()
+// the leader's answer to a read index request (see Raft_forward_read_index): wakes up the reads it confirms
+void Raft_handle_read_index_response(raft_state_t *raft, raft_read_index_t *read_index_r);
+
 
 #endif
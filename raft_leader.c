@@ -1,141 +1,282 @@
+#include <limits.h>
 #include "raft.h"
 #include "raft_utils.h"
+#include "raft_log.h"
 #include "raft_storage_manager.h"
 #include "raft_leader.h"
+#include "raft_follower.h"
+#include "raft_snapshot_sender.h"
+#include "raft_membership.h"
+#include "raft_candidate.h"
 
-#include <pthread.h>
+void Raft_reset_progress(raft_state_t *raft, int follower_id, int next_index) {
+    raft_follower_progress_t *progress = &raft->progress[follower_id];
+    spinlock_acquire(&progress->lock);
+    progress->term = raft->current_term;
+    progress->state = REPLICATION_PROBE;
+    progress->next_index = next_index;
+    progress->match_index = -1;
+    progress->window = FLOW_WINDOW_MIN;
+    progress->progress_time = 0;
+    progress->last_request_id = 0;
+    progress->acked_request_id = 0;
+    progress->last_send_time = 0;
+    progress->sent_commit_index = -1;
+    progress->commit_index = -1;
+    bzero(progress->sent, sizeof(progress->sent));
+    progress->ack_request_time = 0;
+    progress->last_response_time = Raft_get_time_msec(); // the follower gets an election timeout to respond
+    spinlock_release(&progress->lock);
+}
 
-void Raft_send_snapshot(raft_state_t *raft, int follower_id, struct sockaddr_in *addr) {
-    //wait for all snapshots to finish
-    printf("TRYING TO SEND A SNAPSHOT TO %i\n", follower_id);
-    while(raft->snapshot_in_progress) {
-	spinlock_release(&raft->lock);
-	sched_yield();
-	spinlock_acquire(&raft->lock);
-    }
+// window_open()
+// returns 1 if the flow control lets the entry at next_index be sent to the follower; both locks must be held
+int Raft_window_open(raft_state_t *raft, raft_follower_progress_t *progress) {
+    int next_index = progress->next_index;
+    if(next_index >= raft->log_count || next_index < raft->start_log_index) return 0;
+    if(progress->state == REPLICATION_PROBE) return 1; // the probe carries it
+    if(progress->state != REPLICATION_PIPELINE || next_index - progress->match_index - 1 >= progress->window) return 0;
 
-    raft->n_followers_receiving_snapshots ++; // set snapshot flag so that no snapshots are created
+    int first = (progress->match_index + 1 > raft->start_log_index) ? progress->match_index + 1 : raft->start_log_index;
+    long bytes = 0;
+    for(int i = first; i < next_index; ++i) bytes += Raft_log_entry_size(Raft_get_log(raft, i));
+    return bytes < FLOW_WINDOW_BYTES;
+}
 
-    int id = raft->start_log_index;
-    int ind = 0;
+// pipeline_open()
+// returns 1 if another entry can be sent to the follower right away, without waiting for a response; the raft lock must be held
+int Raft_pipeline_open(raft_state_t *raft, int follower_id) {
+    raft_follower_progress_t *progress = &raft->progress[follower_id];
+    spinlock_acquire(&progress->lock);
+    int open = progress->state == REPLICATION_PIPELINE && Raft_window_open(raft, progress);
+    spinlock_release(&progress->lock);
+    return open;
+}
 
-    raft_packet_t packet;
-    packet.request_type = INSTALL_SNAPSHOT;
-    packet.data.install_r.snapshot_id = id;
-    packet.data.install_r.term = raft->current_term;
-    packet.data.install_r.leader_id = raft->id;
-
-    snapshot_iterator_t it;
-    snapshot_it_init(&it, raft, id);
-
-    while(snapshot_it_get_next(&it, packet.data.install_r.filename, packet.data.install_r.buffer)) {
-	packet.data.install_r.index = ind;
-	ind++;
-	packet.data.install_r.request_id = raft->last_request_id[follower_id];
-	packet.data.install_r.done = 0;
-	while(packet.data.install_r.request_id == raft->last_request_id[follower_id]) {
-	    UDP_Write(raft->rpc_sd, addr, (char*)&packet, sizeof(raft_packet_t));
-	    spinlock_release(&raft->lock);
-	    usleep(HEARTBIT_TIME*1000);
-	    spinlock_acquire(&raft->lock);
-	}
-	if(!raft->last_request_response[follower_id]) {
-	    printf("ABORTING SENDING A SNAPSHOT\n");
-	    raft->n_followers_receiving_snapshots --;
-	    return;
-	}
+// needs_commit_notice()
+// returns 1 if the follower has all the committed entries but was not told they are committed; the raft lock must be held
+int Raft_needs_commit_notice(raft_state_t *raft, int follower_id) {
+    raft_follower_progress_t *progress = &raft->progress[follower_id];
+    spinlock_acquire(&progress->lock);
+    int notify = progress->match_index >= raft->commit_index && progress->sent_commit_index < raft->commit_index &&
+	progress->commit_index < raft->commit_index;
+    spinlock_release(&progress->lock);
+    return notify;
+}
+
+// shrink_window()
+// after a loss; the progress lock must be held
+void Raft_shrink_window(raft_follower_progress_t *progress) {
+    progress->window /= 2;
+    if(progress->window < FLOW_WINDOW_MIN) progress->window = FLOW_WINDOW_MIN;
+}
+
+// build_append_entry_request()
+// fills the next request for the follower: the entry at next_index if the flow control allows it,
+// an empty append otherwise; the raft lock must be held
+void Raft_build_append_entry_request(raft_state_t *raft, int follower_id, raft_packet_t *packet) {
+    raft_follower_progress_t *progress = &raft->progress[follower_id];
+    packet->request_type = APPEND;
+    packet->data.append_r.term = raft->current_term;
+    packet->data.append_r.leader_id = raft->id;
+    packet->data.append_r.leader_commit = raft->commit_index;
+    packet->data.append_r.election_timeout = raft->election_timeout;
+
+    spinlock_acquire(&progress->lock);
+    int next_ind = progress->next_index;
+    int send_entry = Raft_window_open(raft, progress);
+    // an empty append checks the part of the log the follower acknowledged, not the entries in flight
+    int prev_index = next_ind - 1;
+    if(!send_entry && progress->state == REPLICATION_PIPELINE && progress->match_index >= raft->start_log_index - 1) {
+	prev_index = progress->match_index;
     }
-   
-    packet.data.install_r.done = 1;
-    packet.data.install_r.request_id = raft->last_request_id[follower_id];
-    packet.data.install_r.index = ind;
+    packet->data.append_r.prev_log_index = prev_index;
+    packet->data.append_r.prev_log_term = Raft_get_log_term(raft, prev_index);
 
-    while(packet.data.install_r.request_id == raft->last_request_id[follower_id]) {
-	UDP_Write(raft->rpc_sd, addr, (char*)&packet, sizeof(raft_packet_t));
-	spinlock_release(&raft->lock);
-	usleep(HEARTBIT_TIME*1000);
-	spinlock_acquire(&raft->lock);
+    long now = Raft_get_time_usec();
+    int request_id = ++progress->last_request_id;
+    packet->data.append_r.request_id = request_id;
+    progress->sent[request_id % FLOW_SENT_SLOTS].request_id = request_id;
+    progress->sent[request_id % FLOW_SENT_SLOTS].time = now;
+    progress->last_send_time = now;
+    progress->sent_commit_index = raft->commit_index;
+    
+    if(!send_entry) {
+	packet->data.append_r.entries_n = 0;
+	//printf("(%i) sending heartbeat to %i\n", raft->id, follower_id);
+    } else {
+	packet->data.append_r.entries_n = 1;
+	Raft_log_copy_entry(&packet->data.append_r.entry, Raft_get_log(raft, next_ind));
+	// while probing, the entry is sent again until the follower accepts it
+	if(progress->state == REPLICATION_PIPELINE) progress->next_index ++;
+	//printf("(%i) appending entry (%i, %i), count = %i\n", raft->id, follower_id, next_ind, packet->data.append_r.entries_n);
     }
-    if(!raft->last_request_response[follower_id]) {
-	printf("ABORTING SENDING A SNAPSHOT\n");
-	raft->n_followers_receiving_snapshots --;
+    spinlock_release(&progress->lock);
+}
+
+// replicate()
+// sends the entries the flow control allows to the follower, or an empty append. unless forced, the empty append is skipped
+// if the follower got a request within the heartbeat interval and has nothing new to learn from it; within the longer
+// idle interval if it has acknowledged everything it was sent as well
+void Raft_replicate(raft_heartbeat_t *heartbeat, int force) {
+    raft_state_t *raft = heartbeat->raft;
+    int follower_id = heartbeat->follower_id;
+    raft_follower_progress_t *progress = &raft->progress[follower_id];
+    raft_packet_t packet;
+
+    mcslock_acquire(&raft->lock);
+    if(raft->state != LEADER || Raft_find_member(&raft->membership, follower_id) == NULL) {
+	mcslock_release(&raft->lock); // the timer of a removed server stops
 	return;
     }
+    struct sockaddr_in addr = heartbeat->addr;
+    int term = raft->current_term;
+    spinlock_acquire(&progress->lock);
+    if(progress->state == REPLICATION_PIPELINE && progress->next_index > progress->match_index + 1 &&
+	    Raft_get_time_msec() - progress->progress_time >= raft->heartbeat_interval) {
+	// nothing was acknowledged for a heartbeat interval: the entries in flight are sent again
+	Raft_shrink_window(progress);
+	progress->next_index = progress->match_index + 1;
+	progress->progress_time = Raft_get_time_msec();
+    }
+    int next_index = progress->next_index;
+    long idle_msec = (Raft_get_time_usec() - progress->last_send_time) / 1000;
+    int up_to_date = next_index >= raft->start_log_index && !Raft_window_open(raft, progress) &&
+	progress->sent_commit_index >= raft->commit_index;
+    // nothing in flight to retransmit: the heartbeats only keep the followers from starting an election and renew
+    // the read lease (see Raft_update_quorum_contact), so they can be further apart
+    int idle = up_to_date && next_index == progress->match_index + 1 && progress->acked_request_id == progress->last_request_id;
+    long interval = idle ? raft->election_timeout / IDLE_HEARTBEATS_PER_ELECTION_TIMEOUT : raft->heartbeat_interval;
+    int skip = !force && idle_msec < interval && up_to_date;
+    spinlock_release(&progress->lock);
 
-    raft->next_index[follower_id] = raft->start_log_index;
-    raft->match_index[follower_id] = raft->start_log_index - 1;
-    raft->n_followers_receiving_snapshots --;
+    if(skip && !raft->snapshot_transfer[follower_id].active) {
+	// the appends sent meanwhile were the heartbeats
+	timer_set(&heartbeat->timer, interval - idle_msec);
+	mcslock_release(&raft->lock);
+	return;
+    }
+    timer_set(&heartbeat->timer, raft->heartbeat_interval);
+    if(raft->snapshot_transfer[follower_id].active) {
+	// the snapshot sender thread is talking to this follower
+	mcslock_release(&raft->lock);
+	return;
+    } else if(next_index < raft->start_log_index) {
+	spinlock_acquire(&progress->lock);
+	progress->state = REPLICATION_SNAPSHOT;
+	spinlock_release(&progress->lock);
+	Raft_start_snapshot_sender(raft, follower_id, &addr);
+	mcslock_release(&raft->lock);
+	return;
+    }
 
-    printf("SUCCESSFULLY INSTALLED A SNAPSHOT\n");
-}
+    // the entries the window allows (one per round trip while probing), or an empty append if it allows none;
+    // a burst is limited, so that a follower that is far behind does not hold up the timers of the others
+    for(int n_sent = 1; ; ++n_sent) {
+	Raft_build_append_entry_request(raft, follower_id, &packet);
+	int more = Raft_pipeline_open(raft, follower_id);
+	if(more && n_sent == FLOW_BURST) timer_set(&heartbeat->timer, 0);
+	mcslock_release(&raft->lock);
 
-void Raft_send_append_entry_request(raft_state_t *raft, int follower_id, struct sockaddr_in *addr) {
-    raft_packet_t packet;
-    packet.request_type = APPEND;
-    packet.data.append_r.term = raft->current_term;
-    packet.data.append_r.leader_id = raft->id;
-    packet.data.append_r.leader_commit = raft->commit_index;
-
-    int next_ind = raft->next_index[follower_id];
-    packet.data.append_r.prev_log_index = next_ind - 1;
-    packet.data.append_r.prev_log_term = Raft_get_log_term(raft, next_ind - 1); 
-    packet.data.append_r.request_id = raft->last_request_id[follower_id];
-    
-    if(next_ind == raft->log_count) {
-	packet.data.append_r.entries_n = 0;
-	//printf("(%i) sending heartbeat to %i\n", raft->id, follower_id);
-    } else {
-	packet.data.append_r.entries_n = 1;
-	packet.data.append_r.entry = *Raft_get_log(raft, next_ind); 
-	//printf("(%i) appending entry (%i, %i), count = %i\n", raft->id, follower_id, next_ind, packet.data.append_r.entries_n);
+	Raft_send_packet(raft, &addr, &packet);
+	if(!more || n_sent == FLOW_BURST) return;
+	mcslock_acquire(&raft->lock);
+	if(raft->state != LEADER || raft->current_term != term) {
+	    mcslock_release(&raft->lock);
+	    return;
+	}
     }
+}
 
-    UDP_Write(raft->rpc_sd, addr, (char*)&packet, sizeof(raft_packet_t));
-    //printf("rc = %i = siseof = %i\n", rc, (int)sizeof(request));
+void Raft_handle_heartbeat_timer(void *arg) {
+    Raft_replicate((raft_heartbeat_t*)arg, 0);
 }
 
-void* Raft_leader_thread(void* arg) {
-    raft_state_t *raft = ((raft_leader_thread_arg_t*)arg)->raft;
-    int follower_id = ((raft_leader_thread_arg_t*)arg)->follower_id;
-    struct sockaddr_in *addr = &((raft_leader_thread_arg_t*)arg)->addr;
+void Raft_send_new_entry(raft_state_t *raft, int index) {
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int follower_id = raft->membership.members[i].server.id;
+	if(follower_id == raft->id) continue;
+	raft_follower_progress_t *progress = &raft->progress[follower_id];
+	spinlock_acquire(&progress->lock);
+	int send = progress->next_index == index && Raft_window_open(raft, progress);
+	spinlock_release(&progress->lock);
+	// the followers that are behind (or have a full window) get it as the responses come in
+	if(send) timer_set(&raft->heartbeats[follower_id].timer, 0);
+    }
+}
 
+void Raft_persist_log(raft_state_t *raft, int term, int end_index) {
+    raft_log_entry_t *entries[LOG_WRITE_BATCH];
     while(1) {
-	spinlock_acquire(&raft->lock);
-	if(raft->state != LEADER) {
-	    spinlock_release(&raft->lock);
-	    break;
+	mcslock_acquire(&raft->lock);
+	if(raft->state != LEADER || raft->current_term != term || raft->durable_index >= end_index - 1) {
+	    mcslock_release(&raft->lock);
+	    return;
 	}
-	if(raft->next_index[follower_id] < raft->start_log_index) {
-	    Raft_send_snapshot(raft, follower_id, addr);
-	} else {
-	    Raft_send_append_entry_request(raft, follower_id, addr);
+	// the entries never move, and they are not truncated before they are durable (see Raft_create_snapshot)
+	int first = raft->durable_index + 1;
+	int n = end_index - first;
+	if(n > LOG_WRITE_BATCH) n = LOG_WRITE_BATCH;
+	for(int i = 0; i < n; ++i) entries[i] = Raft_get_log(raft, first + i);
+	mcslock_release(&raft->lock);
+
+	// one sync per batch: it also covers the records of a concurrent append written before it
+	spinlock_acquire(&raft->wal_lock);
+	int durable = -1;
+	if(raft->wal_term == term) {
+	    for(int i = 0; i < n; ++i) {
+		if(first + i < raft->log_file.end_index) continue; // written by a concurrent append
+		if(Raft_write_log_entry(raft, first + i, entries[i]) < 0) break;
+	    }
+	    if(Raft_sync_log_files(raft) == 0) durable = raft->log_file.end_index - 1;
+	}
+	spinlock_release(&raft->wal_lock);
+
+	mcslock_acquire(&raft->lock);
+	int progress = raft->state == LEADER && raft->current_term == term && durable > raft->durable_index;
+	if(progress) {
+	    raft->durable_index = durable;
+	    Raft_advance_commit_index(raft);
 	}
-	spinlock_release(&raft->lock);
-	usleep(HEARTBIT_TIME*1000);
+	mcslock_release(&raft->lock);
+	if(!progress) return; // the next append writes the rest
+    }
+}
+
+void Raft_init_heartbeats(raft_state_t *raft) {
+    // every possible id gets one: the members change at runtime (see Raft_set_membership)
+    for(int id = 0; id <= MAX_SERVER_ID; ++id) {
+	raft_heartbeat_t *heartbeat = &raft->heartbeats[id];
+	heartbeat->raft = raft;
+	heartbeat->follower_id = id;
+	timer_init(&heartbeat->timer, Raft_heartbeat_timer_fired, heartbeat);
+    }
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	raft->heartbeats[raft->membership.members[i].server.id].addr = raft->membership.members[i].server.raft_socket;
     }
-    
-    free(arg);
-    pthread_exit(0);
 }
 
 void Raft_convert_to_leader(raft_state_t *raft) {
     // the lock must be acquired here!!!!!!
-    raft->n_followers_receiving_snapshots = 0;
+    // a partially installed snapshot is of no use to the leader
+    Raft_discard_snapshot_install(raft);
 
     // adding an artificial log entry in order to commit all previous ones
     raft->log_count ++;
-    raft_log_entry_t *log = Raft_get_log(raft, raft->log_count - 1);
+    raft_log_entry_t *log = Raft_log_put(&raft->log, raft->log_count - 1, NULL);
     log->term = raft->current_term;
-    log->n_servers_replicated = 1;
     log->type = LEADER_LOG;
+    spinlock_acquire(&raft->wal_lock);
+    int saved = Raft_save_log_entry(raft, raft->log_count - 1) == 0 && Raft_sync_log_files(raft) == 0;
+    raft->wal_term = raft->current_term;
+    spinlock_release(&raft->wal_lock);
+    raft->durable_index = saved ? raft->log_count - 1 : raft->log_count - 2;
 
     
-    for(int i = 0; i <= MAX_SERVER_ID; ++i) {
-	raft->next_index[i] = raft->log_count;
-	raft->match_index[i] = 0;
-	raft->last_request_id[i] = 0;
-	raft->last_request_response[i] = -1;
-    }
+    for(int i = 0; i <= MAX_SERVER_ID; ++i) Raft_reset_progress(raft, i, raft->log_count);
+    __atomic_store_n(&raft->lease_expiry, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&raft->quorum_contact_time, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&raft->read_request_time, 0, __ATOMIC_RELEASE);
     
     Raft_print_state(raft);
     printf("(%i[%i]) elected as leader\n", raft->id, raft->current_term);
@@ -143,40 +284,331 @@ void Raft_convert_to_leader(raft_state_t *raft) {
     Raft_save_state(raft);
 
     raft->state = LEADER;
+    raft->leader_id = raft->id;
+    raft->pre_vote_term = -1;
+    raft->transfer_target = -1;
+    Raft_publish_view(raft);
+    timer_set(&raft->election_timer, raft->election_timeout); // checks the quorum
+
+    // the first heartbeats announce the new leader right away
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	if(raft->membership.members[i].server.id == raft->id) continue;
+	timer_set(&raft->heartbeats[raft->membership.members[i].server.id].timer, 0);
+    }
+
+    mcslock_release(&raft->lock);
+}
+
+void Raft_notify_commit(raft_state_t *raft) {
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int id = raft->membership.members[i].server.id;
+	// the others learn the commit index with the entries they are missing
+	if(id != raft->id && Raft_needs_commit_notice(raft, id)) timer_set(&raft->heartbeats[id].timer, 0);
+    }
+}
 
-    spinlock_release(&raft->lock);
+void Raft_advance_commit_index(raft_state_t *raft) {
+    if(raft->state != LEADER) return;
+    long match[MAX_MEMBERS];
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int id = raft->membership.members[i].server.id;
+	if(id == raft->id) {
+	    match[i] = raft->durable_index; // the leader votes only for what it has written
+	} else {
+	    // only the acknowledgements of this term count
+	    spinlock_acquire(&raft->progress[id].lock);
+	    match[i] = (raft->progress[id].term == raft->current_term) ? raft->progress[id].match_index : -1;
+	    spinlock_release(&raft->progress[id].lock);
+	}
+    }
+    // the highest index replicated on a majority of the voters
+    long majority_index = Raft_quorum_value(&raft->membership, match);
+    if(majority_index > raft->commit_index && majority_index >= raft->start_log_index &&
+	    Raft_get_log_term(raft, majority_index) == raft->current_term) {
+	Raft_commit_update(raft, majority_index);
+	Raft_notify_commit(raft);
+	Raft_continue_membership_change(raft);
+	//Raft_print_state(raft);
+    }
+}
+
+int Raft_followers_log_start(raft_state_t *raft) {
+    int start = INT_MAX;
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int id = raft->membership.members[i].server.id;
+	if(id == raft->id) continue;
+	int needed;
+	raft_snapshot_transfer_t *transfer = &raft->snapshot_transfer[id];
+	if(transfer->active) { // set with the raft lock held; the sender gives up on a follower that is gone
+	    spinlock_acquire(&transfer->lock);
+	    needed = transfer->snapshot_id;
+	    spinlock_release(&transfer->lock);
+	} else if(!Raft_is_alive(raft, id)) {
+	    continue;
+	} else {
+	    spinlock_acquire(&raft->progress[id].lock);
+	    needed = raft->progress[id].match_index + 1;
+	    spinlock_release(&raft->progress[id].lock);
+	}
+	if(needed < start) start = needed;
+    }
+    return start;
+}
+
+void Raft_atomic_max(long *value, long new_value) {
+    long current = __atomic_load_n(value, __ATOMIC_ACQUIRE);
+    while(new_value > current && !__atomic_compare_exchange_n(value, &current, new_value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+void Raft_update_quorum_contact(raft_state_t *raft) {
+    long sent[MAX_MEMBERS];
+    // the lock keeps the configuration from changing meanwhile
+    mcslock_acquire(&raft->lock);
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int id = raft->membership.members[i].server.id;
+	if(id == raft->id) {
+	    sent[i] = LONG_MAX;
+	} else {
+	    spinlock_acquire(&raft->progress[id].lock);
+	    sent[i] = raft->progress[id].ack_request_time;
+	    spinlock_release(&raft->progress[id].lock);
+	}
+    }
+    // a majority of the voters heard from us after this time
+    long start = Raft_quorum_value(&raft->membership, sent);
+    mcslock_release(&raft->lock);
+    if(start <= 0) return;
+    Raft_atomic_max(&raft->quorum_contact_time, start);
+    eventcount_signal(&raft->view_event); // the reads waiting for the round (see Raft_read_index)
+    if(start < __atomic_load_n(&raft->lease_barrier, __ATOMIC_ACQUIRE)) return;
+
+    // the followers use an election timeout of at least ELECTION_TIMEOUT_MIN, measured on their own clocks
+    Raft_atomic_max(&raft->lease_expiry, start + 1000L * ELECTION_TIMEOUT_MIN * (100 - LEASE_CLOCK_DRIFT) / 100);
+}
+
+int Raft_read_index(raft_state_t *raft) {
+    mcslock_acquire(&raft->lock);
+    int commit_term = (raft->commit_index >= raft->start_log_index) ? Raft_get_log_term(raft, raft->commit_index) : -1;
+    if(raft->state != LEADER || raft->transfer_target != -1 || commit_term != raft->current_term) {
+	mcslock_release(&raft->lock);
+	return -1;
+    }
+    int index = raft->commit_index;
+    int term = raft->current_term;
+    long time = Raft_get_time_usec();
+    Raft_atomic_max(&raft->read_request_time, time);
+    // the followers with requests in flight get the next one as soon as they respond (see Raft_handle_append_response),
+    // so the reads that come in meanwhile wait for the same round
+    int idle[MAX_MEMBERS];
+    int n_idle = 0;
+    for(int i = 0; i < raft->membership.n_members; ++i) {
+	int id = raft->membership.members[i].server.id;
+	if(id == raft->id) continue;
+	spinlock_acquire(&raft->progress[id].lock);
+	if(raft->progress[id].acked_request_id == raft->progress[id].last_request_id) idle[n_idle++] = id;
+	spinlock_release(&raft->progress[id].lock);
+    }
+    mcslock_release(&raft->lock);
+    for(int i = 0; i < n_idle; ++i) Raft_replicate(&raft->heartbeats[idle[i]], 1);
+
+    // a leader cut off from the majority steps down within an election timeout (see Raft_check_quorum)
+    raft_view_t view;
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->view_event);
+	Raft_read_view(raft, &view);
+	// the read is served from the main files: the entries up to the index have to be applied as well
+	if(__atomic_load_n(&raft->quorum_contact_time, __ATOMIC_ACQUIRE) >= time && view.commit_index >= index) return index;
+	if(view.state != LEADER || view.current_term != term) return -1;
+	eventcount_wait(&raft->view_event, key, -1);
+    }
+}
+
+void Raft_handle_read_index_request(raft_state_t *raft, struct sockaddr_in *addr, raft_read_index_t *read_index_r) {
+    raft_packet_t packet;
+    bzero(&packet, sizeof(raft_packet_t));
+    packet.request_type = READ_INDEX_RESPONSE;
+    packet.data.read_index_r.term = read_index_r->term;
+    packet.data.read_index_r.request_id = read_index_r->request_id;
+    packet.data.read_index_r.index = Raft_read_index(raft);
+    Raft_send_packet(raft, addr, &packet);
+}
+
+int Raft_compare_long(const void *a, const void *b) {
+    long x = *(long*)a, y = *(long*)b;
+    return (x > y) - (x < y);
+}
+
+void Raft_update_timeouts(raft_state_t *raft) {
+    long samples[RTT_SAMPLES];
+    spinlock_acquire(&raft->rtt.lock);
+    int n = (raft->rtt.n_samples < RTT_SAMPLES) ? raft->rtt.n_samples : RTT_SAMPLES;
+    memcpy(samples, raft->rtt.samples, n * sizeof(long));
+    spinlock_release(&raft->rtt.lock);
+    if(n < RTT_MIN_SAMPLES) return;
 
-    for(int i = 0; i < N_SERVERS; ++i) {
-	if(raft->config.servers[i].id == raft->id) continue;
-	raft_leader_thread_arg_t *arg = malloc(sizeof(raft_leader_thread_arg_t));
-	arg->raft = raft; arg->follower_id = raft->config.servers[i].id; arg->addr = raft->config.servers[i].raft_socket;
-	pthread_t tid;
-	pthread_create(&tid, NULL, Raft_leader_thread, arg);
+    qsort(samples, n, sizeof(long), Raft_compare_long);
+    long rtt_p99 = samples[n * 99 / 100];
+    long election_timeout = ELECTION_RTT_FACTOR * rtt_p99 / 1000;
+    if(election_timeout < ELECTION_TIMEOUT_MIN) election_timeout = ELECTION_TIMEOUT_MIN;
+    if(election_timeout > ELECTION_TIMEOUT) election_timeout = ELECTION_TIMEOUT;
+    if(election_timeout != raft->election_timeout) {
+	printf("(%i[%i]) election timeout %li ms (99th percentile round trip %li usec)\n", raft->id, raft->current_term, election_timeout, rtt_p99);
     }
+    raft->election_timeout = election_timeout;
+    raft->heartbeat_interval = election_timeout / HEARTBEATS_PER_ELECTION_TIMEOUT;
 }
 
 void Raft_handle_append_response(raft_state_t *raft, raft_response_packet_t *response) {
-    if(!response->success) {
-	raft->next_index[response->id] --;
-    } else if(raft->next_index[response->id] < raft->log_count) {
-	if(raft->next_index[response->id] > raft->commit_index && Raft_get_log_term(raft, raft->next_index[response->id]) == raft->current_term &&
-	    (++Raft_get_log(raft, raft->next_index[response->id])->n_servers_replicated)*2 > N_SERVERS) {
-
-	    Raft_commit_update(raft, raft->next_index[response->id]);
-		//Raft_print_state(raft);
+    if(response->request_id < 0) return; // a late vote
+    if(response->id < 0 || response->id > MAX_SERVER_ID) return;
+    raft_follower_progress_t *progress = &raft->progress[response->id];
+    int advanced = 0;
+    int resend = 0;
+    long now = Raft_get_time_usec();
+    spinlock_acquire(&progress->lock);
+    if(progress->term != response->term) {
+	// the server was elected again since the caller looked at the view: the response is to a request of
+	// the previous term, and the follower's log might have been rewritten by another leader since
+	spinlock_release(&progress->lock);
+	return;
+    }
+    progress->last_response_time = now / 1000;
+    if(response->success && response->match_index > progress->match_index) {
+	// the follower reports its match index itself, so the acknowledgements can come in any order
+	advanced = response->match_index - progress->match_index;
+	progress->match_index = response->match_index;
+    }
+    long rtt = -1;
+    long acked_time = LONG_MAX;
+    raft_sent_request_t *sent = &progress->sent[response->request_id % FLOW_SENT_SLOTS];
+    if(sent->request_id == response->request_id && sent->time != 0) {
+	rtt = now - sent->time;
+	acked_time = sent->time;
+	if(acked_time > progress->ack_request_time) progress->ack_request_time = acked_time;
+	sent->time = 0; // a duplicate response is no new sample
+    }
+    if(response->request_id > progress->acked_request_id) progress->acked_request_id = response->request_id;
+    if(response->commit_index > progress->commit_index) progress->commit_index = response->commit_index;
+
+    if(!response->success && progress->state == REPLICATION_PIPELINE) {
+	// a request before this one was lost (or reordered): probing from the last entry acknowledged
+	Raft_shrink_window(progress);
+	progress->state = REPLICATION_PROBE;
+	progress->next_index = progress->match_index + 1;
+	resend = 1;
+    } else if(!response->success && progress->state == REPLICATION_PROBE && response->request_id == progress->last_request_id) {
+	// the follower does not have the entry before next_index; its log might end well before it
+	progress->next_index --;
+	if(response->last_log_index + 1 < progress->next_index) progress->next_index = response->last_log_index + 1;
+	resend = 1;
+    } else if(response->success && progress->state == REPLICATION_PROBE) {
+	progress->state = REPLICATION_PIPELINE;
+	progress->progress_time = now / 1000;
+    } else if(advanced && progress->state == REPLICATION_PIPELINE) {
+	// the follower keeps up: more entries in flight
+	progress->window += advanced;
+	if(progress->window > FLOW_WINDOW_MAX) progress->window = FLOW_WINDOW_MAX;
+	progress->progress_time = now / 1000;
+    }
+    if(progress->next_index <= progress->match_index) progress->next_index = progress->match_index + 1;
+    long last_send_time = progress->last_send_time;
+    spinlock_release(&progress->lock);
+
+    if(rtt >= 0) {
+	spinlock_acquire(&raft->rtt.lock);
+	raft->rtt.samples[raft->rtt.n_samples % RTT_SAMPLES] = rtt;
+	raft->rtt.n_samples ++;
+	spinlock_release(&raft->rtt.lock);
+	Raft_update_quorum_contact(raft);
+    }
+    long read_request_time = __atomic_load_n(&raft->read_request_time, __ATOMIC_ACQUIRE);
+    if(acked_time < read_request_time && last_send_time < read_request_time) {
+	// a read came in after the request was sent: the next round confirms it (see Raft_read_index)
+	Raft_replicate(&raft->heartbeats[response->id], 1);
+    }
+    if(!advanced && !resend) return;
+
+    mcslock_acquire(&raft->lock);
+    if(raft->state == LEADER && raft->current_term == response->term) {
+	if(advanced) Raft_advance_commit_index(raft);
+	if(raft->transfer_target == response->id) {
+	    Raft_continue_leadership_transfer(raft);
+	} else if(resend || Raft_pipeline_open(raft, response->id) || Raft_needs_commit_notice(raft, response->id)) {
+	    // the window has room again, the probe goes on, or the follower just got the last committed entry:
+	    // no need to wait for the next heartbeat
+	    timer_set(&raft->heartbeats[response->id].timer, 0);
 	}
-	raft->match_index[response->id] = raft->next_index[response->id];
-	raft->next_index[response->id] ++;
     }
-    raft->last_request_id[response->id] ++;
-    Raft_save_state(raft);
+    mcslock_release(&raft->lock);
 }
 
-void Raft_handle_install_response(raft_state_t *raft, raft_response_packet_t *response) {
-    if(!response->success) {
-	printf("error installing snapshot (follower probably relaunched)\n");
+void Raft_continue_leadership_transfer(raft_state_t *raft) {
+    int target_id = raft->transfer_target;
+    spinlock_acquire(&raft->progress[target_id].lock);
+    int match_index = raft->progress[target_id].match_index;
+    spinlock_release(&raft->progress[target_id].lock);
+
+    if(match_index < raft->log_count - 1) {
+	timer_set(&raft->heartbeats[target_id].timer, 0);
+	return;
     }
-    raft->last_request_id[response->id] ++;
-    Raft_save_state(raft);
+    // no entry is appended during the transfer, so the target stays up to date
+    raft_packet_t packet;
+    bzero(&packet, sizeof(raft_packet_t));
+    packet.request_type = TIMEOUT_NOW;
+    packet.data.timeout_now_r.term = raft->current_term;
+    packet.data.timeout_now_r.leader_id = raft->id;
+    // the target skips the pre-vote, so the others may vote for it within its first election timeout;
+    // the acknowledgements of the requests sent before that is over do not extend the lease
+    long barrier = Raft_get_time_usec() + 2000L * raft->election_timeout;
+    __atomic_store_n(&raft->lease_barrier, barrier, __ATOMIC_RELEASE);
+    __atomic_store_n(&raft->lease_expiry, 0, __ATOMIC_RELEASE);
+    Raft_send_packet(raft, &raft->heartbeats[target_id].addr, &packet);
 }
 
+int Raft_transfer_leadership(raft_state_t *raft, int target_id) {
+    mcslock_acquire(&raft->lock);
+    if(raft->state != LEADER) {
+	mcslock_release(&raft->lock);
+	return -1;
+    }
+    if(raft->transfer_target == -1) {
+	if(target_id == -1) {
+	    // the most up-to-date follower needs the fewest entries
+	    int best_match = -2;
+	    for(int i = 0; i < raft->membership.n_members; ++i) {
+		int id = raft->membership.members[i].server.id;
+		if(id == raft->id || raft->membership.members[i].role != MEMBER_VOTER) continue;
+		spinlock_acquire(&raft->progress[id].lock);
+		int match_index = raft->progress[id].match_index;
+		spinlock_release(&raft->progress[id].lock);
+		if(match_index > best_match) {
+		    best_match = match_index;
+		    target_id = id;
+		}
+	    }
+	}
+	if(target_id < 0 || target_id > MAX_SERVER_ID || target_id == raft->id || !Raft_is_voter(&raft->membership, target_id)) {
+	    mcslock_release(&raft->lock);
+	    return -1;
+	}
+	printf("(%i[%i]) transferring the leadership to %i\n", raft->id, raft->current_term, target_id);
+	raft->transfer_target = target_id;
+	raft->transfer_deadline = Raft_get_time_msec() + raft->election_timeout;
+	Raft_publish_view(raft);
+	Raft_continue_leadership_transfer(raft);
+    }
+    int term = raft->current_term;
+    mcslock_release(&raft->lock);
+
+    // the target's election deposes us (or the transfer is given up, see Raft_handle_election_timeout);
+    // either is published with the view
+    raft_view_t view;
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->view_event);
+	Raft_read_view(raft, &view);
+	if(view.state != LEADER || view.current_term != term || view.transfer_target == -1) break;
+	eventcount_wait(&raft->view_event, key, -1);
+    }
+    return (view.state == LEADER && view.current_term == term) ? -1 : 0;
+}
@@ -3,16 +3,65 @@
 
 #include "raft.h"
 
-typedef struct raft_leader_thread_arg {
-    raft_state_t* raft;
-    int follower_id;
-    struct sockaddr_in addr;
-} raft_leader_thread_arg_t;
+// init_heartbeats()
+// sets up a heartbeat timer for every server id; they run only while the server is the leader, for the members of the configuration
+void Raft_init_heartbeats(raft_state_t *raft);
+
+// reset_progress()
+// the replication to the follower starts over, probing from next_index (a new leader, or a new member)
+void Raft_reset_progress(raft_state_t *raft, int follower_id, int next_index);
+
+// heartbeat timer handler (run by the timer worker): sends the entries the flow control allows to the follower, or an
+// empty append; the empty append is skipped while other requests keep going to the follower within the heartbeat interval
+void Raft_handle_heartbeat_timer(void *arg);
 
 void Raft_convert_to_leader(raft_state_t *raft);
 
-void Raft_handle_append_response(raft_state_t *raft, raft_response_packet_t *response);
+// send_new_entry()
+// sends the entry just appended right away to the followers that have all the ones before it; the raft lock must be held
+void Raft_send_new_entry(raft_state_t *raft, int index);
+
+// persist_log()
+// writes the entries of the leader before end_index to the log files, if no one else did yet; must be called without the raft lock.
+// the lock is not held during the writes, so that the followers replicate the entries in the meantime:
+// the durable index of the leader is just one more vote in the quorum (see Raft_advance_commit_index)
+void Raft_persist_log(raft_state_t *raft, int term, int end_index);
+
+// advance_commit_index()
+// commits up to the highest index replicated on a majority of the servers (the leader included),
+// if that entry is of the current term; the raft lock must be held
+void Raft_advance_commit_index(raft_state_t *raft);
+
+// notify_commit()
+// sends the new commit index right away to the followers that already have all the committed entries,
+// so that they apply them without waiting for the next request; the raft lock must be held
+void Raft_notify_commit(raft_state_t *raft);
 
-void Raft_handle_install_response(raft_state_t *raft, raft_response_packet_t *response);
+// followers_log_start()
+// the first entry the followers still need: after the match index of the live ones, or after the snapshot being sent to one;
+// the raft lock must be held
+int Raft_followers_log_start(raft_state_t *raft);
+
+// continue_leadership_transfer()
+// sends the missing entries to the target of the transfer, or TimeoutNow once it has them all; the raft lock must be held
+void Raft_continue_leadership_transfer(raft_state_t *raft);
+
+// handle_read_index_request()
+// confirms the commit index for a read forwarded by a follower (see Raft_read_index); blocks until it is confirmed
+void Raft_handle_read_index_request(raft_state_t *raft, struct sockaddr_in *addr, raft_read_index_t *read_index_r);
+
+// update_timeouts()
+// derives the base election timeout (sent to the followers with the appends) and the heartbeat interval
+// from the 99th percentile of the measured round trips; the raft lock must be held
+void Raft_update_timeouts(raft_state_t *raft);
+
+// update_quorum_contact()
+// after a follower responded, moves the time a majority last heard from the leader: when the request the majority
+// last responded to was sent. the read lease (see Raft_has_read_lease) is extended from it; must be called without the raft lock
+void Raft_update_quorum_contact(raft_state_t *raft);
+
+// handle_append_response()
+// updates the progress of the follower; must be called without the raft lock
+void Raft_handle_append_response(raft_state_t *raft, raft_response_packet_t *response);
 
 #endif
@@ -0,0 +1,64 @@
+#include "raft.h"
+#include "raft_lock.h"
+#include "raft_utils.h"
+
+void Raft_init_lock_state(raft_lock_state_t *state) {
+    state->holder = -1;
+    state->token = -1;
+    bzero(state->shared, sizeof(state->shared));
+}
+
+int Raft_is_shared_holder(raft_lock_state_t *state, int client) {
+    return client >= 0 && client < MAX_ID && (state->shared[client / 8] & (1 << (client % 8)));
+}
+
+int Raft_apply_lock_entry(raft_lock_state_t *state, int index, raft_log_entry_t *entry) {
+    switch(entry->type) {
+	case LOCK_GRANT_LOG:
+	    if(state->holder == -1) {
+		state->holder = entry->client;
+		state->token = index;
+	    }
+	    return 0;
+	case LOCK_EXPIRE_LOG:
+	    if(state->holder == entry->client && state->token == entry->id) state->holder = -1;
+	    return 0;
+	case LOCK_SHARED_GRANT_LOG:
+	    if(state->holder == -1 && entry->client >= 0 && entry->client < MAX_ID) state->shared[entry->client / 8] |= 1 << (entry->client % 8);
+	    return 0;
+	case LOCK_SHARED_RELEASE_LOG:
+	    if(entry->client >= 0 && entry->client < MAX_ID) state->shared[entry->client / 8] &= ~(1 << (entry->client % 8));
+	    return 0;
+	case CLIENT_LOG:
+	    if(state->holder != entry->client || state->token != entry->id) return 0; // fenced off
+	    state->holder = -1;
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+int Raft_get_lock_state(raft_state_t *raft, raft_lock_state_t *state, int *term) {
+    mcslock_acquire(&raft->lock);
+    int ready = raft->state == LEADER && raft->last_applied_index >= raft->start_log_index &&
+	Raft_get_log_term(raft, raft->last_applied_index) == raft->current_term;
+    *state = raft->lock_state;
+    *term = raft->current_term;
+    mcslock_release(&raft->lock);
+    return ready ? 0 : -1;
+}
+
+int Raft_find_transaction(raft_state_t *raft, int client_id, int token, int *term) {
+    mcslock_acquire(&raft->lock);
+    int index = -1;
+    for(int i = raft->log_count - 1; i >= raft->start_log_index && i > token; --i) {
+	raft_log_entry_t *log = Raft_get_log(raft, i);
+	if(log->type == CLIENT_LOG && log->client == client_id && log->id == token) {
+	    index = i;
+	    *term = log->term;
+	    break;
+	}
+    }
+    mcslock_release(&raft->lock);
+    return index;
+}
@@ -0,0 +1,36 @@
+#ifndef __RAFT_LOCK_h__
+#define __RAFT_LOCK_h__
+
+#include "raft.h"
+
+// replicated lock
+// the lock table is a part of the replicated state: the leader appends an entry when it grants the lock (LOCK_GRANT_LOG)
+// and when the lease of the holder expires (LOCK_EXPIRE_LOG), and the transaction of the holder (CLIENT_LOG) releases it.
+// entries carry the fencing token of the holder in their id: the token is the index of the entry that granted the lock,
+// so tokens only grow. a transaction is applied only if it carries the token of the current holder.
+// the shared holders need no token, but their grants (LOCK_SHARED_GRANT_LOG) and releases (LOCK_SHARED_RELEASE_LOG)
+// are replicated as well: a grant is only answered once it is committed, so a deposed leader cannot hand out shared
+// locks, and a new leader keeps them from an exclusive holder until they are released or their leases run out.
+// the lock state is saved with every snapshot and apply checkpoint, so a new leader knows who holds the lock
+
+void Raft_init_lock_state(raft_lock_state_t *state);
+
+// is_shared_holder()
+// returns 1 if the client holds the lock shared in the state
+int Raft_is_shared_holder(raft_lock_state_t *state, int client);
+
+// apply_lock_entry()
+// applies the committed entry at the index to the lock state;
+// returns 1 if the entry is a transaction that passed the fencing check, i.e. its data must be applied to the files
+int Raft_apply_lock_entry(raft_lock_state_t *state, int index, raft_log_entry_t *entry);
+
+// get_lock_state()
+// copies the lock state and the current term; returns -1 unless this server is the leader and has applied an entry of
+// its term (only then the grants and releases of the previous leaders are all applied)
+int Raft_get_lock_state(raft_state_t *raft, raft_lock_state_t *state, int *term);
+
+// find_transaction()
+// returns the index of the transaction of the client with the fencing token in the log (-1 if none), and its term
+int Raft_find_transaction(raft_state_t *raft, int client_id, int token, int *term);
+
+#endif
@@ -0,0 +1,224 @@
+#include "raft.h"
+#include "raft_log.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+int Raft_log_entry_transactions(raft_log_entry_t *entry) {
+    int n = 0;
+    while(n < MAX_TRANSACTION_ENTRIES && entry->data[n].filename[0] != 0) n++;
+    return n;
+}
+
+int Raft_log_entry_alloc_size(int n_transactions) {
+    int size = offsetof(raft_log_entry_t, data) + n_transactions * sizeof(raft_transaction_entry_t);
+    if(n_transactions < MAX_TRANSACTION_ENTRIES) size += 1; // the terminating empty filename
+    return size;
+}
+
+int Raft_log_entry_size(raft_log_entry_t *entry) {
+    return Raft_log_entry_alloc_size(Raft_log_entry_transactions(entry));
+}
+
+void Raft_log_copy_entry(raft_log_entry_t *dest, raft_log_entry_t *src) {
+    int size = Raft_log_entry_size(src);
+    memcpy(dest, src, size);
+    bzero((char*)dest + size, sizeof(raft_log_entry_t) - size);
+}
+
+// slab allocator: a free object stores the pointer to the next free one
+raft_log_entry_t* Raft_log_alloc_entry(raft_log_t *log, int n_transactions) {
+    if(log->free_entries[n_transactions] == NULL) {
+	int object_size = (Raft_log_entry_alloc_size(n_transactions) + 7) & ~7;
+	int n_objects = LOG_SLAB_SIZE / object_size;
+	if(n_objects == 0) n_objects = 1;
+	char *slab = malloc((long)n_objects * object_size);
+	for(int i = n_objects - 1; i >= 0; --i) {
+	    *(void**)(slab + (long)i * object_size) = log->free_entries[n_transactions];
+	    log->free_entries[n_transactions] = slab + (long)i * object_size;
+	}
+    }
+    void *object = log->free_entries[n_transactions];
+    log->free_entries[n_transactions] = *(void**)object;
+    return (raft_log_entry_t*)object;
+}
+
+void Raft_log_free_entry(raft_log_t *log, raft_log_entry_t *entry) {
+    int n = Raft_log_entry_transactions(entry);
+    *(void**)entry = log->free_entries[n];
+    log->free_entries[n] = entry;
+}
+
+raft_log_segment_t* Raft_log_alloc_segment(raft_log_t *log) {
+    raft_log_segment_t *segment = log->free_segments;
+    if(segment != NULL) {
+	log->free_segments = segment->next_free;
+    } else {
+	segment = malloc(sizeof(raft_log_segment_t));
+    }
+    bzero(segment, sizeof(raft_log_segment_t));
+    return segment;
+}
+
+void Raft_log_hold_mapping(raft_log_mapping_t *mapping) {
+    mapping->refcount ++;
+}
+
+void Raft_log_release_mapping(raft_log_mapping_t *mapping) {
+    if(--mapping->refcount > 0) return;
+    munmap(mapping->addr, mapping->size);
+    free(mapping);
+}
+
+raft_log_entry_t* Raft_log_mapped_entry(raft_log_mapping_t *mapping, int index) {
+    if(index < mapping->first_index || index >= mapping->first_index + mapping->n_entries) return NULL;
+    return (raft_log_entry_t*)(mapping->addr + mapping->offsets[index - mapping->first_index] + sizeof(raft_log_record_header_t));
+}
+
+void Raft_log_free_segment(raft_log_t *log, raft_log_segment_t *segment) {
+    if(segment->mapping != NULL) Raft_log_release_mapping(segment->mapping);
+    segment->next_free = log->free_segments;
+    log->free_segments = segment;
+}
+
+raft_log_segment_t* Raft_log_segment(raft_log_t *log, int segment) {
+    return log->segments[segment & (log->capacity - 1)];
+}
+
+void Raft_log_init(raft_log_t *log, int start_index) {
+    log->capacity = 16;
+    log->segments = calloc(log->capacity, sizeof(raft_log_segment_t*));
+    log->first_segment = start_index / LOG_SEGMENT_SIZE;
+    log->n_segments = 0;
+    log->start_index = start_index;
+    log->reclaim_index = start_index;
+    log->free_segments = NULL;
+    for(int i = 0; i <= MAX_TRANSACTION_ENTRIES; ++i) log->free_entries[i] = NULL;
+}
+
+void Raft_log_reset(raft_log_t *log, int start_index) {
+    for(int s = log->first_segment; s < log->first_segment + log->n_segments; ++s) {
+	raft_log_segment_t *segment = Raft_log_segment(log, s);
+	for(int i = 0; i < LOG_SEGMENT_SIZE; ++i) {
+	    if(segment->entries[i] != NULL) Raft_log_free_entry(log, segment->entries[i]);
+	}
+	Raft_log_free_segment(log, segment);
+    }
+    log->first_segment = start_index / LOG_SEGMENT_SIZE;
+    log->n_segments = 0;
+    log->start_index = start_index;
+    log->reclaim_index = start_index;
+}
+
+// frees up to n truncated entries, and the segments left empty
+void Raft_log_reclaim(raft_log_t *log, int n) {
+    while(n-- > 0 && log->reclaim_index < log->start_index) {
+	if(log->n_segments == 0) {
+	    log->reclaim_index = log->start_index;
+	    log->first_segment = log->start_index / LOG_SEGMENT_SIZE;
+	    break;
+	}
+	raft_log_segment_t *segment = Raft_log_segment(log, log->first_segment);
+	int slot = log->reclaim_index % LOG_SEGMENT_SIZE;
+	if(segment->entries[slot] != NULL) {
+	    Raft_log_free_entry(log, segment->entries[slot]);
+	    segment->entries[slot] = NULL;
+	}
+	log->reclaim_index ++;
+	if(log->reclaim_index % LOG_SEGMENT_SIZE == 0) {
+	    Raft_log_free_segment(log, segment);
+	    log->first_segment ++;
+	    log->n_segments --;
+	}
+    }
+}
+
+raft_log_entry_t* Raft_log_get(raft_log_t *log, int index) {
+    int segment = index / LOG_SEGMENT_SIZE;
+    if(index < log->start_index || segment < log->first_segment || segment >= log->first_segment + log->n_segments) return NULL;
+    raft_log_segment_t *seg = Raft_log_segment(log, segment);
+    raft_log_entry_t *entry = seg->entries[index % LOG_SEGMENT_SIZE];
+    if(entry == NULL && seg->mapping != NULL) entry = Raft_log_mapped_entry(seg->mapping, index);
+    return entry;
+}
+
+raft_log_mapping_t* Raft_log_get_mapping(raft_log_t *log, int index) {
+    int segment = index / LOG_SEGMENT_SIZE;
+    if(index < log->start_index || segment < log->first_segment || segment >= log->first_segment + log->n_segments) return NULL;
+    return Raft_log_segment(log, segment)->mapping;
+}
+
+// returns the segment of the entry, allocating the segments up to it
+raft_log_segment_t* Raft_log_reserve(raft_log_t *log, int index) {
+    int segment = index / LOG_SEGMENT_SIZE;
+    if(log->n_segments == 0) log->first_segment = log->reclaim_index / LOG_SEGMENT_SIZE;
+    while(segment >= log->first_segment + log->n_segments) {
+	if(log->n_segments == log->capacity) {
+	    // the ring is full: double it, keeping every segment at its index modulo the capacity
+	    raft_log_segment_t **segments = calloc(2 * log->capacity, sizeof(raft_log_segment_t*));
+	    for(int s = log->first_segment; s < log->first_segment + log->n_segments; ++s) {
+		segments[s & (2 * log->capacity - 1)] = Raft_log_segment(log, s);
+	    }
+	    free(log->segments);
+	    log->segments = segments;
+	    log->capacity *= 2;
+	}
+	int s = log->first_segment + log->n_segments++;
+	log->segments[s & (log->capacity - 1)] = Raft_log_alloc_segment(log);
+    }
+    return Raft_log_segment(log, segment);
+}
+
+raft_log_entry_t* Raft_log_put(raft_log_t *log, int index, raft_log_entry_t *entry) {
+    Raft_log_reclaim(log, LOG_RECLAIM_BATCH);
+    if(index < log->start_index) return NULL;
+
+    raft_log_entry_t **slot = &Raft_log_reserve(log, index)->entries[index % LOG_SEGMENT_SIZE];
+    if(*slot != NULL) Raft_log_free_entry(log, *slot);
+
+    int n = (entry == NULL) ? 0 : Raft_log_entry_transactions(entry);
+    *slot = Raft_log_alloc_entry(log, n);
+    if(entry == NULL) {
+	bzero(*slot, Raft_log_entry_alloc_size(0));
+    } else {
+	memcpy(*slot, entry, Raft_log_entry_alloc_size(n));
+    }
+    return *slot;
+}
+
+void Raft_log_truncate_prefix(raft_log_t *log, int new_start_index) {
+    if(new_start_index <= log->start_index) return;
+    log->start_index = new_start_index;
+    Raft_log_reclaim(log, LOG_RECLAIM_BATCH);
+}
+
+void Raft_log_map(raft_log_t *log, raft_log_mapping_t *mapping) {
+    mapping->refcount ++; // unmapped right away if none of the entries is in the log
+    int from = (mapping->first_index > log->start_index) ? mapping->first_index : log->start_index;
+    for(int index = from; index < mapping->first_index + mapping->n_entries; index += LOG_SEGMENT_SIZE - index % LOG_SEGMENT_SIZE) {
+	raft_log_segment_t *segment = Raft_log_reserve(log, index);
+	if(segment->mapping == mapping) continue;
+	if(segment->mapping != NULL) Raft_log_release_mapping(segment->mapping);
+	segment->mapping = mapping;
+	mapping->refcount ++;
+    }
+    Raft_log_release_mapping(mapping);
+}
+
+void Raft_log_unmap(raft_log_t *log, raft_log_mapping_t *mapping) {
+    mapping->refcount ++; // keep it mapped while the entries are copied
+    int from = (mapping->first_index > log->start_index) ? mapping->first_index : log->start_index;
+    int to = mapping->first_index + mapping->n_entries;
+    for(int index = from; index < to; ++index) {
+	raft_log_segment_t *segment = Raft_log_reserve(log, index);
+	if(segment->mapping != mapping) continue;
+	if(segment->entries[index % LOG_SEGMENT_SIZE] == NULL) {
+	    Raft_log_put(log, index, Raft_log_mapped_entry(mapping, index));
+	}
+	if(index % LOG_SEGMENT_SIZE == LOG_SEGMENT_SIZE - 1 || index == to - 1) {
+	    segment->mapping = NULL;
+	    Raft_log_release_mapping(mapping);
+	}
+    }
+    Raft_log_release_mapping(mapping);
+}
@@ -0,0 +1,50 @@
+#ifndef __RAFT_LOG_h__
+#define __RAFT_LOG_h__
+
+#include "raft.h"
+
+// in-memory log
+// entries are stored in fixed-size segments, so lookups and appends are O(1) and the entries never move.
+// an entry only takes as much memory as its transaction entries need: entries are allocated from slabs,
+// with a separate free list for each number of transaction entries.
+// prefix truncation is O(1): truncated entries are freed LOG_RECLAIM_BATCH at a time on later calls
+
+void Raft_log_init(raft_log_t *log, int start_index);
+
+// frees all the entries; the next entry stored should be start_index
+void Raft_log_reset(raft_log_t *log, int start_index);
+
+// returns NULL if the entry is not stored
+raft_log_entry_t* Raft_log_get(raft_log_t *log, int index);
+
+// copies the meaningful part of the entry to the log, replacing the one stored at this index
+// if entry is NULL, an empty entry (with no transaction entries) is stored
+raft_log_entry_t* Raft_log_put(raft_log_t *log, int index, raft_log_entry_t *entry);
+
+void Raft_log_truncate_prefix(raft_log_t *log, int new_start_index);
+
+// map()
+// entries of the mapped log file that are not stored in the log are read from the mapping;
+// the log takes over the mapping and unmaps it when it is no longer used
+void Raft_log_map(raft_log_t *log, raft_log_mapping_t *mapping);
+
+// returns the mapping the entry would be read from (NULL if none)
+raft_log_mapping_t* Raft_log_get_mapping(raft_log_t *log, int index);
+
+// hold_mapping() / release_mapping()
+// a reader of mapped entries that lets the raft lock go meanwhile holds their mapping: it is only unmapped once released.
+// the raft lock must be held for both
+void Raft_log_hold_mapping(raft_log_mapping_t *mapping);
+void Raft_log_release_mapping(raft_log_mapping_t *mapping);
+
+// unmap()
+// copies the entries read from the mapping to the log, and drops the mapping (e.g. before the file is truncated)
+void Raft_log_unmap(raft_log_t *log, raft_log_mapping_t *mapping);
+
+// size of the meaningful part of the entry: the used transaction entries and the terminating empty filename
+int Raft_log_entry_size(raft_log_entry_t *entry);
+
+// copies a stored entry to a full-sized raft_log_entry_t
+void Raft_log_copy_entry(raft_log_entry_t *dest, raft_log_entry_t *src);
+
+#endif
@@ -0,0 +1,226 @@
+#include <limits.h>
+#include "raft.h"
+#include "raft_membership.h"
+#include "raft_utils.h"
+#include "raft_log.h"
+#include "raft_storage_manager.h"
+#include "raft_leader.h"
+#include "raft_follower.h"
+
+void Raft_init_membership(raft_membership_t *membership, raft_configuration_t *config) {
+    bzero(membership, sizeof(raft_membership_t));
+    for(int i = 0; i < N_SERVERS; ++i) {
+	if(config->servers[i].id == -1) continue;
+	raft_member_t *member = &membership->members[membership->n_members++];
+	member->server = config->servers[i];
+	member->role = MEMBER_VOTER;
+	member->old_role = MEMBER_VOTER;
+    }
+}
+
+raft_member_t* Raft_find_member(raft_membership_t *membership, int id) {
+    for(int i = 0; i < membership->n_members; ++i) {
+	if(membership->members[i].server.id == id) return &membership->members[i];
+    }
+    return NULL;
+}
+
+int Raft_is_voter(raft_membership_t *membership, int id) {
+    raft_member_t *member = Raft_find_member(membership, id);
+    return member != NULL && (member->role == MEMBER_VOTER || (membership->joint && member->old_role == MEMBER_VOTER));
+}
+
+int Raft_is_quorum(raft_membership_t *membership, unsigned int ids) {
+    // the new configuration, and the old one if joint
+    for(int old = 0; old <= membership->joint; ++old) {
+	int n_voters = 0, n_in_set = 0;
+	for(int i = 0; i < membership->n_members; ++i) {
+	    raft_member_t *member = &membership->members[i];
+	    if((old ? member->old_role : member->role) != MEMBER_VOTER) continue;
+	    n_voters ++;
+	    n_in_set += (ids >> member->server.id) & 1;
+	}
+	if(n_in_set*2 <= n_voters) return 0;
+    }
+    return 1;
+}
+
+long Raft_quorum_value(raft_membership_t *membership, long value[MAX_MEMBERS]) {
+    long result = LONG_MAX;
+    for(int old = 0; old <= membership->joint; ++old) {
+	long voters[MAX_MEMBERS];
+	int n = 0;
+	for(int i = 0; i < membership->n_members; ++i) {
+	    raft_member_t *member = &membership->members[i];
+	    if((old ? member->old_role : member->role) != MEMBER_VOTER) continue;
+	    // insertion sort, in decreasing order
+	    voters[n] = value[i];
+	    for(int j = n++; j > 0 && voters[j] > voters[j-1]; --j) {
+		long tmp = voters[j]; voters[j] = voters[j-1]; voters[j-1] = tmp;
+	    }
+	}
+	if(n == 0) return LONG_MIN;
+	if(voters[n / 2] < result) result = voters[n / 2];
+    }
+    return result;
+}
+
+void Raft_encode_membership(raft_log_entry_t *entry, raft_membership_t *membership) {
+    bzero(entry, sizeof(raft_log_entry_t));
+    entry->type = CONFIG_LOG;
+    entry->id = membership->joint;
+    entry->client = -1;
+    for(int i = 0; i < membership->n_members; ++i) {
+	sprintf(entry->data[i].filename, "server %i", membership->members[i].server.id);
+	memcpy(entry->data[i].buffer, &membership->members[i], sizeof(raft_member_t));
+    }
+}
+
+int Raft_apply_membership_entry(raft_membership_t *membership, raft_log_entry_t *entry) {
+    if(entry->type != CONFIG_LOG) return 0;
+    membership->joint = entry->id;
+    membership->n_members = 0;
+    for(int i = 0; i < MAX_MEMBERS && entry->data[i].filename[0] != 0; ++i) {
+	memcpy(&membership->members[membership->n_members++], entry->data[i].buffer, sizeof(raft_member_t));
+    }
+    return 1;
+}
+
+// set_membership()
+// switches to the configuration of the entry at the index; the leader starts replicating to the new members right away
+void Raft_set_membership(raft_state_t *raft, raft_membership_t *membership, int index) {
+    raft_membership_t old_membership = raft->membership;
+    raft->membership = *membership;
+    raft->membership_index = index;
+    for(int i = 0; i < membership->n_members; ++i) {
+	int id = membership->members[i].server.id;
+	if(id == raft->id) continue;
+	raft->heartbeats[id].addr = membership->members[i].server.raft_socket;
+	if(raft->state != LEADER || Raft_find_member(&old_membership, id) != NULL) continue;
+
+	Raft_reset_progress(raft, id, raft->log_count);
+	timer_set(&raft->heartbeats[id].timer, 0);
+    }
+}
+
+void Raft_refresh_membership(raft_state_t *raft) {
+    raft_membership_t membership = raft->snapshot_membership;
+    int index = raft->start_log_index - 1;
+    for(int i = raft->start_log_index; i < raft->log_count; ++i) {
+	if(Raft_apply_membership_entry(&membership, Raft_get_log(raft, i))) index = i;
+    }
+    if(index != raft->membership_index && index >= raft->start_log_index) printf("(%i[%i]) configuration of entry %i: %i members%s\n", raft->id, raft->current_term, index, membership.n_members, membership.joint ? " (joint)" : "");
+    Raft_set_membership(raft, &membership, index);
+}
+
+// append_membership_entry()
+// appends the configuration to the log of the leader and switches to it; the raft lock must be held
+void Raft_append_membership_entry(raft_state_t *raft, raft_membership_t *membership) {
+    raft_log_entry_t *entry = malloc(sizeof(raft_log_entry_t));
+    Raft_encode_membership(entry, membership);
+    entry->term = raft->current_term;
+    raft->log_count ++;
+    int index = raft->log_count - 1;
+    Raft_log_put(&raft->log, index, entry);
+    free(entry);
+
+    // written with the lock held, after the entries before it that are still being written (see Raft_persist_log)
+    spinlock_acquire(&raft->wal_lock);
+    for(int i = raft->log_file.end_index; i <= index; ++i) {
+	if(Raft_save_log_entry(raft, i) < 0) break;
+    }
+    if(Raft_sync_log_files(raft) == 0 && raft->log_file.end_index - 1 > raft->durable_index) raft->durable_index = raft->log_file.end_index - 1;
+    spinlock_release(&raft->wal_lock);
+
+    printf("(%i[%i]) appended the configuration %i: %i members%s\n", raft->id, raft->current_term, index, membership->n_members, membership->joint ? " (joint)" : "");
+    Raft_set_membership(raft, membership, index);
+    Raft_send_new_entry(raft, index);
+}
+
+// leave_joint_membership()
+// the new configuration of a joint one: the removed servers are dropped
+void Raft_leave_joint_membership(raft_membership_t *membership) {
+    int n = 0;
+    for(int i = 0; i < membership->n_members; ++i) {
+	if(membership->members[i].role == MEMBER_REMOVED) continue;
+	membership->members[n] = membership->members[i];
+	membership->members[n].old_role = membership->members[n].role;
+	n ++;
+    }
+    membership->n_members = n;
+    membership->joint = 0;
+}
+
+int Raft_leader_server(raft_state_t *raft, raft_server_configuration_t *server) {
+    mcslock_acquire(&raft->lock);
+    raft_member_t *member = (raft->leader_id == -1) ? NULL : Raft_find_member(&raft->membership, raft->leader_id);
+    if(member != NULL) *server = member->server;
+    mcslock_release(&raft->lock);
+    return (member != NULL) ? 0 : -1;
+}
+
+int Raft_change_membership(raft_state_t *raft, raft_server_configuration_t *server, member_role_t role) {
+    if(server->id < 0 || server->id > MAX_SERVER_ID) return -1;
+    mcslock_acquire(&raft->lock);
+    if(raft->state != LEADER || raft->transfer_target != -1 || raft->membership.joint || raft->membership_index > raft->commit_index) {
+	mcslock_release(&raft->lock);
+	return -1;
+    }
+
+    raft_membership_t membership = raft->membership;
+    raft_member_t *member = Raft_find_member(&membership, server->id);
+    if(member == NULL && role != MEMBER_REMOVED) {
+	if(membership.n_members >= MAX_MEMBERS) {
+	    // the configuration entry has no room for another member (see Raft_encode_membership)
+	    mcslock_release(&raft->lock);
+	    return -1;
+	}
+	member = &membership.members[membership.n_members++];
+	member->server = *server;
+	member->role = MEMBER_REMOVED;
+	member->old_role = MEMBER_REMOVED;
+    }
+    if(member == NULL || member->role == role) {
+	mcslock_release(&raft->lock);
+	return 0;
+    }
+    member->role = role;
+    // the voters change through the joint configuration; a learner is added or removed in one step
+    membership.joint = (member->old_role == MEMBER_VOTER) != (role == MEMBER_VOTER);
+    if(!membership.joint) Raft_leave_joint_membership(&membership);
+    if(!Raft_is_quorum(&membership, ~0u)) {
+	mcslock_release(&raft->lock);
+	return -1; // no voters left
+    }
+    Raft_append_membership_entry(raft, &membership);
+    int term = raft->current_term;
+    mcslock_release(&raft->lock);
+
+    // every commit, and every change of the term or the role, publishes the view
+    long deadline = Raft_get_time_msec() + MEMBERSHIP_CHANGE_TIMEOUT;
+    while(1) {
+	unsigned int key = eventcount_prepare(&raft->view_event);
+	mcslock_acquire(&raft->lock);
+	int done = raft->current_term == term && !raft->membership.joint && raft->membership_index <= raft->commit_index;
+	int failed = raft->current_term != term || raft->state != LEADER;
+	mcslock_release(&raft->lock);
+	// a leader that removed itself steps down once the change is committed
+	if(done) return 0;
+	long remaining = deadline - Raft_get_time_msec();
+	if(failed || remaining <= 0) return -1;
+	eventcount_wait(&raft->view_event, key, remaining);
+    }
+}
+
+void Raft_continue_membership_change(raft_state_t *raft) {
+    if(raft->membership_index > raft->commit_index) return;
+    if(raft->membership.joint) {
+	// the old voters agreed on the joint configuration: from now on, the new voters decide alone
+	raft_membership_t membership = raft->membership;
+	Raft_leave_joint_membership(&membership);
+	Raft_append_membership_entry(raft, &membership);
+    } else if(!Raft_is_voter(&raft->membership, raft->id)) {
+	printf("(%i[%i]) not a voter anymore -- stepping down\n", raft->id, raft->current_term);
+	Raft_convert_to_follower(raft, raft->current_term);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef __RAFT_MEMBERSHIP_h__
+#define __RAFT_MEMBERSHIP_h__
+
+#include "raft.h"
+
+// cluster membership
+// the configuration is a part of the replicated state: a CONFIG_LOG entry holds all the members (one per transaction entry,
+// the joint flag in its id), and a server uses the latest one in its log as soon as it has it, committed or not.
+// the snapshots carry the configuration of their last entry, so the configuration is the one of the snapshot
+// updated by the entries of the log. the bootstrap configuration (raft_config) only seeds the first one.
+//
+// learners get the log and the snapshots like the voters, but they do not vote and do not count in any majority.
+// the voters change in two steps (joint consensus): the leader appends the joint configuration, in which both
+// the old and the new voters have to agree on elections and commits, and once that is committed, the new one
+
+// init_membership()
+// the members of the bootstrap configuration, all of them voters
+void Raft_init_membership(raft_membership_t *membership, raft_configuration_t *config);
+
+// find_member()
+// returns the member with the id, or NULL if it is not in the configuration
+raft_member_t* Raft_find_member(raft_membership_t *membership, int id);
+
+// is_voter()
+// returns 1 if the server votes in the old or the new configuration
+int Raft_is_voter(raft_membership_t *membership, int id);
+
+// is_quorum()
+// returns 1 if the servers of the set (bit i for server i) are a majority of the voters (of both configurations if joint)
+int Raft_is_quorum(raft_membership_t *membership, unsigned int ids);
+
+// quorum_value()
+// the highest value reached by a majority of the voters (of both configurations if joint), where value[i] is the one of members[i];
+// LONG_MIN if a configuration has no voters
+long Raft_quorum_value(raft_membership_t *membership, long value[MAX_MEMBERS]);
+
+// apply_membership_entry()
+// replaces the configuration by the one of the entry; returns 1 if it is a configuration entry
+int Raft_apply_membership_entry(raft_membership_t *membership, raft_log_entry_t *entry);
+
+// refresh_membership()
+// takes the configuration of the snapshot updated by the entries of the log; called after the configuration entries
+// were appended, truncated, or installed with a snapshot. the raft lock must be held
+void Raft_refresh_membership(raft_state_t *raft);
+
+// leader_server()
+// copies the configuration of the server this one takes for the leader to *server; returns -1 if the leader is not
+// known or not in the configuration. the followers point the clients to it (E_FOLLOWER)
+int Raft_leader_server(raft_state_t *raft, raft_server_configuration_t *server);
+
+// change_membership()
+// makes the server a voter or a learner, or removes it (see member_role_t); on the leader, one change at a time.
+// blocks until the new configuration is committed: returns 0 then, or -1 if this server is not the leader,
+// another change is in progress, or the change did not complete within MEMBERSHIP_CHANGE_TIMEOUT (it might still complete later)
+int Raft_change_membership(raft_state_t *raft, raft_server_configuration_t *server, member_role_t role);
+
+// continue_membership_change()
+// once the joint configuration is committed, appends the new one; once that is committed, a leader that is not
+// one of its voters steps down. called by the leader whenever the commit index advances; the raft lock must be held
+void Raft_continue_membership_change(raft_state_t *raft);
+
+#endif
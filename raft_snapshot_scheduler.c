@@ -0,0 +1,172 @@
+#include "raft.h"
+#include "raft_utils.h"
+#include "raft_log.h"
+#include "raft_storage_manager.h"
+#include "raft_snapshot_scheduler.h"
+#include "raft_lock.h"
+#include "raft_membership.h"
+#include "raft_leader.h"
+
+#include <pthread.h>
+
+void Raft_init_snapshot_generations(raft_state_t *raft) {
+    for(int i = 0; i < SNAPSHOT_GENERATIONS; ++i) {
+	raft->snapshots[i].snapshot_id = -1;
+	raft->snapshots[i].refcount = 0;
+    }
+    if(raft->start_log_index != 0) {
+	Raft_add_snapshot_generation(raft, raft->start_log_index, &raft->snapshot_lock_state, &raft->snapshot_membership);
+    }
+}
+
+raft_snapshot_generation_t* Raft_find_snapshot_generation(raft_state_t *raft, int snapshot_id) {
+    for(int i = 0; i < SNAPSHOT_GENERATIONS; ++i) {
+	if(raft->snapshots[i].snapshot_id == snapshot_id) return &raft->snapshots[i];
+    }
+    return NULL;
+}
+
+int Raft_add_snapshot_generation(raft_state_t *raft, int snapshot_id, raft_lock_state_t *lock_state, raft_membership_t *membership) {
+    raft_snapshot_generation_t *gen = Raft_find_snapshot_generation(raft, snapshot_id);
+    if(gen == NULL) gen = Raft_find_snapshot_generation(raft, -1);
+    if(gen == NULL) return -1;
+    gen->snapshot_id = snapshot_id;
+    gen->lock_state = *lock_state;
+    gen->membership = *membership;
+    gen->refcount ++;
+    return 0;
+}
+
+int Raft_acquire_snapshot(raft_state_t *raft, int snapshot_id, raft_lock_state_t *lock_state, raft_membership_t *membership) {
+    raft_snapshot_generation_t *gen = Raft_find_snapshot_generation(raft, snapshot_id);
+    if(snapshot_id == -1 || gen == NULL) return -1;
+    gen->refcount ++;
+    *lock_state = gen->lock_state;
+    *membership = gen->membership;
+    return 0;
+}
+
+int Raft_release_snapshot(raft_state_t *raft, int snapshot_id) {
+    raft_snapshot_generation_t *gen = Raft_find_snapshot_generation(raft, snapshot_id);
+    if(snapshot_id == -1 || gen == NULL) return 0;
+    if(--gen->refcount > 0) return 0;
+    gen->snapshot_id = -1;
+    return 1;
+}
+
+int Raft_create_snapshot(raft_state_t *raft, int new_log_start) {
+    mcslock_acquire(&raft->lock);
+    // the entries the leader is still writing are committed if the followers have them, but they are kept until they are written;
+    // the applier reads the entries after last_applied_index without the lock, so they are kept until they are applied
+    if(raft->snapshot_in_progress || raft->install_snapshot_id != -1 || new_log_start <= raft->start_log_index || new_log_start > raft->last_applied_index + 1 ||
+	    (raft->state == LEADER && new_log_start > raft->durable_index + 1) || Raft_find_snapshot_generation(raft, -1) == NULL) {
+	mcslock_release(&raft->lock);
+	return -1;
+    }
+    raft->snapshot_in_progress = 1; // set the flag that the snapshot is in progress
+    int prev_snap_id = raft->start_log_index;
+    raft_lock_state_t lock_state = raft->snapshot_lock_state;
+    raft_membership_t membership = raft->snapshot_membership;
+    mcslock_release(&raft->lock);
+
+    Raft_create_snapshot_dir(raft, new_log_start);
+
+    if(prev_snap_id != 0) {
+	Raft_copy_snapshot(raft, prev_snap_id, new_log_start);
+    }
+
+    // the entries before new_log_start are committed, so they are not changed while we read them. the pointers to them
+    // are taken a segment at a time under the lock though: an append can reallocate the segment directory of the log,
+    // and a follower truncating its log files drops the mapping of a sealed file (held here, it stays mapped)
+    raft_log_entry_t *entries[LOG_SEGMENT_SIZE];
+    for(int first = prev_snap_id; first < new_log_start; ) {
+	int n = LOG_SEGMENT_SIZE - first % LOG_SEGMENT_SIZE;
+	if(n > new_log_start - first) n = new_log_start - first;
+	mcslock_acquire(&raft->lock);
+	for(int i = 0; i < n; ++i) entries[i] = Raft_get_log(raft, first + i);
+	raft_log_mapping_t *mapping = Raft_log_get_mapping(&raft->log, first);
+	if(mapping != NULL) Raft_log_hold_mapping(mapping);
+	mcslock_release(&raft->lock);
+
+	for(int i = 0; i < n; ++i) {
+	    raft_log_entry_t *log = entries[i];
+	    Raft_apply_membership_entry(&membership, log);
+	    if(!Raft_apply_lock_entry(&lock_state, first + i, log)) continue;
+	    for(int j = 0; j < MAX_TRANSACTION_ENTRIES; ++j) {
+		if(log->data[j].filename[0] == 0) break;
+		Raft_add_to_snapshot(raft, new_log_start, 0, log->data[j].filename, log->data[j].buffer);
+	    }
+	}
+	if(mapping != NULL) {
+	    mcslock_acquire(&raft->lock);
+	    Raft_log_release_mapping(mapping);
+	    mcslock_release(&raft->lock);
+	}
+	first += n;
+    }
+    Raft_seal_snapshot(raft, new_log_start);
+
+    mcslock_acquire(&raft->lock);
+    raft->snapshot_in_progress = 0;
+    Raft_log_truncate_prefix(&raft->log, new_log_start);
+    raft->start_log_index = new_log_start;
+    raft->snapshot_lock_state = lock_state;
+    raft->snapshot_membership = membership;
+    Raft_add_snapshot_generation(raft, new_log_start, &lock_state, &membership);
+    int remove_prev = Raft_release_snapshot(raft, prev_snap_id); // the previous one might still be streamed to a follower
+    Raft_save_state(raft);
+    spinlock_acquire(&raft->wal_lock);
+    Raft_remove_log_prefix(raft);
+    spinlock_release(&raft->wal_lock);
+
+    mcslock_release(&raft->lock);
+
+    if(remove_prev) {
+	Raft_remove_snapshot(raft, prev_snap_id);
+    }
+
+    return 0;
+}
+
+void* Raft_snapshot_scheduler_thread(void *arg) {
+    raft_state_t *raft = (raft_state_t*)arg;
+
+    double commit_rate = 0; // committed entries per second, exponentially smoothed
+    mcslock_acquire(&raft->lock);
+    int prev_commit_index = raft->commit_index;
+    mcslock_release(&raft->lock);
+
+    while(1) {
+	usleep(SNAPSHOT_SCHEDULER_INTERVAL*1000);
+
+	mcslock_acquire(&raft->lock);
+	int committed = raft->commit_index - raft->start_log_index + 1;
+	int free_entries = LOG_SIZE - (raft->log_count - raft->start_log_index);
+	int delta = raft->commit_index - prev_commit_index;
+	prev_commit_index = raft->commit_index;
+	int new_log_start = raft->commit_index + 1 - SNAPSHOT_KEEP_ENTRIES;
+	if(raft->state == LEADER) {
+	    // a follower catching up gets the entries rather than another snapshot
+	    int needed = Raft_followers_log_start(raft);
+	    int oldest = raft->commit_index + 1 - LOG_RETAIN_SIZE;
+	    if(needed < new_log_start) new_log_start = (needed > oldest) ? needed : oldest;
+	}
+	mcslock_release(&raft->lock);
+
+	if(delta < 0) delta = 0;
+	commit_rate = (3*commit_rate + delta * 1000.0 / SNAPSHOT_SCHEDULER_INTERVAL) / 4;
+
+	int size_trigger = (committed >= COMMITS_TO_SNAPSHOT);
+	int rate_trigger = (committed - SNAPSHOT_KEEP_ENTRIES >= SNAPSHOT_MIN_ENTRIES && free_entries * 1000.0 < commit_rate * SNAPSHOT_FILL_TIME);
+	if(size_trigger || rate_trigger) {
+	    Raft_create_snapshot(raft, new_log_start);
+	}
+    }
+    pthread_exit(0);
+}
+
+void Raft_start_snapshot_scheduler(raft_state_t *raft) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, Raft_snapshot_scheduler_thread, raft);
+    pthread_detach(tid);
+}
@@ -0,0 +1,34 @@
+#ifndef __RAFT_SNAPSHOT_SCHEDULER_h__
+#define __RAFT_SNAPSHOT_SCHEDULER_h__
+
+#include "raft.h"
+
+// snapshot generations
+// the current snapshot (start_log_index) holds one reference, and every snapshot sender streaming
+// a snapshot holds another one, so older snapshots are kept on disk while the log keeps being compacted.
+// all the functions below must be called with the raft lock held
+
+void Raft_init_snapshot_generations(raft_state_t *raft);
+
+// registers a new snapshot (with the lock state and the configuration it was taken at) with one reference; returns -1 if all the generations are in use
+int Raft_add_snapshot_generation(raft_state_t *raft, int snapshot_id, raft_lock_state_t *lock_state, raft_membership_t *membership);
+
+// copies the lock state and the configuration of the snapshot; returns -1 if the snapshot is not retained
+int Raft_acquire_snapshot(raft_state_t *raft, int snapshot_id, raft_lock_state_t *lock_state, raft_membership_t *membership);
+
+// returns 1 if this was the last reference: the caller should remove the snapshot files (preferably without holding the lock)
+int Raft_release_snapshot(raft_state_t *raft, int snapshot_id);
+
+// create_snapshot()
+// moves the committed log entries before new_log_start to a new snapshot; the files are copied without the lock held
+// returns -1 if the snapshot cannot be created now
+int Raft_create_snapshot(raft_state_t *raft, int new_log_start);
+
+// start_snapshot_scheduler()
+// starts the thread that decides when to compact the log:
+//	- when COMMITS_TO_SNAPSHOT entries are committed since the last snapshot (size trigger);
+//	- when the log would grow beyond LOG_SIZE entries in less than SNAPSHOT_FILL_TIME msec at the current commit rate (rate trigger).
+// on the leader, the entries the live followers still need are kept, up to LOG_RETAIN_SIZE of them (see Raft_followers_log_start)
+void Raft_start_snapshot_scheduler(raft_state_t *raft);
+
+#endif
@@ -0,0 +1,240 @@
+#include "raft.h"
+#include "raft_utils.h"
+#include "raft_storage_manager.h"
+#include "raft_follower.h"
+#include "raft_snapshot_sender.h"
+#include "raft_snapshot_scheduler.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef struct raft_snapshot_sender_arg {
+    raft_state_t *raft;
+    int follower_id;
+    struct sockaddr_in addr;
+} raft_snapshot_sender_arg_t;
+
+// chained checksum of the first n_chunks chunks of the snapshot stream
+unsigned int Raft_snapshot_prefix_checksum(snapshot_layout_t *layout, int n_chunks, raft_install_snapshot_request_t *chunk) {
+    unsigned int checksum = 0;
+    for(int seq = 0; seq < n_chunks; ++seq) {
+	if(snapshot_layout_read_chunk(layout, seq, chunk) != 0) break;
+	checksum = Raft_chain_checksum(checksum, chunk->crc);
+    }
+    return checksum;
+}
+
+int Raft_send_snapshot(raft_state_t *raft, int follower_id, struct sockaddr_in *addr) {
+    raft_snapshot_transfer_t *transfer = &raft->snapshot_transfer[follower_id];
+
+    mcslock_acquire(&raft->lock);
+    int snapshot_id = raft->start_log_index;
+    raft_lock_state_t lock_state;
+    raft_membership_t membership;
+    // the reference keeps the snapshot on disk even if the log is compacted again during the transfer
+    if(raft->state != LEADER || Raft_acquire_snapshot(raft, snapshot_id, &lock_state, &membership) != 0) {
+	transfer->active = 0;
+	mcslock_release(&raft->lock);
+	return -1;
+    }
+    transfer->active = 1;
+
+    int term = raft->current_term;
+
+    spinlock_acquire(&transfer->lock);
+    transfer->snapshot_id = snapshot_id;
+    transfer->acked_seq = 0;
+    transfer->acked_offset = 0;
+    transfer->sack = 0;
+    transfer->checksum = 0;
+    transfer->n_acks = 0;
+    transfer->done = 0;
+    transfer->failed = 0;
+    transfer->last_ack_time = Raft_get_time_msec();
+    spinlock_release(&transfer->lock);
+
+    raft_packet_t *packet = malloc(sizeof(raft_packet_t));
+    bzero(packet, offsetof(raft_packet_t, data.install_r.buffer));
+    packet->request_type = INSTALL_SNAPSHOT;
+    packet->data.install_r.term = term;
+    packet->data.install_r.leader_id = raft->id;
+    packet->data.install_r.snapshot_id = snapshot_id;
+    packet->data.install_r.lock_state = lock_state;
+    packet->data.install_r.membership = membership;
+    mcslock_release(&raft->lock);
+
+    printf("SENDING SNAPSHOT %i TO %i\n", snapshot_id, follower_id);
+
+    snapshot_layout_t layout;
+    snapshot_layout_init(&layout, raft, snapshot_id);
+    long *sent_time = calloc(layout.n_chunks + 1, sizeof(long)); // the last one is for the final (done) message
+
+    // the transfer starts with probes: the follower might already have a part of this snapshot
+    // (received from us or from the previous leader before a restart or an election)
+    int probing = 1;
+    long probe_time = 0;
+    packet->data.install_r.probe = 1;
+    packet->data.install_r.restart = 0;
+    packet->data.install_r.len = 0;
+
+    int rc = -1;
+    raft_view_t view;
+    while(1) {
+	unsigned int key = eventcount_prepare(&transfer->acked);
+	Raft_read_view(raft, &view);
+	if(view.state != LEADER || view.current_term != term) break;
+
+	spinlock_acquire(&transfer->lock);
+	int acked_seq = transfer->acked_seq;
+	long acked_offset = transfer->acked_offset;
+	unsigned long long sack = transfer->sack;
+	unsigned int checksum = transfer->checksum;
+	int n_acks = transfer->n_acks;
+	int done = transfer->done;
+	int failed = transfer->failed;
+	long last_ack_time = transfer->last_ack_time;
+	spinlock_release(&transfer->lock);
+
+	long now = Raft_get_time_msec();
+	if(failed || now - last_ack_time > SNAPSHOT_TRANSFER_TIMEOUT) break;
+	if(done) {
+	    rc = 0;
+	    break;
+	}
+
+	if(probing && n_acks > 0) {
+	    if(acked_seq <= layout.n_chunks && Raft_snapshot_prefix_checksum(&layout, acked_seq, &packet->data.install_r) == checksum) {
+		if(acked_seq > 0) {
+		    printf("RESUMING SNAPSHOT %i TO %i FROM BYTE %li\n", snapshot_id, follower_id, acked_offset);
+		}
+		probing = 0;
+		packet->data.install_r.probe = 0;
+		packet->data.install_r.restart = 0;
+	    } else {
+		// the follower's prefix does not match our snapshot: make it start over
+		printf("SNAPSHOT %i PROGRESS OF %i DOES NOT MATCH, RESTARTING\n", snapshot_id, follower_id);
+		packet->data.install_r.restart = 1;
+		spinlock_acquire(&transfer->lock);
+		transfer->n_acks = 0;
+		spinlock_release(&transfer->lock);
+		probe_time = 0;
+	    }
+	}
+
+	if(probing) {
+	    if(now - probe_time >= SNAPSHOT_RETRANSMIT_TIMEOUT) {
+		packet->data.install_r.seq = -1;
+		packet->data.install_r.done = 0;
+		packet->data.install_r.len = 0;
+		Raft_send_packet(raft, addr, packet);
+		probe_time = now;
+	    }
+	} else if(acked_seq >= layout.n_chunks) {
+	    if(now - sent_time[layout.n_chunks] >= SNAPSHOT_RETRANSMIT_TIMEOUT) {
+		packet->data.install_r.done = 1;
+		packet->data.install_r.seq = layout.n_chunks;
+		packet->data.install_r.n_chunks = layout.n_chunks;
+		packet->data.install_r.offset = layout.total_size;
+		packet->data.install_r.len = 0;
+		Raft_send_packet(raft, addr, packet);
+		sent_time[layout.n_chunks] = now;
+	    }
+	} else {
+	    // chunks below the highest selectively acknowledged one are most likely lost
+	    int highest_sacked = (sack == 0) ? acked_seq : acked_seq + 64 - __builtin_clzll(sack);
+	    packet->data.install_r.done = 0;
+	    for(int seq = acked_seq; seq < acked_seq + SNAPSHOT_WINDOW && seq < layout.n_chunks; ++seq) {
+		if(seq > acked_seq && ((sack >> (seq - acked_seq - 1)) & 1)) continue;
+		long since_sent = now - sent_time[seq];
+		if(sent_time[seq] == 0 || since_sent >= SNAPSHOT_RETRANSMIT_TIMEOUT ||
+			(seq < highest_sacked && since_sent >= SNAPSHOT_FAST_RETRANSMIT_TIMEOUT)) {
+		    snapshot_layout_read_chunk(&layout, seq, &packet->data.install_r);
+		    Raft_send_packet(raft, addr, packet);
+		    sent_time[seq] = now;
+		}
+	    }
+	}
+	// until the next response, or until a chunk is due for a retransmit (sooner once a gap was acknowledged)
+	eventcount_wait(&transfer->acked, key, (sack != 0) ? SNAPSHOT_FAST_RETRANSMIT_TIMEOUT : SNAPSHOT_RETRANSMIT_TIMEOUT);
+    }
+
+    snapshot_layout_close(&layout);
+    free(sent_time);
+    free(packet);
+
+    mcslock_acquire(&raft->lock);
+    if(rc == 0 && raft->state == LEADER && raft->current_term == term) {
+	spinlock_acquire(&raft->progress[follower_id].lock);
+	raft->progress[follower_id].state = REPLICATION_PIPELINE;
+	raft->progress[follower_id].next_index = snapshot_id;
+	raft->progress[follower_id].match_index = snapshot_id - 1;
+	raft->progress[follower_id].progress_time = Raft_get_time_msec();
+	raft->progress[follower_id].last_response_time = Raft_get_time_msec(); // it is alive until it responds to the appends
+	spinlock_release(&raft->progress[follower_id].lock);
+	printf("SUCCESSFULLY INSTALLED A SNAPSHOT\n");
+    } else {
+	rc = -1;
+	spinlock_acquire(&raft->progress[follower_id].lock);
+	raft->progress[follower_id].state = REPLICATION_PROBE;
+	spinlock_release(&raft->progress[follower_id].lock);
+	printf("ABORTING SENDING A SNAPSHOT\n");
+    }
+    int remove_snapshot = Raft_release_snapshot(raft, snapshot_id);
+    transfer->active = 0;
+    mcslock_release(&raft->lock);
+
+    if(remove_snapshot) {
+	Raft_remove_snapshot(raft, snapshot_id);
+    }
+    return rc;
+}
+
+void* Raft_snapshot_sender_thread(void *arg) {
+    raft_snapshot_sender_arg_t *sender_arg = (raft_snapshot_sender_arg_t*)arg;
+    Raft_send_snapshot(sender_arg->raft, sender_arg->follower_id, &sender_arg->addr);
+    free(arg);
+    pthread_exit(0);
+}
+
+void Raft_start_snapshot_sender(raft_state_t *raft, int follower_id, struct sockaddr_in *addr) {
+    if(raft->snapshot_transfer[follower_id].active) return;
+    raft->snapshot_transfer[follower_id].active = 1;
+
+    raft_snapshot_sender_arg_t *arg = malloc(sizeof(raft_snapshot_sender_arg_t));
+    arg->raft = raft; arg->follower_id = follower_id; arg->addr = *addr;
+    pthread_t tid;
+    pthread_create(&tid, NULL, Raft_snapshot_sender_thread, arg);
+    pthread_detach(tid);
+}
+
+void Raft_handle_install_response(raft_state_t *raft, raft_install_snapshot_response_t *response) {
+    if(response->term > raft->current_term) {
+	mcslock_acquire(&raft->lock);
+	if(response->term > raft->current_term) {
+	    Raft_convert_to_follower(raft, response->term);
+	    Raft_save_state(raft);
+	}
+	mcslock_release(&raft->lock);
+	return;
+    }
+    if(response->id < 0 || response->id > MAX_SERVER_ID) return;
+
+    raft_snapshot_transfer_t *transfer = &raft->snapshot_transfer[response->id];
+    spinlock_acquire(&transfer->lock);
+    if(transfer->snapshot_id == response->snapshot_id) {
+	// the follower's state is authoritative: if it lost the chunks, we resend them
+	transfer->acked_seq = response->next_seq;
+	transfer->acked_offset = response->offset;
+	transfer->sack = response->sack;
+	transfer->checksum = response->checksum;
+	transfer->n_acks ++;
+	transfer->done = response->done;
+	if(!response->success) {
+	    printf("error installing snapshot (follower probably relaunched)\n");
+	    transfer->failed = 1;
+	}
+	transfer->last_ack_time = Raft_get_time_msec();
+    }
+    spinlock_release(&transfer->lock);
+    eventcount_signal(&transfer->acked);
+}
@@ -0,0 +1,21 @@
+#ifndef __RAFT_SNAPSHOT_SENDER_h__
+#define __RAFT_SNAPSHOT_SENDER_h__
+
+#include "raft.h"
+
+// send_snapshot()
+// streams the latest snapshot to the follower and waits until it is installed.
+// up to SNAPSHOT_WINDOW chunks are in flight at once; the follower acknowledges
+// the contiguous prefix of the stream it has received together with the chunks it received out of order,
+// so only the missing chunks are retransmitted.
+// the raft lock must NOT be held by the caller; returns 0 if the snapshot was installed
+int Raft_send_snapshot(raft_state_t *raft, int follower_id, struct sockaddr_in *addr);
+
+// start_snapshot_sender()
+// starts a thread sending the snapshot to the follower unless one is already running
+// the raft lock must be held by the caller
+void Raft_start_snapshot_sender(raft_state_t *raft, int follower_id, struct sockaddr_in *addr);
+
+void Raft_handle_install_response(raft_state_t *raft, raft_install_snapshot_response_t *response);
+
+#endif
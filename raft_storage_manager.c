@@ -1,64 +1,625 @@
 #include "packet_format.h"
 #include "raft_storage_manager.h"
 #include "raft.h"
+#include "raft_log.h"
+#include "raft_utils.h"
+#include <limits.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
-void Raft_load_state(raft_state_t *raft, char filedir[256]) {
-    char raft_file[256];
-    sprintf(raft_file,  "%sraft_state", filedir);
-    FILE *f = fopen(raft_file, "rb");
-    fread(raft, sizeof(raft_state_t), 1, f);
+// makes the creation, removal, and renames of the files in the directory durable
+void Raft_sync_dir(char *files_dir) {
+    int fd = open(files_dir, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// the state files (raft_state, install_progress, apply_checkpoint) hold a struct followed by its checksum,
+// and are replaced atomically: the struct is written to tmp_<name>, synced, and renamed
+int Raft_save_checksummed(char *files_dir, char *name, void *data, int size) {
+    char tmp_file[PATH_MAX], file[PATH_MAX];
+    snprintf(tmp_file, sizeof(tmp_file), "%stmp_%s", files_dir, name);
+    snprintf(file, sizeof(file), "%s%s", files_dir, name);
+    unsigned int crc = Raft_checksum(0, data, size);
+    FILE *f = fopen(tmp_file, "wb");
+    if(f == NULL) return -1;
+    int ok = fwrite(data, size, 1, f) == 1 && fwrite(&crc, sizeof(crc), 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0;
     fclose(f);
+    // the old file stays in place unless the new one is complete on disk
+    if(!ok || rename(tmp_file, file) != 0) return -1;
+    Raft_sync_dir(files_dir);
+    return 0;
 }
 
-void Raft_save_state(raft_state_t *raft) {
-    char tmp_raft_file[256];
-    strcpy(tmp_raft_file, raft->files_dir);
-    strcat(tmp_raft_file, "tmp_raft_state");
-    FILE *f = fopen(tmp_raft_file, "wb");
-    fwrite(raft, sizeof(raft_state_t), 1, f);
-    fflush(f);
+// returns -1 if the file is missing or corrupted
+int Raft_load_checksummed(char *files_dir, char *name, void *data, int size) {
+    char file[PATH_MAX];
+    sprintf(file, "%s%s", files_dir, name);
+    FILE *f = fopen(file, "rb");
+    if(f == NULL) return -1;
+    unsigned int crc;
+    int ok = fread(data, size, 1, f) == 1 && fread(&crc, sizeof(crc), 1, f) == 1;
     fclose(f);
+    return (ok && crc == Raft_checksum(0, data, size)) ? 0 : -1;
+}
+
+int Raft_load_state(raft_state_t *raft, char filedir[256]) {
+    raft_persistent_state_t *state = &raft->saved_state;
+    if(Raft_load_checksummed(filedir, "raft_state", state, sizeof(raft_persistent_state_t)) != 0) return -1;
+    raft->id = state->id;
+    raft->group = state->group;
+    raft->current_term = state->current_term;
+    raft->voted_for = state->voted_for;
+    raft->start_log_index = state->start_log_index;
+    raft->snapshot_lock_state = state->snapshot_lock_state;
+    raft->snapshot_membership = state->snapshot_membership;
+    return 0;
+}
+
+void Raft_save_state(raft_state_t *raft) {
+    raft_persistent_state_t state;
+    bzero(&state, sizeof(state)); // compared as a whole, padding included
+    state.id = raft->id;
+    state.group = raft->group;
+    state.current_term = raft->current_term;
+    state.voted_for = raft->voted_for;
+    state.start_log_index = raft->start_log_index;
+    state.snapshot_lock_state = raft->snapshot_lock_state;
+    state.snapshot_membership = raft->snapshot_membership;
+    if(memcmp(&state, &raft->saved_state, sizeof(state)) == 0) return;
+    if(Raft_save_checksummed(raft->files_dir, "raft_state", &state, sizeof(state)) == 0) raft->saved_state = state;
+}
+
+// log files
+// file log_<k> is a sequence of records (raft_log_record_header_t followed by the entry), each padded to 8 bytes.
+// once it has all the entries of [k, k + LOG_FILE_ENTRIES), the file is sealed with a footer
+// (the offsets of the records followed by raft_log_footer_t), so that it can be mapped and read in place.
+// every record and the offsets are checksummed: the log is loaded up to the first corrupted record
+typedef struct raft_log_footer {
+    unsigned int magic;
+    int first_index;
+    int n_entries;
+    unsigned int crc; // of the offsets
+    long offsets_offset;
+} raft_log_footer_t;
+
+unsigned int Raft_log_record_crc(raft_log_record_header_t *header, raft_log_entry_t *entry) {
+    return Raft_checksum(Raft_checksum(0, (char*)header, 2*sizeof(int)), (char*)entry, header->size);
+}
+
+int Raft_log_record_size(int entry_size) {
+    return (sizeof(raft_log_record_header_t) + entry_size + 7) & ~7;
+}
+
+void Raft_get_log_file_path(raft_state_t *raft, int base, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%slog_%i", raft->files_dir, base);
+}
+
+int Raft_log_file_last_base(raft_log_file_t *log_file) {
+    if(log_file->base != -1) return log_file->base;
+    return (log_file->end_index - 1) - (log_file->end_index - 1) % LOG_FILE_ENTRIES;
+}
+
+int Raft_compare_int(const void *a, const void *b) {
+    return *(int*)a - *(int*)b;
+}
+
+// bases of all the log files in the directory, in increasing order
+int Raft_list_log_files(raft_state_t *raft, int **bases) {
+    int n = 0, capacity = 16;
+    *bases = malloc(capacity * sizeof(int));
+    DIR *dir = opendir(raft->files_dir);
+    if(dir == NULL) return 0;
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+	int base;
+	char c;
+	if(sscanf(ent->d_name, "log_%i%c", &base, &c) != 1) continue;
+	if(n == capacity) {
+	    capacity *= 2;
+	    *bases = realloc(*bases, capacity * sizeof(int));
+	}
+	(*bases)[n++] = base;
+    }
+    closedir(dir);
+    qsort(*bases, n, sizeof(int), Raft_compare_int);
+    return n;
+}
+
+void Raft_remove_log_file(raft_state_t *raft, int base) {
+    char path[PATH_MAX];
+    Raft_get_log_file_path(raft, base, path);
+    remove(path);
+}
+
+void Raft_reset_log_file_state(raft_log_file_t *log_file, int end_index) {
+    log_file->base = -1;
+    log_file->first_index = end_index;
+    log_file->n_entries = 0;
+    log_file->size = 0;
+    log_file->end_index = end_index;
+    log_file->oldest_base = end_index - end_index % LOG_FILE_ENTRIES;
+}
+
+void Raft_reset_log_files(raft_state_t *raft) {
+    int *bases;
+    int n = Raft_list_log_files(raft, &bases);
+    for(int i = 0; i < n; ++i) Raft_remove_log_file(raft, bases[i]);
+    free(bases);
+    Raft_reset_log_file_state(&raft->log_file, raft->start_log_index);
+}
+
+void Raft_init_log_files(raft_state_t *raft) {
+    raft->log_file.offsets = malloc(LOG_FILE_ENTRIES * sizeof(long));
+    Raft_reset_log_files(raft);
+}
+
+void Raft_remove_log_prefix(raft_state_t *raft) {
+    raft_log_file_t *log_file = &raft->log_file;
+    int last_base = Raft_log_file_last_base(log_file);
+    while(log_file->oldest_base + LOG_FILE_ENTRIES <= raft->start_log_index && log_file->oldest_base <= last_base) {
+	Raft_remove_log_file(raft, log_file->oldest_base);
+	log_file->oldest_base += LOG_FILE_ENTRIES;
+    }
+}
+
+void Raft_seal_log_file(raft_state_t *raft) {
+    raft_log_file_t *log_file = &raft->log_file;
+    raft_log_footer_t footer;
+    footer.magic = LOG_FILE_MAGIC;
+    footer.first_index = log_file->first_index;
+    footer.n_entries = log_file->n_entries;
+    footer.offsets_offset = log_file->size;
+    footer.crc = Raft_checksum(0, (char*)log_file->offsets, log_file->n_entries * sizeof(long));
+
+    char path[PATH_MAX];
+    Raft_get_log_file_path(raft, log_file->base, path);
+    // the records were synced as they were written; a file without a valid footer is read record by record on restart
+    int fd = open(path, O_WRONLY);
+    if(fd >= 0) {
+	long offsets_size = log_file->n_entries * sizeof(long);
+	if(pwrite(fd, log_file->offsets, offsets_size, log_file->size) == offsets_size) {
+	    pwrite(fd, &footer, sizeof(footer), log_file->size + offsets_size);
+	}
+	fdatasync(fd);
+	close(fd);
+    }
+
+    log_file->base = -1;
+    log_file->n_entries = 0;
+    log_file->size = 0;
+}
+
+// reads the footer of a sealed log file; returns 0 if it is valid
+int Raft_read_log_footer(int fd, int base, long file_size, raft_log_footer_t *footer) {
+    if(file_size < sizeof(raft_log_footer_t)) return -1;
+    if(pread(fd, footer, sizeof(raft_log_footer_t), file_size - sizeof(raft_log_footer_t)) != sizeof(raft_log_footer_t)) return -1;
+    if(footer->magic != LOG_FILE_MAGIC || footer->first_index < base || footer->first_index + footer->n_entries != base + LOG_FILE_ENTRIES) return -1;
+    if(footer->offsets_offset + footer->n_entries * sizeof(long) + sizeof(raft_log_footer_t) != file_size) return -1;
+    return 0;
+}
+
+// writes the log file of base again from the entries in memory, up to index (when it cannot be read back or cut)
+void Raft_rewrite_log_file(raft_state_t *raft, int base, int index) {
+    raft_log_file_t *log_file = &raft->log_file;
+    int first = (raft->start_log_index > base) ? raft->start_log_index : base;
+    Raft_remove_log_file(raft, base);
+    log_file->base = -1;
+    log_file->end_index = first;
+    for(int i = first; i < index; ++i) Raft_write_log_entry(raft, i, Raft_get_log(raft, i));
+}
+
+// drops all the entries starting from index from the log files
+void Raft_truncate_log_files(raft_state_t *raft, int index) {
+    raft_log_file_t *log_file = &raft->log_file;
+    int base = index - index % LOG_FILE_ENTRIES;
+    int last_base = Raft_log_file_last_base(log_file);
+    for(int b = base + LOG_FILE_ENTRIES; b <= last_base; b += LOG_FILE_ENTRIES) {
+	Raft_remove_log_file(raft, b);
+    }
+
+    if(log_file->base != base) {
+	// the file is sealed: the entries read from its mapping are copied to memory before the footer is cut off
+	// (a reader holding the mapping, like the snapshot scheduler, keeps it mapped until it lets it go)
+	for(int i = base; i < base + LOG_FILE_ENTRIES; i += LOG_SEGMENT_SIZE) {
+	    raft_log_mapping_t *mapping = Raft_log_get_mapping(&raft->log, i);
+	    if(mapping == NULL) continue;
+	    Raft_log_unmap(&raft->log, mapping);
+	    break;
+	}
+    }
+
+    char path[PATH_MAX];
+    Raft_get_log_file_path(raft, base, path);
+    int fd = open(path, O_RDWR);
+    int ok = (fd >= 0);
+    if(ok && log_file->base != base) {
+	// the record offsets are read back from the footer
+	struct stat st;
+	raft_log_footer_t footer;
+	ok = fstat(fd, &st) == 0 && Raft_read_log_footer(fd, base, st.st_size, &footer) == 0 &&
+	    pread(fd, log_file->offsets, footer.n_entries * sizeof(long), footer.offsets_offset) == footer.n_entries * sizeof(long);
+	if(ok) {
+	    log_file->base = base;
+	    log_file->first_index = footer.first_index;
+	}
+    }
+    if(ok && index >= log_file->first_index) {
+	log_file->n_entries = index - log_file->first_index;
+	log_file->size = log_file->offsets[log_file->n_entries];
+	log_file->end_index = index;
+	ok = (ftruncate(fd, log_file->size) == 0);
+    } else {
+	ok = 0;
+    }
+    if(fd >= 0) close(fd);
+    if(!ok) Raft_rewrite_log_file(raft, base, index);
+}
+
+int Raft_save_log_entry(raft_state_t *raft, int index) {
+    return Raft_write_log_entry(raft, index, Raft_get_log(raft, index));
+}
+
+int Raft_write_log_entry(raft_state_t *raft, int index, raft_log_entry_t *entry) {
+    raft_log_file_t *log_file = &raft->log_file;
+    if(index < log_file->end_index) {
+	Raft_truncate_log_files(raft, index);
+    } else if(index > log_file->end_index) {
+	// should not happen: the entries before index were never saved
+	Raft_reset_log_files(raft);
+	Raft_reset_log_file_state(log_file, index);
+    }
+
+    char path[PATH_MAX];
+    int base = index - index % LOG_FILE_ENTRIES;
+    Raft_get_log_file_path(raft, base, path);
+    if(log_file->base != base) {
+	log_file->base = base;
+	log_file->first_index = index;
+	log_file->n_entries = 0;
+	log_file->size = 0;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0) return -1;
+	close(fd);
+	Raft_sync_dir(raft->files_dir);
+    }
+
+    int size = Raft_log_entry_size(entry);
+    int record_size = Raft_log_record_size(size);
+    char *record = calloc(1, record_size);
+    raft_log_record_header_t *header = (raft_log_record_header_t*)record;
+    header->index = index;
+    header->size = size;
+    header->crc = Raft_log_record_crc(header, entry);
+    memcpy(record + sizeof(raft_log_record_header_t), entry, size);
+
+    int fd = open(path, O_WRONLY);
+    int written = (fd >= 0) ? pwrite(fd, record, record_size, log_file->size) : -1;
+    if(fd >= 0) close(fd);
+    free(record);
+    if(written != record_size) return -1; // nothing is recorded: the entry is written again at the same offset
+
+    log_file->offsets[log_file->n_entries++] = log_file->size;
+    log_file->size += record_size;
+    log_file->end_index = index + 1;
+    if(index == base + LOG_FILE_ENTRIES - 1) {
+	Raft_seal_log_file(raft);
+    }
+    return 0;
+}
+
+int Raft_sync_log_files(raft_state_t *raft) {
+    raft_log_file_t *log_file = &raft->log_file;
+    if(log_file->base == -1) return 0; // the last file is sealed, and synced with its footer
+    char path[PATH_MAX];
+    Raft_get_log_file_path(raft, log_file->base, path);
+    int fd = open(path, O_WRONLY);
+    if(fd < 0) return -1;
+    int rc = fdatasync(fd);
+    close(fd);
+    return rc;
+}
+
+// checks the records and the offsets of a mapped sealed file; returns 0 if none is corrupted
+int Raft_verify_log_mapping(raft_log_mapping_t *mapping, raft_log_footer_t *footer) {
+    if(footer->crc != Raft_checksum(0, (char*)mapping->offsets, mapping->n_entries * sizeof(long))) return -1;
+    for(int i = 0; i < mapping->n_entries; ++i) {
+	long offset = mapping->offsets[i];
+	if(offset < 0 || offset + sizeof(raft_log_record_header_t) > footer->offsets_offset) return -1;
+	raft_log_record_header_t *header = (raft_log_record_header_t*)(mapping->addr + offset);
+	if(header->index != mapping->first_index + i || header->size <= 0 || header->size > sizeof(raft_log_entry_t)) return -1;
+	if(offset + Raft_log_record_size(header->size) > footer->offsets_offset) return -1;
+	if(header->crc != Raft_log_record_crc(header, (raft_log_entry_t*)(header + 1))) return -1;
+    }
+    return 0;
+}
+
+// reads the records of an unsealed log file to memory; the file is truncated at the first torn or corrupted record
+// returns -1 if the file does not continue the log
+int Raft_load_log_records(raft_state_t *raft, int fd, int base) {
+    raft_log_file_t *log_file = &raft->log_file;
+    raft_log_entry_t *entry = malloc(sizeof(raft_log_entry_t));
+    long offset = 0;
+    int next_index = -1;
+    raft_log_record_header_t header;
+    while(pread(fd, &header, sizeof(header), offset) == sizeof(header)) {
+	int index = header.index, size = header.size;
+	if(size <= 0 || size > sizeof(raft_log_entry_t) || index < base || index >= base + LOG_FILE_ENTRIES) break;
+	if(next_index == -1) {
+	    if(index > raft->log_count) break; // a gap after the previous file
+	    log_file->first_index = index;
+	} else if(index != next_index) {
+	    break;
+	}
+	bzero(entry, sizeof(raft_log_entry_t));
+	if(pread(fd, entry, size, offset + sizeof(header)) != size) break; // torn record
+	if(header.crc != Raft_log_record_crc(&header, entry)) break;
+
+	if(index >= raft->start_log_index) {
+	    Raft_log_put(&raft->log, index, entry);
+	    raft->log_count = index + 1;
+	}
+	log_file->offsets[index - log_file->first_index] = offset;
+	offset += Raft_log_record_size(size);
+	next_index = index + 1;
+    }
+    free(entry);
+
+    if(next_index == -1) return -1;
+    ftruncate(fd, offset);
+    log_file->base = base;
+    log_file->n_entries = next_index - log_file->first_index;
+    log_file->size = offset;
+    log_file->end_index = next_index;
+    return 0;
+}
+
+void Raft_load_log(raft_state_t *raft) {
+    raft_log_file_t *log_file = &raft->log_file;
+    Raft_log_init(&raft->log, raft->start_log_index);
+    raft->log_count = raft->start_log_index;
+    log_file->offsets = malloc(LOG_FILE_ENTRIES * sizeof(long));
+    Raft_reset_log_file_state(log_file, raft->start_log_index);
+
+    int *bases;
+    int n = Raft_list_log_files(raft, &bases);
+    int broken = 0;
+    for(int i = 0; i < n; ++i) {
+	int base = bases[i];
+	if(base + LOG_FILE_ENTRIES <= raft->start_log_index || broken) {
+	    Raft_remove_log_file(raft, base);
+	    continue;
+	}
+	if(log_file->end_index == raft->start_log_index) log_file->oldest_base = base;
+
+	char path[PATH_MAX];
+	Raft_get_log_file_path(raft, base, path);
+	int fd = open(path, O_RDWR);
+	struct stat st;
+	fstat(fd, &st);
+
+	raft_log_footer_t footer;
+	raft_log_mapping_t *mapping = NULL;
+	if(Raft_read_log_footer(fd, base, st.st_size, &footer) == 0 && footer.first_index <= raft->log_count) {
+	    mapping = malloc(sizeof(raft_log_mapping_t));
+	    mapping->addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	    mapping->size = st.st_size;
+	    mapping->offsets = (long*)(mapping->addr + footer.offsets_offset);
+	    mapping->first_index = footer.first_index;
+	    mapping->n_entries = footer.n_entries;
+	    mapping->refcount = 0;
+	    if(Raft_verify_log_mapping(mapping, &footer) != 0) {
+		printf("corrupted log file %s: loading its valid records\n", path);
+		munmap(mapping->addr, mapping->size);
+		free(mapping);
+		mapping = NULL;
+	    }
+	}
+	if(mapping != NULL) {
+	    // sealed: the entries are read from the mapping when they are needed
+	    Raft_log_map(&raft->log, mapping);
+	    raft->log_count = base + LOG_FILE_ENTRIES;
+	    log_file->end_index = raft->log_count;
+	} else if(Raft_load_log_records(raft, fd, base) == 0) {
+	    if(log_file->end_index == base + LOG_FILE_ENTRIES) {
+		Raft_seal_log_file(raft); // only the footer was lost
+	    } else {
+		broken = 1; // the unsealed file is the last one
+	    }
+	} else {
+	    broken = 1;
+	    Raft_remove_log_file(raft, base);
+	}
+	close(fd);
+    }
+    free(bases);
+
+    if(log_file->end_index <= raft->start_log_index) {
+	// nothing after the snapshot
+	Raft_reset_log_files(raft);
+    }
+}
+
+// persists the contiguous prefix of the snapshot being installed (removes the file if there is no install)
+void Raft_save_install_progress(raft_state_t *raft) {
+    char raft_file[PATH_MAX];
+    snprintf(raft_file, sizeof(raft_file), "%sinstall_progress", raft->files_dir);
+    if(raft->install_snapshot_id == -1) {
+	remove(raft_file);
+	return;
+    }
+
+    raft_install_progress_t progress;
+    progress.snapshot_id = raft->install_snapshot_id;
+    progress.seq = raft->install_snapshot_seq;
+    progress.offset = raft->install_snapshot_offset;
+    progress.checksum = raft->install_snapshot_checksum;
+    Raft_save_checksummed(raft->files_dir, "install_progress", &progress, sizeof(raft_install_progress_t));
 
-    char raft_file[256];
-    strcpy(raft_file, raft->files_dir);
-    strcat(raft_file, "raft_state");
-    rename(tmp_raft_file, raft_file);
+    raft->install_snapshot_saved_offset = progress.offset;
 }
 
-int Raft_get_snapshot_path(raft_state_t *raft, int id, char path[256]) {
+int Raft_load_install_progress(raft_state_t *raft, raft_install_progress_t *progress) {
+    return Raft_load_checksummed(raft->files_dir, "install_progress", progress, sizeof(raft_install_progress_t));
+}
+
+int Raft_get_snapshot_path(raft_state_t *raft, int id, char path[PATH_MAX]) {
     if(id == -1) {
 	sprintf(path, "%s", raft->files_dir);
     } else {
-	sprintf(path, "%ssnapshot_%i/", raft->files_dir, id);
+	snprintf(path, PATH_MAX, "%ssnapshot_%i/", raft->files_dir, id);
     }
     return strlen(path);
 }
 
 void Raft_create_snapshot_dir(raft_state_t *raft, int snapshot_id) {
-    char dir[256];
+    char dir[PATH_MAX];
     Raft_get_snapshot_path(raft, snapshot_id, dir);
     mode_t mod = 0777;
     mkdir(dir, mod);
 }
 
 void Raft_remove_snapshot(raft_state_t *raft, int snapshot_id) {
-    char path[256];
+    char path[PATH_MAX];
     int path_len = Raft_get_snapshot_path(raft, snapshot_id, path);
 
-    for(int file_ind = 0; file_ind < 100; ++file_ind) {
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
 	sprintf(path + path_len, "file_%i", file_ind);
 	remove(path);
     }
+    sprintf(path + path_len, "checksums");
+    remove(path);
     Raft_get_snapshot_path(raft, snapshot_id, path);
     rmdir(path);
 }
 
+void Raft_remove_snapshots_except(raft_state_t *raft, int keep1, int keep2) {
+    DIR *dir = opendir(raft->files_dir);
+    if(dir == NULL) return;
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+	int snapshot_id;
+	char c;
+	if(sscanf(ent->d_name, "snapshot_%i%c", &snapshot_id, &c) != 1) continue;
+	if(snapshot_id == keep1 || snapshot_id == keep2) continue;
+	Raft_remove_snapshot(raft, snapshot_id);
+    }
+    closedir(dir);
+}
+
+typedef struct raft_snapshot_checksums {
+    long size[N_MAIN_FILES]; // -1 if there is no such file
+    unsigned int crc[N_MAIN_FILES];
+} raft_snapshot_checksums_t;
+
+void Raft_compute_snapshot_checksums(raft_state_t *raft, int snapshot_id, raft_snapshot_checksums_t *checksums) {
+    char path[PATH_MAX];
+    int path_len = Raft_get_snapshot_path(raft, snapshot_id, path);
+    char *buffer = malloc(SNAPSHOT_CHUNK_SIZE);
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
+	sprintf(path + path_len, "file_%i", file_ind);
+	checksums->size[file_ind] = -1;
+	checksums->crc[file_ind] = 0;
+	FILE *f = fopen(path, "r");
+	if(f == NULL) continue;
+	checksums->size[file_ind] = 0;
+	size_t nread;
+	while((nread = fread(buffer, 1, SNAPSHOT_CHUNK_SIZE, f)) > 0) {
+	    checksums->crc[file_ind] = Raft_checksum(checksums->crc[file_ind], buffer, nread);
+	    checksums->size[file_ind] += nread;
+	}
+	fclose(f);
+    }
+    free(buffer);
+}
+
+void Raft_seal_snapshot(raft_state_t *raft, int snapshot_id) {
+    raft_snapshot_checksums_t checksums;
+    Raft_compute_snapshot_checksums(raft, snapshot_id, &checksums);
+    char path[PATH_MAX];
+    Raft_get_snapshot_path(raft, snapshot_id, path);
+    Raft_save_checksummed(path, "checksums", &checksums, sizeof(checksums));
+}
+
+int Raft_verify_snapshot(raft_state_t *raft, int snapshot_id) {
+    raft_snapshot_checksums_t saved, checksums;
+    char path[PATH_MAX];
+    Raft_get_snapshot_path(raft, snapshot_id, path);
+    if(Raft_load_checksummed(path, "checksums", &saved, sizeof(saved)) != 0) return -1;
+    Raft_compute_snapshot_checksums(raft, snapshot_id, &checksums);
+    return (memcmp(&saved, &checksums, sizeof(checksums)) == 0) ? 0 : -1;
+}
+
+// returns the number of the main file, -1 if it is not one
+int Raft_main_file_index(char filename[256]) {
+    int file_ind;
+    char c;
+    if(sscanf(filename, "file_%i%c", &file_ind, &c) != 1) return -1;
+    return (file_ind >= 0 && file_ind < N_MAIN_FILES) ? file_ind : -1;
+}
+
+void Raft_update_main_file_size(raft_state_t *raft, char filename[256]) {
+    int file_ind = Raft_main_file_index(filename);
+    if(file_ind == -1) return;
+    char path[PATH_MAX];
+    sprintf(path, "%s%s", raft->files_dir, filename);
+    struct stat st;
+    raft->apply_checkpoint.file_size[file_ind] = (stat(path, &st) == 0) ? st.st_size : 0;
+}
+
+void Raft_save_apply_checkpoint(raft_state_t *raft, int applied_index) {
+    raft->apply_checkpoint.applied_index = applied_index;
+    raft->apply_checkpoint.lock_state = raft->lock_state;
+    Raft_save_checksummed(raft->files_dir, "apply_checkpoint", &raft->apply_checkpoint, sizeof(raft_apply_checkpoint_t));
+}
+
+void Raft_reset_apply_checkpoint(raft_state_t *raft, int applied_index) {
+    char filename[256];
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
+	sprintf(filename, "file_%i", file_ind);
+	Raft_update_main_file_size(raft, filename);
+    }
+    Raft_save_apply_checkpoint(raft, applied_index);
+}
+
+void Raft_remove_apply_checkpoint(raft_state_t *raft) {
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%sapply_checkpoint", raft->files_dir);
+    remove(file);
+}
+
+int Raft_restore_main_files(raft_state_t *raft) {
+    if(Raft_load_checksummed(raft->files_dir, "apply_checkpoint", &raft->apply_checkpoint, sizeof(raft_apply_checkpoint_t)) != 0) return -1;
+
+    // the entries up to applied_index must still be in the snapshot or in the log
+    raft_apply_checkpoint_t *checkpoint = &raft->apply_checkpoint;
+    if(checkpoint->applied_index < raft->start_log_index - 1 || checkpoint->applied_index >= raft->log_count) return -1;
+
+    char path[PATH_MAX];
+    struct stat st[N_MAIN_FILES];
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
+	snprintf(path, sizeof(path), "%sfile_%i", raft->files_dir, file_ind);
+	if(stat(path, &st[file_ind]) != 0) st[file_ind].st_size = 0;
+	if(st[file_ind].st_size < checkpoint->file_size[file_ind]) return -1;
+    }
+    // drop whatever the entries after the checkpoint wrote: they are applied again
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
+	if(st[file_ind].st_size == checkpoint->file_size[file_ind]) continue;
+	snprintf(path, sizeof(path), "%sfile_%i", raft->files_dir, file_ind);
+	truncate(path, checkpoint->file_size[file_ind]);
+    }
+    return 0;
+}
+
 void Raft_clean_main_files(raft_state_t *raft) {
-    char path[256];
+    char path[PATH_MAX];
     strcpy(path, raft->files_dir);
-    for(int file_ind = 0; file_ind < 100; ++file_ind) {
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
 	sprintf(path + strlen(raft->files_dir), "file_%i", file_ind);
 	FILE *f = fopen(path, "w");
 	fclose(f);
@@ -66,12 +627,12 @@ void Raft_clean_main_files(raft_state_t *raft) {
 }
 
 void Raft_copy_snapshot(raft_state_t *raft, int source_snapshot_id, int dest_snapshot_id) {
-    char dir1[256], dir2[256];
+    char dir1[PATH_MAX], dir2[PATH_MAX];
     int dir1_len = Raft_get_snapshot_path(raft, source_snapshot_id, dir1);
     int dir2_len = Raft_get_snapshot_path(raft, dest_snapshot_id, dir2);
-    
+    char *buffer = malloc(SNAPSHOT_CHUNK_SIZE);
 
-    for(int file_ind = 0; file_ind < 100; ++file_ind) {
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
 	sprintf(dir1 + dir1_len, "file_%i", file_ind);
     	FILE *f1 = fopen(dir1, "r");
 	if(f1 == NULL) continue;
@@ -79,17 +640,18 @@ void Raft_copy_snapshot(raft_state_t *raft, int source_snapshot_id, int dest_sna
 	sprintf(dir2 + dir2_len, "file_%i", file_ind);
 	FILE *f2 = fopen(dir2, "w");
 
-	int a;
-	while((a = fgetc(f1)) != EOF) {
-	    fputc(a, f2);
+	size_t nread;
+	while((nread = fread(buffer, 1, SNAPSHOT_CHUNK_SIZE, f1)) > 0) {
+	    fwrite(buffer, 1, nread, f2);
 	}
 	fclose(f1);
 	fclose(f2);
     }
+    free(buffer);
 }
 
 void Raft_add_to_snapshot(raft_state_t *raft, int snapshot_id, int create_new_sn, char filename[256], char buffer[BUFFER_SIZE]) {
-    char dir[256];
+    char dir[PATH_MAX];
     Raft_get_snapshot_path(raft, snapshot_id, dir);
     if(create_new_sn) {
         mode_t mod = 0777;
@@ -104,33 +666,73 @@ void Raft_add_to_snapshot(raft_state_t *raft, int snapshot_id, int create_new_sn
 }
 
 
-void snapshot_it_init(snapshot_iterator_t *it, raft_state_t *raft, int snapshot_id) {
-    it->fileno = -1;
-    it->f = NULL;
-    it->raft = raft;
-    it->snapshot_id = snapshot_id;
+void Raft_write_snapshot_chunk(raft_state_t *raft, int snapshot_id, char filename[256], long offset, char *buffer, int len) {
+    char path[PATH_MAX];
+    Raft_get_snapshot_path(raft, snapshot_id, path);
+    sprintf(path + strlen(path), "%s", filename);
+
+    int fd = open(path, O_WRONLY | O_CREAT, 0666);
+    if(fd < 0) return;
+    pwrite(fd, buffer, len, offset);
+    close(fd);
 }
 
-int snapshot_it_get_next(snapshot_iterator_t *it, char filename[256], char buffer[BUFFER_SIZE]) {
-    char dir[256];
-    int dir_len = Raft_get_snapshot_path(it->raft, it->snapshot_id, dir);
-    while(it->f == NULL) {
-	it->fileno++;
-	if(it->fileno >= 100) return 0;
-	
-	sprintf(dir + dir_len, "file_%i", it->fileno);
-	it->f = fopen(dir, "rb");
-    }
+void snapshot_layout_init(snapshot_layout_t *layout, raft_state_t *raft, int snapshot_id) {
+    char dir[PATH_MAX];
+    int dir_len = Raft_get_snapshot_path(raft, snapshot_id, dir);
 
-    sprintf(filename, "file_%i", it->fileno);
+    layout->snapshot_id = snapshot_id;
+    layout->n_files = 0;
+    layout->n_chunks = 0;
+    layout->total_size = 0;
+    for(int file_ind = 0; file_ind < N_MAIN_FILES; ++file_ind) {
+	sprintf(dir + dir_len, "file_%i", file_ind);
+	int fd = open(dir, O_RDONLY);
+	if(fd < 0) continue;
 
-    bzero(buffer, BUFFER_SIZE);
-    int nread = fread(buffer, sizeof(char), BUFFER_SIZE, it->f);
-    if(nread < BUFFER_SIZE) {
-	fclose(it->f);
-	it->f = NULL;
+	struct stat st;
+	fstat(fd, &st);
+	int n = layout->n_files++;
+	layout->fileno[n] = file_ind;
+	layout->fd[n] = fd;
+	layout->size[n] = st.st_size;
+	layout->offset[n] = layout->total_size;
+	layout->first_chunk[n] = layout->n_chunks;
+
+	layout->total_size += st.st_size;
+	layout->n_chunks += (st.st_size == 0) ? 1 : (st.st_size + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
     }
-    return 1;
 }
 
+int snapshot_layout_read_chunk(snapshot_layout_t *layout, int seq, raft_install_snapshot_request_t *chunk) {
+    if(seq < 0 || seq >= layout->n_chunks) return -1;
+
+    // binary search for the last file starting at or before the chunk
+    int l = 0, r = layout->n_files - 1;
+    while(l < r) {
+	int m = (l + r + 1) / 2;
+	if(layout->first_chunk[m] <= seq) l = m;
+	else r = m - 1;
+    }
+
+    long file_offset = (long)(seq - layout->first_chunk[l]) * SNAPSHOT_CHUNK_SIZE;
+    long len = layout->size[l] - file_offset;
+    if(len > SNAPSHOT_CHUNK_SIZE) len = SNAPSHOT_CHUNK_SIZE;
 
+    sprintf(chunk->filename, "file_%i", layout->fileno[l]);
+    chunk->seq = seq;
+    chunk->n_chunks = layout->n_chunks;
+    chunk->file_offset = file_offset;
+    chunk->offset = layout->offset[l] + file_offset;
+    chunk->len = pread(layout->fd[l], chunk->buffer, len, file_offset);
+    if(chunk->len < 0) chunk->len = 0;
+    chunk->crc = Raft_checksum(0, chunk->buffer, chunk->len);
+    return 0;
+}
+
+void snapshot_layout_close(snapshot_layout_t *layout) {
+    for(int i = 0; i < layout->n_files; ++i) {
+	close(layout->fd[i]);
+    }
+    layout->n_files = 0;
+}
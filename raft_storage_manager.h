@@ -4,29 +4,114 @@
 #include "packet_format.h"
 #include "raft.h"
 
-void Raft_load_state(raft_state_t *raft, char filedir[256]);
+// the state files are checksummed (CRC32C); returns -1 if the state is missing or corrupted
+int Raft_load_state(raft_state_t *raft, char filedir[256]);
 
+// save_state()
+// saves the persistent state (see raft_persistent_state_t) if it changed since it was last saved; the raft lock must be held
 void Raft_save_state(raft_state_t *raft);
 
+// log files
+// the log is persisted in files of LOG_FILE_ENTRIES entries; full files are sealed with an index footer,
+// so that a restarting server maps them and reads the entries in place instead of loading the whole log
+
+// save_log_entry()
+// appends the entry to the log files; if the entry is already saved, it is replaced and all the entries after it are dropped.
+// returns -1 if the record could not be written (nothing is recorded then). the record is not synced yet: see sync_log_files
+int Raft_save_log_entry(raft_state_t *raft, int index);
+
+// write_log_entry()
+// same, but the entry is given instead of being looked up in the log, so the log does not have to be locked
+int Raft_write_log_entry(raft_state_t *raft, int index, raft_log_entry_t *entry);
+
+// sync_log_files()
+// makes the records written so far durable (fdatasync); an entry only counts as durable, or is acknowledged, after it.
+// returns -1 if the sync failed
+int Raft_sync_log_files(raft_state_t *raft);
+
+// removes the log files with no entries after start_log_index
+void Raft_remove_log_prefix(raft_state_t *raft);
+
+// removes all the log files (the log starts at start_log_index)
+void Raft_reset_log_files(raft_state_t *raft);
+
+void Raft_init_log_files(raft_state_t *raft);
+
+// load_log()
+// rebuilds the in-memory log and log_count from the log files (start_log_index must be loaded):
+// sealed files are mapped, the records of the last unsealed one are read, and its torn tail is truncated
+void Raft_load_log(raft_state_t *raft);
+
+// apply checkpoint
+// the commit handler appends to the main files; after the committed entries are applied, the index of the last one
+// and the sizes of the main files are saved (atomically, with a rename), so that a restarting server only truncates
+// what was written after the checkpoint and applies the entries after it, instead of rebuilding the files from the snapshot
+
+// updates the size of the main file in the checkpoint (after an entry was applied to it)
+void Raft_update_main_file_size(raft_state_t *raft, char filename[256]);
+
+void Raft_save_apply_checkpoint(raft_state_t *raft, int applied_index);
+
+// reset_apply_checkpoint()
+// saves a checkpoint with the current sizes of all the main files (e.g. after they are rebuilt from a snapshot)
+void Raft_reset_apply_checkpoint(raft_state_t *raft, int applied_index);
+
+// removes the checkpoint before the main files are replaced, so that a restart cannot resume from it
+void Raft_remove_apply_checkpoint(raft_state_t *raft);
+
+// restore_main_files()
+// loads the checkpoint and truncates the main files to the checkpointed sizes;
+// returns -1 if there is no usable checkpoint (missing, older than the snapshot, or a file is shorter than checkpointed)
+int Raft_restore_main_files(raft_state_t *raft);
+
+void Raft_save_install_progress(raft_state_t *raft);
+
+int Raft_load_install_progress(raft_state_t *raft, raft_install_progress_t *progress);
+
 void Raft_create_snapshot_dir(raft_state_t *raft, int snapshot_id);
 
 void Raft_remove_snapshot(raft_state_t *raft, int snapshot_id);
 
+// remove_snapshots_except()
+// removes every snapshot directory in files_dir but the two given (-1 keeps none)
+void Raft_remove_snapshots_except(raft_state_t *raft, int keep1, int keep2);
+
+// seal_snapshot()
+// saves the sizes and the checksums of the files of a complete snapshot to its checksums file
+void Raft_seal_snapshot(raft_state_t *raft, int snapshot_id);
+
+// returns -1 if the snapshot is not sealed or its files do not match the checksums
+int Raft_verify_snapshot(raft_state_t *raft, int snapshot_id);
+
 void Raft_clean_main_files(raft_state_t *raft);
 
 void Raft_copy_snapshot(raft_state_t *raft, int source_snapshot_id, int dest_snapshot_id);
 
 void Raft_add_to_snapshot(raft_state_t *raft, int snapshot_id, int create_new_sn, char filename[256], char buffer[BUFFER_SIZE]);
 
-typedef struct snapshot_iterator {
-	FILE *f;
-	int fileno;
+void Raft_write_snapshot_chunk(raft_state_t *raft, int snapshot_id, char filename[256], long offset, char *buffer, int len);
+
+// snapshot layout
+// describes how the snapshot is split into the chunks of the snapshot stream:
+// files are taken in order, and each file is split into chunks of SNAPSHOT_CHUNK_SIZE bytes
+// (the last chunk of a file might be shorter, and an empty file is a single empty chunk)
+typedef struct snapshot_layout {
 	int snapshot_id;
-	raft_state_t *raft;
-} snapshot_iterator_t;
+	int n_files;
+	int fileno[N_MAIN_FILES];
+	int fd[N_MAIN_FILES];
+	long size[N_MAIN_FILES];
+	long offset[N_MAIN_FILES];
+	int first_chunk[N_MAIN_FILES];
+	int n_chunks;
+	long total_size;
+} snapshot_layout_t;
+
+void snapshot_layout_init(snapshot_layout_t *layout, raft_state_t *raft, int snapshot_id);
 
-void snapshot_it_init(snapshot_iterator_t *it, raft_state_t *raft, int snapshot_id);
+// fills filename, offsets, len, and buffer of the chunk; returns -1 if there is no such chunk
+int snapshot_layout_read_chunk(snapshot_layout_t *layout, int seq, raft_install_snapshot_request_t *chunk);
 
-int snapshot_it_get_next(snapshot_iterator_t *it, char filename[256], char buffer[BUFFER_SIZE]);
+void snapshot_layout_close(snapshot_layout_t *layout);
 
 #endif
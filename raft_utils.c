@@ -1,14 +1,31 @@
 #include "raft.h"
 #include "raft_utils.h"
+#include "raft_log.h"
+#include "crc32c.h"
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 void Raft_print_state(raft_state_t *raft) {
-    char state_str[1024];
+    char *state_str = malloc(64 + 32 * (raft->log_count - raft->start_log_index));
     sprintf(state_str, "%i(%i)	%i[", raft->id, raft->current_term, raft->start_log_index);
     for(int i = 0; i < raft->log_count - raft->start_log_index; ++i) {
-	if(raft->log[i].type == LEADER_LOG) {
+	raft_log_entry_t *log = Raft_get_log(raft, i + raft->start_log_index);
+	if(log->type == LEADER_LOG) {
 	    sprintf(state_str + strlen(state_str), "l");
+	} else if(log->type == LOCK_GRANT_LOG) {
+	    sprintf(state_str + strlen(state_str), "g");
+	} else if(log->type == LOCK_EXPIRE_LOG) {
+	    sprintf(state_str + strlen(state_str), "e");
+	} else if(log->type == CONFIG_LOG) {
+	    sprintf(state_str + strlen(state_str), "m");
+	} else if(log->type == LOCK_SHARED_GRANT_LOG) {
+	    sprintf(state_str + strlen(state_str), "s");
+	} else if(log->type == LOCK_SHARED_RELEASE_LOG) {
+	    sprintf(state_str + strlen(state_str), "r");
 	}
-	sprintf(state_str + strlen(state_str), "%i(%i)", i + raft->start_log_index, raft->log[i].term);
+	sprintf(state_str + strlen(state_str), "%i(%i)", i + raft->start_log_index, log->term);
 	if(i + raft->start_log_index <= raft->commit_index) {
 	    sprintf(state_str + strlen(state_str), "c");
 	}
@@ -18,24 +35,25 @@ void Raft_print_state(raft_state_t *raft) {
     }
     sprintf(state_str + strlen(state_str), "]\n");
     printf("%s", state_str);
+    free(state_str);
 }
 
 raft_log_entry_t* Raft_get_log(raft_state_t *raft, int abs_index) {
     if(abs_index < raft->start_log_index || abs_index >= raft->log_count) {
 	return 0;
     }
-    return &raft->log[abs_index - raft->start_log_index];
+    return Raft_log_get(&raft->log, abs_index);
 }
 
 int Raft_get_log_term(raft_state_t *raft, int abs_index) {
     if(abs_index < raft->start_log_index || abs_index >= raft->log_count) {
 	return -1;
     }
-    return raft->log[abs_index - raft->start_log_index].term;
+    return Raft_log_get(&raft->log, abs_index)->term;
 }
 
 int Raft_absli2relli(raft_state_t *raft, int absolute_log_index) {
-    if(absolute_log_index < raft->start_log_index || absolute_log_index >= raft->start_log_index + LOG_SIZE) return -1;
+    if(absolute_log_index < raft->start_log_index || absolute_log_index >= raft->log_count) return -1;
     return absolute_log_index - raft->start_log_index;
 }
 
@@ -43,3 +61,73 @@ int Raft_relli2absli(raft_state_t *raft, int relative_log_index) {
     return relative_log_index + raft->start_log_index;
 }
 
+long Raft_get_time_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long Raft_get_time_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Raft_seed_random(raft_state_t *raft) {
+    unsigned long long seed = 0;
+    if(getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	seed = ((unsigned long long)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((unsigned long long)getpid() << 16);
+    }
+    raft->random_state = seed ? seed : 1; // xorshift never leaves 0
+}
+
+unsigned int Raft_random(raft_state_t *raft) {
+    unsigned long long x = raft->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    raft->random_state = x;
+    return (x * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+// CRC32C, continuing the checksum seed of the preceding data
+unsigned int Raft_checksum(unsigned int seed, char *buffer, int len) {
+    return crc32c(seed, buffer, len);
+}
+
+// checksum of a stream prefix extended by one more chunk; chunks can be checksummed
+// independently (in any order) and chained later
+unsigned int Raft_chain_checksum(unsigned int prefix_checksum, unsigned int chunk_checksum) {
+    return Raft_checksum(prefix_checksum, (char*)&chunk_checksum, sizeof(chunk_checksum));
+}
+
+// only the meaningful part of the packet is sent over the network:
+// snapshot chunks are much larger than all the other packets
+int Raft_packet_size(raft_packet_t *packet) {
+    switch (packet->request_type) {
+	case APPEND:
+	    if(packet->data.append_r.entries_n == 0) return offsetof(raft_packet_t, data.append_r.entry);
+	    return offsetof(raft_packet_t, data.append_r.entry) + Raft_log_entry_size(&packet->data.append_r.entry);
+	case VOTE:
+	    return offsetof(raft_packet_t, data) + sizeof(raft_vote_request_t);
+	case INSTALL_SNAPSHOT:
+	    return offsetof(raft_packet_t, data.install_r.buffer) + packet->data.install_r.len;
+	case RESPONSE:
+	    return offsetof(raft_packet_t, data) + sizeof(raft_response_packet_t);
+	case INSTALL_SNAPSHOT_RESPONSE:
+	    return offsetof(raft_packet_t, data) + sizeof(raft_install_snapshot_response_t);
+	case TIMEOUT_NOW:
+	    return offsetof(raft_packet_t, data) + sizeof(raft_timeout_now_t);
+	case READ_INDEX:
+	case READ_INDEX_RESPONSE:
+	    return offsetof(raft_packet_t, data) + sizeof(raft_read_index_t);
+    }
+    return sizeof(raft_packet_t);
+}
+
+int Raft_send_packet(raft_state_t *raft, struct sockaddr_in *addr, raft_packet_t *packet) {
+    packet->group = raft->group;
+    return UDP_Write(raft->rpc_sd, addr, (char*)packet, Raft_packet_size(packet));
+}
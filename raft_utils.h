@@ -13,4 +13,25 @@ int Raft_relli2absli(raft_state_t *raft, int relative_log_index);
 
 void Raft_print_state(raft_state_t *raft);
 
+long Raft_get_time_msec();
+
+long Raft_get_time_usec();
+
+// seed_random()
+// seeds the random generator of the server from the kernel's entropy pool, so that servers started at the same time
+// do not draw the same election timeouts
+void Raft_seed_random(raft_state_t *raft);
+
+// random()
+// xorshift64*; the raft lock must be held
+unsigned int Raft_random(raft_state_t *raft);
+
+unsigned int Raft_checksum(unsigned int seed, char *buffer, int len);
+
+unsigned int Raft_chain_checksum(unsigned int prefix_checksum, unsigned int chunk_checksum);
+
+int Raft_packet_size(raft_packet_t *packet);
+
+int Raft_send_packet(raft_state_t *raft, struct sockaddr_in *addr, raft_packet_t *packet);
+
 #endif
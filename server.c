@@ -1,64 +1,225 @@
 #include <assert.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "packet_format.h"
 #include "server_rpc.h"
 #include "tmdspinlock.h"
 #include "raft.h"
+#include "raft_lock.h"
+
+#define BALANCE_INTERVAL 1000 // msec between the checks of the leader balancer
+
+// lock_group
+// the lock of a raft group: the server hosts n_groups of them, and the lock names and the files are spread over
+// the groups by name_group. the groups share the sockets, the timers, and the handler threads of the server
+typedef struct lock_group {
+	raft_state_t raft;
+	tmdspinlock_t lock;
+	raft_log_entry_t current_log_entry; // the transaction of the lock holder; its id is the fencing token
+	int current_transaction_size; // bytes appended in the transaction
+
+	// the term in which the lock was last taken over from the replicated lock state
+	int lock_term;
+	spinlock_t lock_term_lock;
+
+	char files_dir[256];
+} lock_group_t;
 
 server_rpc_conn_t rpc;
-tmdspinlock_t lock;
-raft_state_t raft;
-raft_log_entry_t current_log_entry;
+lock_group_t groups[MAX_GROUPS];
+int n_groups = 1;
 
 char files_dir[128];
+int use_read_index = 0; // confirm the leadership for each read with a heartbeat round instead of trusting the lease
 
-void print_transaction() {
-    printf("TRANSACTION %i, CLIENT %i\n", current_log_entry.id, current_log_entry.client);
+void print_transaction(lock_group_t *group) {
+    raft_log_entry_t *entry = &group->current_log_entry;
+    printf("TRANSACTION %i, CLIENT %i\n", entry->id, entry->client);
     for(int i = 0; i < MAX_TRANSACTION_ENTRIES; ++i) {
-	if(current_log_entry.data[i].filename[0] == 0) break;
-	printf("FILE: '%s': '%s'\n", current_log_entry.data[i].filename, current_log_entry.data[i].buffer);
+	if(entry->data[i].filename[0] == 0) break;
+	printf("FILE: '%s': '%s'\n", entry->data[i].filename, entry->data[i].buffer);
     }
     printf("\n");
 }
 
-int handle_lock_acquire(int client_id, char* message) {
-    if(tmdspinlock_acquire(&lock, client_id) < 0) {
-	strcpy(message, "the client already has the lock\n");
+void start_transaction(lock_group_t *group, int client_id, int token) {
+    bzero(group->current_log_entry.data, sizeof(raft_transaction_entry_t)*MAX_TRANSACTION_ENTRIES);
+    group->current_log_entry.type = CLIENT_LOG;
+    group->current_log_entry.client = client_id;
+    group->current_log_entry.id = token;
+    group->current_transaction_size = 0;
+}
+
+// sync_lock()
+// the first time a request is handled in a new term, the holders of the lock are taken over from the replicated lock state.
+// the appends of its transaction were buffered by the previous leader, so the client is asked to send them again.
+// the current term is saved to term
+int sync_lock(lock_group_t *group, char* message, int *term) {
+    raft_view_t view;
+    Raft_read_view(&group->raft, &view);
+    if(view.state != LEADER || view.commit_term != view.current_term) {
+	strcpy(message, "the leader has not committed an entry of its term yet");
+	return E_ELECTION;
+    }
+    *term = view.current_term;
+    if(__atomic_load_n(&group->lock_term, __ATOMIC_ACQUIRE) == *term) return 0;
+
+    raft_lock_state_t state;
+    if(Raft_get_lock_state(&group->raft, &state, term) != 0) {
+	strcpy(message, "the leader has not committed an entry of its term yet");
+	return E_ELECTION;
+    }
+    spinlock_acquire(&group->lock_term_lock);
+    if(group->lock_term != *term) {
+	int shared_ids[MAX_ID], n_shared = 0;
+	for(int i = 0; i < MAX_ID; ++i) {
+	    if(Raft_is_shared_holder(&state, i)) shared_ids[n_shared++] = i;
+	}
+	tmdspinlock_set_holders(&group->lock, state.holder, shared_ids, n_shared);
+	start_transaction(group, state.holder, state.token);
+	__atomic_store_n(&group->lock_term, *term, __ATOMIC_RELEASE);
+    }
+    spinlock_release(&group->lock_term_lock);
+    return 0;
+}
+
+// wait_committed()
+// parks until the entry is committed (returns 1) or replaced by another leader (returns -1).
+// the commit index and the term are published with the view; the timeout only bounds the wait for a missed change
+int wait_committed(lock_group_t *group, int index, int term) {
+    while(1) {
+	unsigned int key = eventcount_prepare(&group->raft.view_event);
+	int rc = Raft_is_entry_committed(&group->raft, index, term);
+	if(rc != 0) return rc;
+	eventcount_wait(&group->raft.view_event, key, HEARTBIT_TIME);
+    }
+}
+
+int handle_lock_acquire(int group_id, int client_id, int mode, int* retry_after, char* message) {
+    lock_group_t *group = &groups[group_id];
+    int term;
+    int rc = sync_lock(group, message, &term);
+    if(rc < 0) return rc;
+    if((*retry_after = Raft_admission_delay(&group->raft)) > 0) {
+	// a new grant would only grow the log further; the holders release theirs meanwhile
+	strcpy(message, "the log is not keeping up; retry later");
+	return E_BUSY;
+    }
+
+    if(tmdspinlock_acquire(&group->lock, client_id, mode) < 0) {
+	// the client might have missed the response: the fencing token is sent again
+	int token = (tmdspinlock_holder_mode(&group->lock, client_id) == LOCK_EXCLUSIVE) ? group->current_log_entry.id : -1;
+	int log_data[2] = {term, token};
+	memcpy(message, log_data, 2*sizeof(int));
 	return E_LOCK;
     }
-    bzero(current_log_entry.data, sizeof(raft_transaction_entry_t)*MAX_TRANSACTION_ENTRIES);
-    current_log_entry.client = client_id;
-    current_log_entry.id++;
-    int log_data[2] = {raft.current_term, current_log_entry.id};
+    tmdspinlock_pause_if_owner(&group->lock, client_id); // the lease is not expired until the grant is in the log
+
+    raft_log_entry_t *grant = calloc(1, sizeof(raft_log_entry_t));
+    grant->type = (mode == LOCK_SHARED) ? LOCK_SHARED_GRANT_LOG : LOCK_GRANT_LOG;
+    grant->client = client_id;
+    int index = Raft_append_entry(&group->raft, grant);
+    int grant_term = grant->term;
+    free(grant);
+    // the grant is only answered once it is committed: a deposed leader could hand out a token and lose the entry, and
+    // a new leader with a shorter log grant a lower one. shared holders need no token, but nothing fences their reads
+    if(index >= 0 && wait_committed(group, index, grant_term) < 0) index = -1;
+    if(index < 0) {
+	tmdspinlock_reset_if_owner(&group->lock, client_id);
+	tmdspinlock_release(&group->lock, client_id);
+	sprintf(message, "this is not the leader server; address another one\n");
+	return E_FOLLOWER;
+    }
+    int token = -1;
+    if(mode == LOCK_EXCLUSIVE) {
+	token = index;
+	start_transaction(group, client_id, token);
+    }
+    tmdspinlock_reset_if_owner(&group->lock, client_id);
+
+    int log_data[2] = {term, token};
     memcpy(message, log_data, 2*sizeof(int));
     return 0;
 }
 
-int handle_lock_release(int client_id, int transaction_term, int transaction_id, char* message) {
-    if(transaction_term == raft.current_term) {
-	// if the transaction is from our term, we need to add it to the log ans release the lock
-	if(tmdspinlock_pause_if_owner(&lock, client_id) == 0) {
-	    Raft_append_entry(&raft, &current_log_entry); 
-	    tmdspinlock_reset_if_owner(&lock, client_id);
-	}
-	if(tmdspinlock_release(&lock, client_id) < 0) {
+// the lease of the holder expired: the release is replicated before the lock is granted to anyone else.
+// runs on the expire thread of the lock, so the log write does not hold up the timing wheel (see tmdspinlock_init)
+void handle_lock_expire(tmdspinlock_t *lock, int holder_id, int mode) {
+    lock_group_t *group = (lock_group_t*)((char*)lock - offsetof(lock_group_t, lock));
+    raft_log_entry_t *expire = calloc(1, sizeof(raft_log_entry_t));
+    expire->type = (mode == LOCK_SHARED) ? LOCK_SHARED_RELEASE_LOG : LOCK_EXPIRE_LOG;
+    expire->client = holder_id;
+    expire->id = (mode == LOCK_SHARED) ? -1 : group->current_log_entry.id;
+    Raft_append_entry(&group->raft, expire);
+    free(expire);
+}
+
+int handle_lock_release(int group_id, int client_id, int token, int offset, int* committed_index, char* message) {
+    lock_group_t *group = &groups[group_id];
+    int term;
+    int rc = sync_lock(group, message, &term);
+    if(rc < 0) return rc;
+
+    if(tmdspinlock_holder_mode(&group->lock, client_id) == LOCK_SHARED) {
+	if(tmdspinlock_pause_if_owner(&group->lock, client_id) < 0) {
 	    strcpy(message, "lock released before being acquired");
 	    return E_LOCK_EXP;
 	}
-    } else {
-	printf("getting a request for release() of a previous term %i for client %i\n", transaction_term, client_id);
+	// the release is in the log before anyone can be granted the lock exclusively after it
+	raft_log_entry_t *release = calloc(1, sizeof(raft_log_entry_t));
+	release->type = LOCK_SHARED_RELEASE_LOG;
+	release->client = client_id;
+	release->id = -1;
+	int index = Raft_append_entry(&group->raft, release);
+	free(release);
+	tmdspinlock_reset_if_owner(&group->lock, client_id);
+	if(index < 0) {
+	    sprintf(message, "this is not the leader server; address another one\n");
+	    return E_FOLLOWER;
+	}
+	tmdspinlock_release(&group->lock, client_id);
+	strcpy(message, "lock released");
+	return 0;
     }
 
-    int rc = 0;
-    while(rc == 0) {
-	rc = Raft_is_entry_committed(&raft, transaction_term, transaction_id);
-	sched_yield();
+    int index = -1;
+    term = -1;
+    if(tmdspinlock_pause_if_owner(&group->lock, client_id) == 0) {
+	if(group->current_log_entry.id == token) {
+	    if(group->current_transaction_size != offset) {
+		tmdspinlock_reset_if_owner(&group->lock, client_id);
+		strcpy(message, "the transaction was lost by the previous leader");
+		return E_TRANSACTION_RESET;
+	    }
+	    // adding the transaction to the log releases the lock
+	    index = Raft_append_entry(&group->raft, &group->current_log_entry);
+	    term = group->current_log_entry.term;
+	    if(index < 0) {
+		tmdspinlock_reset_if_owner(&group->lock, client_id);
+		sprintf(message, "this is not the leader server; address another one\n");
+		return E_FOLLOWER;
+	    }
+	}
+	tmdspinlock_reset_if_owner(&group->lock, client_id);
+	if(index >= 0) tmdspinlock_release(&group->lock, client_id);
+    }
+    if(index < 0 && token >= 0) {
+	// the release might have been handled by the previous leader
+	index = Raft_find_transaction(&group->raft, client_id, token, &term);
+    }
+    if(index < 0) {
+	strcpy(message, "lock released before being acquired");
+	return E_LOCK_EXP;
     }
 
-    if(rc == 1) {
+    if(wait_committed(group, index, term) == 1) {
+	*committed_index = index;
 	strcpy(message, "lock released");
 	return 0;
     } else {
@@ -68,15 +229,33 @@ int handle_lock_release(int client_id, int transaction_term, int transaction_id,
     }
 }
 
-int handle_append_file(int client_id, char* filename, char* buffer, char* message) {
-    if(tmdspinlock_pause_if_owner(&lock, client_id) < 0) {
+int handle_append_file(int group_id, int client_id, int token, int offset, char* filename, char* buffer, char* message) {
+    lock_group_t *group = &groups[group_id];
+    if(name_group(filename, n_groups) != group_id) {
+	strcpy(message, "the file belongs to the lock of another group");
+	return E_FILE;
+    }
+    int term;
+    int rc = sync_lock(group, message, &term);
+    if(rc < 0) return rc;
+
+    if(tmdspinlock_pause_if_owner(&group->lock, client_id) < 0 || tmdspinlock_holder_mode(&group->lock, client_id) != LOCK_EXCLUSIVE ||
+	    group->current_log_entry.id != token) {
+	tmdspinlock_reset_if_owner(&group->lock, client_id);
 	strcpy(message, "trying to write to file without holding a lock");
 	return E_LOCK_EXP;
     }
+    if(offset == -1) {
+	start_transaction(group, client_id, token); // the client sends the whole transaction again
+    } else if(group->current_transaction_size != offset) {
+	tmdspinlock_reset_if_owner(&group->lock, client_id);
+	strcpy(message, "the transaction was lost by the previous leader");
+	return E_TRANSACTION_RESET;
+    }
     
     int result = E_TRANSACTION_LIMIT; 
     for(int i = 0; i < MAX_TRANSACTION_ENTRIES; ++i) {
-	raft_transaction_entry_t *entry = &current_log_entry.data[i];
+	raft_transaction_entry_t *entry = &group->current_log_entry.data[i];
 	if(entry->filename[0] == 0) {
 	    strcpy(entry->filename, filename);
 	    strcpy(entry->buffer, buffer);
@@ -92,20 +271,90 @@ int handle_append_file(int client_id, char* filename, char* buffer, char* messag
     if(result == E_TRANSACTION_LIMIT) {
 	strcpy(message, "too many files modified within one transaction");
     } else {
+	group->current_transaction_size += strlen(buffer);
 	strcpy(message, "success");
     }
-    tmdspinlock_reset_if_owner(&lock, client_id);
+    tmdspinlock_reset_if_owner(&group->lock, client_id);
     return result;
 }
 
-void handle_raft_commit(raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]) {
+// handle_read_file()
+// a read is not added to the log, the server reads the file itself. a linearizable read is served by the leader while
+// it holds the lease (see Raft_has_read_lease), or once a heartbeat round confirmed it is still the leader
+// (see Raft_read_index); a follower asks the leader for the index to wait for (see Raft_forward_read_index).
+// the commits are applied before they are published, so the file has every entry up to the commit index
+int handle_read_file(int group_id, char* filename, int offset, int length, int consistency, int min_index, int max_staleness,
+	char* buffer, int* index, char* message) {
+    if(strnlen(filename, 256) == 256 || strchr(filename, '/') != NULL || offset < 0 || length < 0) {
+	strcpy(message, "invalid file name or range");
+	return E_FILE;
+    }
+    if(name_group(filename, n_groups) != group_id) {
+	strcpy(message, "the file belongs to another group");
+	return E_FILE;
+    }
+    lock_group_t *group = &groups[group_id];
+    if(length > BUFFER_SIZE) length = BUFFER_SIZE;
+
+    raft_view_t view;
+    Raft_read_view(&group->raft, &view);
+    if(consistency == READ_LINEARIZABLE) {
+	if(view.state != LEADER) {
+	    *index = Raft_forward_read_index(&group->raft);
+	} else if(use_read_index) {
+	    *index = Raft_read_index(&group->raft);
+	} else {
+	    *index = Raft_has_read_lease(&group->raft) ? view.commit_index : -1;
+	}
+	if(*index < 0) {
+	    strcpy(message, "the leader could not confirm its leadership");
+	    return (view.state == LEADER) ? E_ELECTION : E_FOLLOWER;
+	}
+    } else if(consistency == READ_MIN_INDEX) {
+	if(view.commit_index < min_index) {
+	    strcpy(message, "the server has not applied the index yet");
+	    return E_STALE;
+	}
+	*index = view.commit_index;
+    } else {
+	long staleness = Raft_get_staleness(&group->raft);
+	if(staleness < 0 || staleness > max_staleness) {
+	    strcpy(message, "the server has not heard from the leader recently enough");
+	    return E_STALE;
+	}
+	*index = view.commit_index;
+    }
+    char fn[sizeof(group->files_dir) + 256];
+    strcpy(fn, group->files_dir);
+    strcat(fn, filename);
+    int fd = open(fn, O_RDONLY);
+    if(fd < 0) {
+	strcpy(message, "no such file");
+	return E_FILE;
+    }
+    int n = pread(fd, buffer, length, offset);
+    close(fd);
+    if(n < 0) {
+	strcpy(message, "failed to read the file");
+	return E_FILE;
+    }
+    strcpy(message, "success");
+    return n;
+}
+
+int is_exclusive_holder(int group_id, int client_id) {
+    if(group_id < 0 || group_id >= n_groups) return 0;
+    return tmdspinlock_holder_mode(&groups[group_id].lock, client_id) == LOCK_EXCLUSIVE;
+}
+
+void handle_raft_commit(raft_state_t *raft, raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]) {
     for(int i = 0; i < MAX_TRANSACTION_ENTRIES; ++i) {
 	char* filename = data[i].filename;
 	char* buffer = data[i].buffer;
 	if(filename[0] == 0) break;
 
-	char fn[256];
-	strcpy(fn, files_dir);
+	char fn[sizeof(raft->files_dir) + 256];
+	strcpy(fn, raft->files_dir);
 	strcat(fn, filename);
 	FILE *f = fopen(fn, "a");
 	if(!f) continue;
@@ -116,10 +365,43 @@ void handle_raft_commit(raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES])
 }
 
 void* raft_listener_thread(void* arg) {
-    Raft_RPC_listen(&raft);
+    raft_state_t *rafts[MAX_GROUPS];
+    for(int i = 0; i < n_groups; ++i) rafts[i] = &groups[i].raft;
+    Raft_RPC_listen_groups(rafts, n_groups);
     pthread_exit(0);
 }
 
+// leader_balancer_thread()
+// the groups elect their leaders independently, so a server can end up leading most of them (e.g. the first one
+// started): a leader that leads at least two groups more than a live voter of one of them hands that one over
+void* leader_balancer_thread(void* arg) {
+    int id = *(int*)arg;
+    while(1) {
+	usleep(BALANCE_INTERVAL * 1000);
+	int n_led[MAX_SERVER_ID + 1];
+	bzero(n_led, sizeof(n_led));
+	for(int i = 0; i < n_groups; ++i) {
+	    raft_view_t view;
+	    Raft_read_view(&groups[i].raft, &view);
+	    if(view.leader_id >= 0 && view.leader_id <= MAX_SERVER_ID) n_led[view.leader_id] ++;
+	}
+	for(int i = 0; i < n_groups; ++i) {
+	    raft_view_t view;
+	    Raft_read_view(&groups[i].raft, &view);
+	    if(view.state != LEADER || view.transfer_target != -1) continue;
+	    int target = -1;
+	    for(int j = 0; j <= MAX_SERVER_ID; ++j) {
+		if(j == id || n_led[j] + 2 > n_led[id] || !Raft_is_live_voter(&groups[i].raft, j)) continue;
+		if(target == -1 || n_led[j] < n_led[target]) target = j;
+	    }
+	    if(target == -1) continue;
+	    printf("(%i) leading %i groups: handing group %i over to server %i\n", id, n_led[id], i, target);
+	    Raft_transfer_leadership(&groups[i].raft, target);
+	    break; // one at a time: the counts are read again
+	}
+    }
+}
+
 int main(int argc, char *argv[]) {
     // initialize rpc handler
     
@@ -130,8 +412,27 @@ int main(int argc, char *argv[]) {
 
     int id = atoi(argv[2]);
     int use_backup = 0;
-    if(argc >= 4 && strcmp(argv[3], "use-backup") == 0) {
-	use_backup = 1;
+    int join = 0; // a new server: it starts with no members and waits for the leader to add it (see Raft_change_membership)
+    tmdspinlock_policy_t lock_policy = WRITER_PREFERENCE;
+    for(int i = 3; i < argc; ++i) {
+	if(strcmp(argv[i], "use-backup") == 0) {
+	    use_backup = 1;
+	} else if(strcmp(argv[i], "reader-preference") == 0) {
+	    lock_policy = READER_PREFERENCE;
+	} else if(strcmp(argv[i], "fifo") == 0) {
+	    lock_policy = FIFO_ORDER;
+	} else if(strcmp(argv[i], "read-index") == 0) {
+	    use_read_index = 1;
+	} else if(strcmp(argv[i], "join") == 0) {
+	    join = 1;
+	} else if(strncmp(argv[i], "groups=", 7) == 0) {
+	    // the same on every server of the cluster
+	    n_groups = atoi(argv[i] + 7);
+	    if(n_groups < 1 || n_groups > MAX_GROUPS) {
+		printf("the number of groups must be between 1 and %i\n", MAX_GROUPS);
+		exit(1);
+	    }
+	}
     }
     int port_client;
     int port_raft;
@@ -149,25 +450,46 @@ int main(int argc, char *argv[]) {
 	printf("    server %i, client_port = %i, raft_port = %i, files_dir= %s \n", config.servers[i].id, ntohs(config.servers[i].client_socket.sin_port), ntohs(config.servers[i].raft_socket.sin_port), config.servers[i].file_directory);
     }
 */
-    if(use_backup) {
-	Raft_server_restore(&raft, files_dir, handle_raft_commit, id, port_raft); 
-    } else {
-	Raft_server_init(&raft, config, files_dir, handle_raft_commit, id, port_raft);
+    raft_configuration_t initial_config = config;
+    if(join) {
+	for(int i = 0; i < N_SERVERS; ++i) initial_config.servers[i].id = -1;
+    }
+    int raft_sd = Raft_open_socket(port_raft);
+    raft_state_t *rafts[MAX_GROUPS];
+    for(int i = 0; i < n_groups; ++i) {
+	lock_group_t *group = &groups[i];
+	// the first group keeps the files in the directory of the server, the others in subdirectories of it
+	strcpy(group->files_dir, files_dir);
+	if(i > 0) {
+	    sprintf(group->files_dir + strlen(group->files_dir), "group_%i/", i);
+	    mkdir(group->files_dir, 0755);
+	}
+	if(use_backup) {
+	    Raft_server_restore_group(&group->raft, group->files_dir, handle_raft_commit, id, i, raft_sd);
+	} else {
+	    Raft_server_init_group(&group->raft, initial_config, group->files_dir, handle_raft_commit, id, i, raft_sd);
+	}
+	rafts[i] = &group->raft;
+
+	// initialize the lock
+	group->lock_term = -1;
+	spinlock_init(&group->lock_term_lock);
+	tmdspinlock_init(&group->lock, lock_policy, handle_lock_expire);
     }
     pthread_t tid;
     pthread_create(&tid, NULL, raft_listener_thread, NULL);
+    if(n_groups > 1) pthread_create(&tid, NULL, leader_balancer_thread, &id);
 
     bzero(&rpc, sizeof(server_rpc_conn_t));
-    Server_RPC_init(&rpc, &raft, port_client);
+    Server_RPC_init(&rpc, rafts, n_groups, port_client);
 
     // set up handlers for the RPCs
     rpc.handle_lock_acquire = handle_lock_acquire;
     rpc.handle_lock_release = handle_lock_release;
     rpc.handle_append_file = handle_append_file;
+    rpc.handle_read_file = handle_read_file;
+    rpc.is_exclusive_holder = is_exclusive_holder;
 
-    // initialize the spinlock
-    tmdspinlock_init(&lock);
     // start listening for requests
     Server_RPC_listen(&rpc);
 }
-
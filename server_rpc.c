@@ -1,5 +1,6 @@
 #include "server_rpc.h"
 #include "raft.h"
+#include "raft_membership.h"
 #include "udp.h"
 #include "packet_format.h"
 #include "spinlock.h"
@@ -12,16 +13,96 @@ typedef struct request {
 } request_t;
 
 
-void Server_RPC_init(server_rpc_conn_t *rpc, raft_state_t *raft, int port) {
+void Server_RPC_init(server_rpc_conn_t *rpc, raft_state_t **groups, int n_groups, int port) {
     rpc->sd = UDP_Open(port);
-    rpc->raft = raft;
+    for(int i = 0; i < n_groups; ++i) rpc->groups[i] = groups[i];
+    rpc->n_groups = n_groups;
     
     spinlock_init(&rpc->client_table_lock);
     bzero(rpc->client_table, sizeof(rpc->client_table));
+    rpc->n_in_flight = 0;
 }
 
 void* handle_packet(void *arg);
 
+int send_packet_response(server_rpc_conn_t *rpc, struct sockaddr_in *addr, response_info_t *response) {
+    return UDP_Write(rpc->sd, addr, (char*)response, RESPONSE_SIZE);
+}
+
+// answer_duplicate()
+// a request the client sent again is answered E_IN_PROGRESS while it is handled, and with the same response once it was;
+// returns 0 if the request is a new one. the lock of the client must be held
+int answer_duplicate(server_rpc_conn_t *rpc, client_process_data_t *client, packet_info_t *packet, struct sockaddr_in *addr) {
+    if(client->vtime != packet->vtime) return 0;
+    if(client->state == PROCESSING) {
+	response_info_t response;
+	bzero(&response, RESPONSE_SIZE);
+	response.client_id = packet->client_id;
+	response.vtime = packet->vtime;
+	response.rc = E_IN_PROGRESS;
+	sprintf(response.message, "request from this client is already in progress");
+	send_packet_response(rpc, addr, &response);
+    } else {
+	send_packet_response(rpc, addr, &client->last_response);
+    }
+    return 1;
+}
+
+// admit()
+// returns 1 if the request gets a handler thread. otherwise the listener answers it itself: the retransmits of the
+// requests being handled as duplicates, and the new ones E_BUSY; the request is not executed then, so the client state
+// is left as it is. the requests of a lock holder are always let in: turning them away would only let its lease run out.
+// anyone can send an append though, so only those of the exclusive holder are
+int admit(server_rpc_conn_t *rpc, request_t *request) {
+    operation_type_t operation = request->packet.operation;
+    int finishing = operation == LOCK_RELEASE || operation == CLIENT_CLOSE || (operation == APPEND_FILE &&
+	    rpc->is_exclusive_holder != NULL && rpc->is_exclusive_holder(request->packet.group, request->packet.client_id));
+    // the slot is taken first and given back if it is over the limit, so two admissions cannot take the last one
+    int n = __atomic_add_fetch(&rpc->n_in_flight, 1, __ATOMIC_ACQ_REL);
+    if(n <= MAX_IN_FLIGHT || finishing) return 1;
+    __atomic_sub_fetch(&rpc->n_in_flight, 1, __ATOMIC_ACQ_REL);
+
+    int client_id = request->packet.client_id;
+    if(client_id >= 0 && client_id < MAX_ID) {
+	spinlock_acquire(&rpc->client_table_lock);
+	client_process_data_t *client = rpc->client_table[client_id];
+	spinlock_release(&rpc->client_table_lock);
+	if(client != NULL) {
+	    spinlock_acquire(&client->lock);
+	    int duplicate = answer_duplicate(rpc, client, &request->packet, &request->addr);
+	    spinlock_release(&client->lock);
+	    if(duplicate) return 0;
+	}
+    }
+    response_info_t response;
+    bzero(&response, RESPONSE_SIZE);
+    response.client_id = request->packet.client_id;
+    response.vtime = request->packet.vtime;
+    response.rc = E_BUSY;
+    response.retry_after = BUSY_RETRY_AFTER;
+    strcpy(response.message, "the server is overloaded; retry later");
+    send_packet_response(rpc, &request->addr, &response);
+    return 0;
+}
+
+// finish_request()
+// frees the request and ends its handler thread
+void finish_request(void *arg) {
+    server_rpc_conn_t *rpc = ((request_t*)arg)->rpc;
+    free(arg);
+    __atomic_sub_fetch(&rpc->n_in_flight, 1, __ATOMIC_ACQ_REL);
+    pthread_exit(0);
+}
+
+// hint_leader()
+// a follower turning a request away (E_FOLLOWER) tells the client where the leader is: its id in the index
+// (-1 if not known) and its configuration in the buffer, so that the clients find the servers added later too
+void hint_leader(raft_state_t *raft, response_info_t *response) {
+    raft_server_configuration_t leader;
+    response->index = (Raft_leader_server(raft, &leader) == 0) ? leader.id : -1;
+    if(response->index >= 0) memcpy(response->buffer, &leader, sizeof(raft_server_configuration_t));
+}
+
 void Server_RPC_listen(server_rpc_conn_t *rpc) {
     pthread_t req_thread_id;
     
@@ -30,17 +111,16 @@ void Server_RPC_listen(server_rpc_conn_t *rpc) {
 	bzero(request, sizeof(request_t));
 	request->rpc = rpc;
 	int rc = UDP_Read(rpc->sd, &request->addr, (char*)&request->packet, PACKET_SIZE);
-	if(rc < 0) continue;
+	if(rc < 0 || !admit(rpc, request)) {
+	    free(request);
+	    continue;
+	}
 
 	pthread_create(&req_thread_id, NULL, handle_packet, request);
 	pthread_detach(req_thread_id);
     }
 }
 
-int send_packet_response(server_rpc_conn_t *rpc, struct sockaddr_in *addr, response_info_t *response) {
-    return UDP_Write(rpc->sd, addr, (char*)response, RESPONSE_SIZE);
-}
-
 void* handle_packet(void *arg) {
     packet_info_t *packet = &((request_t*)arg)->packet;
     struct sockaddr_in *addr = &((request_t*)arg)->addr;
@@ -51,12 +131,30 @@ void* handle_packet(void *arg) {
     response.client_id = packet->client_id;
     response.vtime = packet->vtime;
 
-    if(rpc->raft->state != LEADER) {
-	response.rc = (rpc->raft->state == FOLLOWER) ? E_FOLLOWER : E_ELECTION;
+    if(packet->group < 0 || packet->group >= rpc->n_groups) {
+	response.rc = E_FILE;
+	sprintf(response.message, "the server has no group %i\n", packet->group);
+	send_packet_response(rpc, addr, &response);
+	finish_request(arg);
+    }
+    raft_state_t *raft = rpc->groups[packet->group];
+
+    raft_view_t view;
+    Raft_read_view(raft, &view);
+    if(view.state != LEADER && packet->operation != READ_FILE) {
+	// the followers serve the reads too
+	response.rc = (view.state == FOLLOWER) ? E_FOLLOWER : E_ELECTION;
 	sprintf(response.message, "this is not the leader server; address another one\n");
+	if(response.rc == E_FOLLOWER) hint_leader(raft, &response);
+	send_packet_response(rpc, addr, &response);
+	finish_request(arg);
+    }
+    if(view.transfer_target != -1 && packet->operation != TRANSFER_LEADERSHIP) {
+	// the new leader is elected within a round trip
+	response.rc = E_ELECTION;
+	sprintf(response.message, "the leadership is being transferred to server %i\n", view.transfer_target);
 	send_packet_response(rpc, addr, &response);
-	free(arg);
-	pthread_exit(0);
+	finish_request(arg);
     }
     
     // get the client data structure -- if it does not exist and the request is init, create a new structure;
@@ -81,19 +179,9 @@ void* handle_packet(void *arg) {
     
 
     spinlock_acquire(&client->lock); // lock the client state to do all the necessary checks
-    if(client->vtime == packet->vtime) {
-	if(client->state == PROCESSING) { 
-	    // if the request from the client is already processed on another thread, return the corresponding message
-	    response.rc = E_IN_PROGRESS;
-	    sprintf(response.message, "request from this client is already in progress");
-	    send_packet_response(rpc, addr, &response);
-	} else {
-	    // if already sent the response for this request before, repeat this response
-	    send_packet_response(rpc, addr, &client->last_response);
-	}
+    if(answer_duplicate(rpc, client, packet, addr)) {
 	spinlock_release(&client->lock);
-	free(arg);
-	pthread_exit(0);
+	finish_request(arg);
     } 
     client->state = PROCESSING;
     client->vtime = packet->vtime;
@@ -102,31 +190,56 @@ void* handle_packet(void *arg) {
     switch (packet->operation) {
 	case CLIENT_INIT:
 	    strcpy(response.message, "connected"); // TODO: check user didn't exist before
+	    response.index = rpc->n_groups;
 	    break;
 	case LOCK_ACQUIRE:
-	    response.rc = rpc->handle_lock_acquire(packet->client_id, response.message);
+	    response.rc = rpc->handle_lock_acquire(packet->group, packet->client_id, packet->mode, &response.retry_after, response.message);
 	    break;
-	case LOCK_RELEASE: {
-	    int transaction_data[2];
-	    memcpy(transaction_data, packet->buffer, 2*sizeof(int));
-	    response.rc = rpc->handle_lock_release(packet->client_id, transaction_data[0], transaction_data[1], response.message);
+	case LOCK_RELEASE:
+	    response.rc = rpc->handle_lock_release(packet->group, packet->client_id, packet->token, packet->offset, &response.index, response.message);
 	    break;
-	}
 	case APPEND_FILE:
-	    response.rc = rpc->handle_append_file(packet->client_id, packet->file_name, packet->buffer, response.message);
+	    response.rc = rpc->handle_append_file(packet->group, packet->client_id, packet->token, packet->offset, packet->file_name, packet->buffer, response.message);
+	    break;
+	case READ_FILE:
+	    response.rc = rpc->handle_read_file(packet->group, packet->file_name, packet->offset, packet->length, packet->consistency, packet->min_index,
+		    packet->max_staleness, response.buffer, &response.index, response.message);
 	    break;
 	case CLIENT_CLOSE:
 	    strcpy(response.message, "disconnected"); // TODO: clear user's data
 	    break;
+	case TRANSFER_LEADERSHIP:
+	    if(Raft_transfer_leadership(raft, packet->target_id) == 0) {
+		strcpy(response.message, "the leadership is transferred");
+	    } else {
+		response.rc = E_TRANSFER;
+		strcpy(response.message, "the leadership transfer failed");
+	    }
+	    break;
+	case CHANGE_MEMBERSHIP: {
+	    raft_server_configuration_t server;
+	    memcpy(&server, packet->buffer, sizeof(raft_server_configuration_t));
+	    if(Raft_change_membership(raft, &server, packet->role) == 0) {
+		strcpy(response.message, "the configuration is changed");
+	    } else {
+		response.rc = E_MEMBERSHIP;
+		strcpy(response.message, "the configuration change was refused or did not complete");
+	    }
+	    break;
+	}
     }
 
+    if(response.rc == E_FOLLOWER) hint_leader(raft, &response);
     spinlock_acquire(&client->lock);
     client->state = WAITING;
     client->last_response = response;
+    if(response.rc == E_ELECTION || response.rc == E_FOLLOWER || response.rc == E_STALE || response.rc == E_BUSY) {
+	client->vtime = -1; // the request was not executed: it is handled again when the client retries it
+    }
     send_packet_response(rpc, addr, &response);
     spinlock_release(&client->lock);
 
-    free(arg);
-    pthread_exit(0);
+    finish_request(arg);
+    return NULL;
 }
 
@@ -6,7 +6,8 @@
 #include "spinlock.h"
 #include "raft.h"
 
-#define MAX_ID 1000
+#define MAX_IN_FLIGHT 64 // requests handled at once; the others are answered E_BUSY by the listener (see Server_RPC_listen)
+#define BUSY_RETRY_AFTER 20 // msec, the hint sent with them
 
 
 // client_process_data
@@ -22,9 +23,12 @@ typedef struct client_process_data {
 } client_process_data_t;
 
 
-typedef int (*lock_acquire_handler)(int client_id, char* response_message);
-typedef int (*lock_release_handler)(int client_id, int transaction_term, int transaction_id, char* response_message);
-typedef int (*append_file_handler)(int client_id, char* filename, char* buffer, char* response_message);
+typedef int (*lock_acquire_handler)(int group, int client_id, int mode, int* retry_after, char* response_message);
+typedef int (*lock_release_handler)(int group, int client_id, int token, int offset, int* index, char* response_message);
+typedef int (*append_file_handler)(int group, int client_id, int token, int offset, char* filename, char* buffer, char* response_message);
+typedef int (*read_file_handler)(int group, char* filename, int offset, int length, int consistency, int min_index, int max_staleness,
+	char* buffer, int* index, char* response_message);
+typedef int (*lock_holder_check)(int group, int client_id); // returns 1 if the client holds the lock of the group exclusively
 
 
 // RPC connection structure specifies handlers for different RPCs
@@ -37,8 +41,13 @@ typedef struct server_rpc_conn {
 	lock_acquire_handler handle_lock_acquire;
 	lock_release_handler handle_lock_release;
 	append_file_handler handle_append_file;
+	read_file_handler handle_read_file;
+	lock_holder_check is_exclusive_holder; // the appends of the holder are admitted over the limit (see Server_RPC_listen)
 
-	raft_state_t *raft;
+	raft_state_t *groups[MAX_GROUPS]; // a request goes to the group of the packet
+	int n_groups;
+
+	int n_in_flight; // handler threads running
 } server_rpc_conn_t;
 
 typedef enum client_state {
@@ -46,8 +55,12 @@ typedef enum client_state {
 	WAITING
 } client_state_t;
 
-void Server_RPC_init(server_rpc_conn_t *rpc, raft_state_t *raft, int port);
+void Server_RPC_init(server_rpc_conn_t *rpc, raft_state_t **groups, int n_groups, int port);
 
+// listen()
+// handles each request in a thread of its own. when MAX_IN_FLIGHT of them are running, the new requests are answered
+// E_BUSY right away (their retransmits too), except the releases, the closes, and the appends of the exclusive holder,
+// which let the others go on
 void Server_RPC_listen(server_rpc_conn_t *rpc);
 
 #endif
@@ -1,4 +1,45 @@
 #include "spinlock.h"
+#include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static __thread mcslock_node_t mcslock_nodes[MCSLOCK_MAX_NESTING];
+
+void _spinlock_futex_wait(int *addr, int value) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void _spinlock_futex_wake(int *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void _spinlock_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// should_spin()
+// spinning only helps if the holder can run meanwhile: on a single processor the waiters park right away
+int _spinlock_should_spin() {
+    static int n_processors = 0;
+    if(n_processors == 0) n_processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return n_processors > 1;
+}
+
+// backoff()
+// one round of the exponential backoff of a spinning waiter
+void _spinlock_backoff(int *backoff) {
+    for(int i = 0; i < *backoff; ++i) _spinlock_pause();
+    if(*backoff < SPINLOCK_MAX_BACKOFF) *backoff *= 2;
+}
 
 int spinlock_init(spinlock_t *lock) {
     lock->lock_flag = 0;
@@ -6,10 +47,126 @@ int spinlock_init(spinlock_t *lock) {
 }
 
 void spinlock_acquire(spinlock_t *lock) {
-    while(!__sync_bool_compare_and_swap(&lock->lock_flag, 0, 1));
+    int expected = 0;
+    if(__atomic_compare_exchange_n(&lock->lock_flag, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+    if(_spinlock_should_spin()) {
+	int backoff = 1;
+	for(int round = 0; round < SPINLOCK_SPIN_ROUNDS; ++round) {
+	    _spinlock_backoff(&backoff);
+	    expected = 0;
+	    if(__atomic_load_n(&lock->lock_flag, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_compare_exchange_n(&lock->lock_flag, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+	}
+    }
+    // the lock is marked as having parked waiters (2) from now on: the release has to wake one of them up
+    while(__atomic_exchange_n(&lock->lock_flag, 2, __ATOMIC_ACQUIRE) != 0) {
+	_spinlock_futex_wait(&lock->lock_flag, 2);
+    }
     return;
 }
 void spinlock_release(spinlock_t *lock) {
-    __sync_bool_compare_and_swap(&lock->lock_flag, 1, 0);
+    if(__atomic_exchange_n(&lock->lock_flag, 0, __ATOMIC_RELEASE) == 2) _spinlock_futex_wake(&lock->lock_flag);
     return;
 }
+
+
+int mcslock_init(mcslock_t *lock) {
+    lock->tail = NULL;
+    lock->holder = NULL;
+    return 0;
+}
+
+void mcslock_acquire(mcslock_t *lock) {
+    mcslock_node_t *node = NULL;
+    for(int i = 0; i < MCSLOCK_MAX_NESTING && node == NULL; ++i) {
+	if(!mcslock_nodes[i].in_use) node = &mcslock_nodes[i];
+    }
+    assert(node != NULL);
+    node->in_use = 1;
+    node->next = NULL;
+    node->state = 1;
+
+    mcslock_node_t *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if(prev != NULL) {
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	int backoff = 1;
+	for(int round = 0; round < SPINLOCK_SPIN_ROUNDS && _spinlock_should_spin() &&
+		__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != 0; ++round) _spinlock_backoff(&backoff);
+
+	// park unless the lock was handed over meanwhile
+	int state = 1;
+	while(__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != 0) {
+	    if(state == 1 && !__atomic_compare_exchange_n(&node->state, &state, 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) continue;
+	    state = 2;
+	    _spinlock_futex_wait(&node->state, 2);
+	}
+    }
+    lock->holder = node;
+}
+
+void mcslock_release(mcslock_t *lock) {
+    mcslock_node_t *node = lock->holder;
+    mcslock_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if(next == NULL) {
+	mcslock_node_t *expected = node;
+	if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	    node->in_use = 0;
+	    return;
+	}
+	// the next waiter swapped the tail, but has not linked itself yet
+	while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) sched_yield();
+    }
+    node->in_use = 0;
+    if(__atomic_exchange_n(&next->state, 0, __ATOMIC_RELEASE) == 2) _spinlock_futex_wake(&next->state);
+}
+
+
+int seqlock_init(seqlock_t *lock) {
+    lock->sequence = 0;
+    return 0;
+}
+
+void seqlock_write_begin(seqlock_t *lock) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqlock_write_end(seqlock_t *lock) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int seqlock_read_begin(seqlock_t *lock) {
+    unsigned int sequence;
+    while((sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE)) & 1) sched_yield(); // the writer is in the middle of a few stores
+    return sequence;
+}
+
+int seqlock_read_retry(seqlock_t *lock, unsigned int sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+
+int eventcount_init(eventcount_t *event) {
+    event->count = 0;
+    event->n_waiters = 0;
+    return 0;
+}
+
+unsigned int eventcount_prepare(eventcount_t *event) {
+    return __atomic_load_n(&event->count, __ATOMIC_SEQ_CST);
+}
+
+void eventcount_wait(eventcount_t *event, unsigned int key, long msec) {
+    // the signal either sees the waiter or changes the count before the futex compares it
+    __atomic_add_fetch(&event->n_waiters, 1, __ATOMIC_SEQ_CST);
+    struct timespec timeout = {msec / 1000, (msec % 1000) * 1000000};
+    syscall(SYS_futex, &event->count, FUTEX_WAIT_PRIVATE, key, (msec < 0) ? NULL : &timeout, NULL, 0);
+    __atomic_sub_fetch(&event->n_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+void eventcount_signal(eventcount_t *event) {
+    __atomic_add_fetch(&event->count, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&event->n_waiters, __ATOMIC_SEQ_CST) > 0) syscall(SYS_futex, &event->count, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
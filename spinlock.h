@@ -1,12 +1,80 @@
 #ifndef __SPINLOCK_h__
 #define __SPINLOCK_h__
 
+#define SPINLOCK_SPIN_ROUNDS 10 // rounds of backoff before a waiter parks
+#define SPINLOCK_MAX_BACKOFF 64 // pause instructions in one round
+#define MCSLOCK_MAX_NESTING 4 // mcs locks one thread can hold at once
+
+// spinlock
+// an adaptive lock: a waiter spins a few rounds with exponential backoff (only if there is more
+// than one processor to run the holder on), and then parks on a futex until the lock is released
 typedef struct spinlock {
-    int lock_flag;
+    int lock_flag; // 0 free, 1 held, 2 held with waiters parked
 } spinlock_t;
 
 int spinlock_init(spinlock_t *lock);
-void spinlock_acquire(spinlock_t *lock); 
+void spinlock_acquire(spinlock_t *lock);
 void spinlock_release(spinlock_t *lock);
 
+
+// mcs lock
+// a queue lock for the heavily contended locks: the waiters are granted the lock in order,
+// each of them spins (and then parks) on its own queue node, and the release wakes up only the next one.
+// the queue nodes are taken from the calling thread, so the lock must be released by the thread that acquired it
+typedef struct mcslock_node {
+	struct mcslock_node *next;
+	int state; // 0 granted, 1 waiting, 2 waiting parked
+	int in_use;
+} mcslock_node_t;
+
+typedef struct mcslock {
+	mcslock_node_t *tail;
+	mcslock_node_t *holder;
+} mcslock_t;
+
+int mcslock_init(mcslock_t *lock);
+void mcslock_acquire(mcslock_t *lock);
+void mcslock_release(mcslock_t *lock);
+
+
+// seqlock
+// lets the readers copy a few words without blocking the writer or each other: the sequence is odd while a write
+// is in progress, and a reader retries if it read during a write. the writers must be serialized by another lock,
+// and the protected words must be accessed with atomic loads and stores
+typedef struct seqlock {
+	unsigned int sequence;
+} seqlock_t;
+
+int seqlock_init(seqlock_t *lock);
+void seqlock_write_begin(seqlock_t *lock);
+void seqlock_write_end(seqlock_t *lock);
+
+// read_begin()
+// waits until no write is in progress and returns the sequence to pass to read_retry
+unsigned int seqlock_read_begin(seqlock_t *lock);
+
+// read_retry()
+// returns 1 if a write happened since read_begin, i.e. the words have to be read again
+int seqlock_read_retry(seqlock_t *lock, unsigned int sequence);
+
+
+// eventcount
+// lets threads wait for a condition that the others make true without a lock they share: a waiter takes the count
+// with eventcount_prepare, checks the condition, and parks until the count changes; whoever makes the condition true
+// advances the count with eventcount_signal, which wakes all the waiters up to check it again
+typedef struct eventcount {
+	unsigned int count;
+	int n_waiters;
+} eventcount_t;
+
+int eventcount_init(eventcount_t *event);
+unsigned int eventcount_prepare(eventcount_t *event);
+
+// wait()
+// parks until the count is not key anymore (returns at once if it changed already), or msec pass (-1 for no limit);
+// might return early, so the condition has to be checked again
+void eventcount_wait(eventcount_t *event, unsigned int key, long msec);
+
+void eventcount_signal(eventcount_t *event);
+
 #endif
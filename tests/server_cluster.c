@@ -5,6 +5,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include "../client_rpc.h"
 
 #define N_SERVERS 5
@@ -12,6 +13,13 @@
 int server_pid[N_SERVERS];
 int server_active[N_SERVERS];
 int nactive;
+char *server_option = NULL; // passed to the servers after the others, e.g. "read-index"
+
+// a client that keeps writing while the servers are paused, restarted, or hand the leadership over (see start_write_client)
+rpc_conn_t write_client_rpc;
+volatile int n_writes = 0; // transactions committed by the client
+volatile long max_write_gap = 0; // longest time between two of them, msec; reset it to measure from then on
+long last_write_time = 0;
 
 void start_server_cluster(int use_backup) {
     nactive = N_SERVERS;
@@ -21,8 +29,8 @@ void start_server_cluster(int use_backup) {
 	server_pid[i] = fork();
 	if(server_pid[i] != 0) continue; 
 
-	char id_arg[2]; sprintf(id_arg, "%i", i+1);
-	char* args[] = {"./bin/server/", "./raft_config", id_arg, use_backup ? "use-backup" : NULL, NULL};
+	char id_arg[12]; sprintf(id_arg, "%i", i+1);
+	char* args[] = {"./bin/server/", "./raft_config", id_arg, use_backup ? "use-backup" : server_option, use_backup ? server_option : NULL, NULL};
 	int rs = execv("./bin/server", args);
 	printf("exec failed, result: %i\n", rs);
 	exit(1);
@@ -44,8 +52,8 @@ void start_server_failures() {
 	    server_pid[ind] = fork();
 	    if(server_pid[ind] != 0) continue;
 
-	    char id_arg[2]; sprintf(id_arg, "%i", ind+1);
-	    char* args[] = {"./bin/server/", "./raft_config", id_arg, "use-backup", NULL};
+	    char id_arg[12]; sprintf(id_arg, "%i", ind+1);
+	    char* args[] = {"./bin/server/", "./raft_config", id_arg, "use-backup", server_option, NULL};
 	    int rs = execv("./bin/server", args);
 	    printf("exec failed, result: %i\n", rs);
 	    exit(1);
@@ -74,6 +82,17 @@ void kill_all_servers() {
     }
 }
 
+// stops the server without killing it (as if it stalled or was cut off) until resume_server
+void pause_server(int ind) {
+    kill(server_pid[ind], SIGSTOP);
+    printf("paused server %i\n", ind+1);
+}
+
+void resume_server(int ind) {
+    kill(server_pid[ind], SIGCONT);
+    printf("resumed server %i\n", ind+1);
+}
+
 void restart_server(rpc_conn_t *rpc, int leader, int delay) {
     int ind;
     if(leader) {
@@ -95,10 +114,69 @@ void restart_server(rpc_conn_t *rpc, int leader, int delay) {
     server_pid[ind] = fork();
     if(server_pid[ind] != 0) return;
 
-    char id_arg[2]; sprintf(id_arg, "%i", ind+1);
-    char* args[] = {"./bin/server", "./raft_config", id_arg, "use-backup", NULL};
+    char id_arg[12]; sprintf(id_arg, "%i", ind+1);
+    char* args[] = {"./bin/server", "./raft_config", id_arg, "use-backup", server_option, NULL};
+    int rs = execv("./bin/server", args);
+    printf("exec failed, result: %i\n", rs);
+    exit(1);
+}
+
+// starts a stopped server: from its saved state with "use-backup", or as a new server with "join"
+void start_server(int ind, char *mode) {
+    server_active[ind] = 1;
+    nactive++;
+
+    server_pid[ind] = fork();
+    if(server_pid[ind] != 0) return;
+
+    char id_arg[12]; sprintf(id_arg, "%i", ind+1);
+    char* args[] = {"./bin/server", "./raft_config", id_arg, mode, server_option, NULL};
     int rs = execv("./bin/server", args);
     printf("exec failed, result: %i\n", rs);
     exit(1);
 }
 
+void stop_server(int ind) {
+    server_active[ind] = 0;
+    nactive --;
+    kill(server_pid[ind], SIGKILL);
+    printf("killed server %i\n", ind+1);
+}
+
+// planned restart of the leader: the leadership is handed over first, so that the clients
+// only wait for about a round trip instead of a whole election
+void transfer_and_restart_leader(rpc_conn_t *rpc, int delay) {
+    int rc = RPC_transfer_leadership(rpc, -1);
+    printf("leadership transfer from server %i: %s\n", rpc->current_leader_index+1, rc == 0 ? "done" : "failed");
+    usleep(200 * 1000); // the clients it answers in the meantime are sent to the new leader
+    restart_server(rpc, 1, delay);
+}
+
+long now_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void* write_client(void *arg) {
+    RPC_init(&write_client_rpc, 1, 2000, *(raft_configuration_t*)arg);
+    char buffer[BUFFER_SIZE] = "A";
+    while(1) {
+	int rc = RPC_acquire_lock(&write_client_rpc);
+	assert(rc == 0 || rc == E_LOCK); // E_LOCK: the grant was answered by a leader that went away
+	assert(RPC_append_file(&write_client_rpc, "file_0", buffer) == 0);
+	assert(RPC_release_lock(&write_client_rpc) == 0);
+
+	long now = now_msec();
+	if(last_write_time != 0 && now - last_write_time > max_write_gap) max_write_gap = now - last_write_time;
+	last_write_time = now;
+	n_writes ++;
+    }
+}
+
+// starts a client (id 1) that keeps committing transactions of one append, and waits until it committed a few
+void start_write_client(raft_configuration_t *config) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, write_client, config);
+    while(n_writes < 10) usleep(10000);
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "./server_cluster.c"
+
+// a follower is paused for longer than the election timeout and resumed, a few times, while a client keeps writing.
+// prints for how long the writes were unavailable after each rejoin: the follower must not depose the leader
+// (it would take a whole election), so the longest pause between two writes has to stay below the election timeout
+
+#define N_ROUNDS 3
+#define PAUSE_SEC 3
+
+raft_configuration_t config;
+
+int main(int argc, char* argv[]) {
+    start_server_cluster(0); 
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    start_write_client(&config);
+
+    long worst_gap = 0;
+    for(int round = 0; round < N_ROUNDS; ++round) {
+	int ind = rand() % N_SERVERS;
+	while(ind == write_client_rpc.current_leader_index) ind = rand() % N_SERVERS;
+
+	pause_server(ind);
+	sleep(PAUSE_SEC);
+	max_write_gap = 0;
+	resume_server(ind);
+	sleep(PAUSE_SEC);
+
+	printf("round %i: writes unavailable for %li ms after server %i rejoined\n", round, max_write_gap, ind+1);
+	if(max_write_gap > worst_gap) worst_gap = max_write_gap;
+    }
+
+    kill_all_servers();
+    printf("writes unavailable for at most %li ms\n", worst_gap);
+    assert(worst_gap < ELECTION_TIMEOUT);
+    exit(0);
+}
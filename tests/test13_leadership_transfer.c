@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "./server_cluster.c"
+
+// the leader is restarted a few times while a client keeps writing: first after handing over the leadership,
+// then without (as if it crashed). prints for how long the writes were unavailable each time;
+// with the transfer, it has to stay below the election timeout
+
+#define N_ROUNDS 3
+#define ROUND_SEC 3
+
+raft_configuration_t config;
+rpc_conn_t admin_rpc;
+
+long restart_leader(int transfer) {
+    max_write_gap = 0;
+    if(transfer) {
+	transfer_and_restart_leader(&admin_rpc, 1);
+    } else {
+	restart_server(&write_client_rpc, 1, 1);
+    }
+    sleep(ROUND_SEC);
+    return max_write_gap;
+}
+
+int main(int argc, char* argv[]) {
+    start_server_cluster(0); 
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    start_write_client(&config);
+    RPC_init(&admin_rpc, 2, 2001, config);
+
+    long transfer_gap = 0, crash_gap = 0;
+    for(int round = 0; round < N_ROUNDS; ++round) {
+	long gap = restart_leader(1);
+	printf("round %i: writes unavailable for %li ms after the leadership transfer\n", round, gap);
+	if(gap > transfer_gap) transfer_gap = gap;
+    }
+    for(int round = 0; round < N_ROUNDS; ++round) {
+	long gap = restart_leader(0);
+	printf("round %i: writes unavailable for %li ms after the leader crashed\n", round, gap);
+	if(gap > crash_gap) crash_gap = gap;
+    }
+
+    kill_all_servers();
+    printf("writes unavailable for at most %li ms with the transfer, %li ms without\n", transfer_gap, crash_gap);
+    assert(transfer_gap < ELECTION_TIMEOUT);
+    exit(0);
+}
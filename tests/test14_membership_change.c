@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "./server_cluster.c"
+
+// the cluster is shrunk to three voters while a client keeps writing (the leader might remove itself), and one of the
+// three is stopped: the writes go on, since two of them are a majority of the new configuration. then the two removed
+// servers join again with an empty state, first as learners and then as voters. a client that only knows one follower
+// finds the leader, the configuration is filled up to MAX_MEMBERS with learners that are never started and one more
+// is refused, and after they are removed two servers are stopped again
+
+#define PROGRESS_TIMEOUT_SEC 20
+
+raft_configuration_t config;
+rpc_conn_t rpc, admin_rpc, hint_rpc;
+
+volatile int client_state = 0;
+
+void* client(void *arg) {
+    RPC_init(&rpc, 1, 2000, config);
+    char buffer[BUFFER_SIZE] = "A";
+    while(1) {
+	int rc = RPC_acquire_lock(&rpc);
+	assert(rc == 0 || rc == E_LOCK); // E_LOCK: the grant was answered by a leader that went away
+	assert(RPC_append_file(&rpc, "file_0", buffer) == 0);
+	assert(RPC_release_lock(&rpc) == 0);
+	client_state ++;
+    }
+}
+
+// waits until the client commits a few more transactions
+void wait_for_writes() {
+    int state = client_state;
+    for(int i = 0; i < PROGRESS_TIMEOUT_SEC * 10 && client_state < state + 10; ++i) usleep(100000);
+    assert(client_state >= state + 10);
+    printf("the writes go on (%i transactions)\n", client_state);
+}
+
+void change_membership(int ind, member_role_t role) {
+    int rc = RPC_change_membership(&admin_rpc, &config.servers[ind], role);
+    printf("server %i %s: %s\n", ind+1, role == MEMBER_VOTER ? "made a voter" : role == MEMBER_LEARNER ? "made a learner" : "removed", rc == 0 ? "done" : "failed");
+    assert(rc == 0);
+}
+
+// the ids after those of raft_config, and then 0, on ports nothing listens on; they are never started
+raft_server_configuration_t absent_server(int n) {
+    raft_server_configuration_t server = config.servers[0];
+    server.id = (N_SERVERS + 1 + n <= MAX_SERVER_ID) ? N_SERVERS + 1 + n : 0;
+    server.client_socket.sin_port = htons(ntohs(server.client_socket.sin_port) + 100 + n);
+    server.raft_socket.sin_port = htons(ntohs(server.raft_socket.sin_port) + 100 + n);
+    return server;
+}
+
+// stops a running server other than the leader among the first n
+int stop_follower(int n) {
+    int ind = 0;
+    while(ind < n && (ind == admin_rpc.current_leader_index || server_active[ind] == 0)) ind ++;
+    assert(ind < n);
+    stop_server(ind);
+    return ind;
+}
+
+int main(int argc, char* argv[]) {
+    start_server_cluster(0);
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    pthread_t client_thread;
+    pthread_create(&client_thread, NULL, client, NULL);
+    while(client_state < 10) usleep(10000);
+    RPC_init(&admin_rpc, 2, 2001, config);
+
+    for(int ind = 4; ind >= 3; --ind) {
+	change_membership(ind, MEMBER_REMOVED);
+	stop_server(ind);
+    }
+    wait_for_writes();
+    int stopped = stop_follower(3);
+    wait_for_writes();
+    start_server(stopped, "use-backup");
+
+    for(int ind = 3; ind <= 4; ++ind) start_server(ind, "join");
+    sleep(1);
+    // the learners catch up without being counted in the majorities
+    for(int ind = 3; ind <= 4; ++ind) change_membership(ind, MEMBER_LEARNER);
+    wait_for_writes();
+    for(int ind = 3; ind <= 4; ++ind) change_membership(ind, MEMBER_VOTER);
+    wait_for_writes();
+
+    // the followers point the clients to the leader, so the client does not need to know it
+    raft_configuration_t follower_config;
+    int follower = (admin_rpc.current_leader_index + 1) % N_SERVERS;
+    for(int i = 0; i < N_SERVERS; ++i) follower_config.servers[i] = config.servers[follower];
+    RPC_init(&hint_rpc, 3, 2002, follower_config);
+    int rc = RPC_acquire_lock(&hint_rpc);
+    assert(rc == 0 || rc == E_LOCK);
+    char buffer[BUFFER_SIZE] = "B";
+    assert(RPC_append_file(&hint_rpc, "file_0", buffer) == 0);
+    assert(RPC_release_lock(&hint_rpc) == 0);
+    printf("a client that only knows server %i found the leader\n", follower+1);
+
+    // a configuration entry holds MAX_MEMBERS servers
+    int n_absent = MAX_MEMBERS - N_SERVERS;
+    for(int n = 0; n < n_absent; ++n) {
+	raft_server_configuration_t server = absent_server(n);
+	assert(RPC_change_membership(&admin_rpc, &server, MEMBER_LEARNER) == 0);
+    }
+    raft_server_configuration_t server = absent_server(n_absent);
+    assert(RPC_change_membership(&admin_rpc, &server, MEMBER_LEARNER) == E_MEMBERSHIP);
+    printf("%i members: one more is refused\n", MAX_MEMBERS);
+    for(int n = 0; n < n_absent; ++n) {
+	raft_server_configuration_t server = absent_server(n);
+	assert(RPC_change_membership(&admin_rpc, &server, MEMBER_REMOVED) == 0);
+    }
+    wait_for_writes();
+
+    stop_follower(N_SERVERS);
+    stop_follower(N_SERVERS);
+    wait_for_writes();
+
+    kill_all_servers();
+    exit(0);
+}
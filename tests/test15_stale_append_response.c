@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../raft.h"
+#include "../raft_leader.h"
+#include "../raft_follower.h"
+
+// server 1 of ./raft_config runs in the test process without the others: it is elected in term 2 and again in term 4,
+// and an acknowledgement of a term 2 request comes in after that (as if it was read from the socket before the second
+// election). the leader must not count it, nor a progress left from term 2, nor a response with an unknown id
+
+raft_configuration_t config;
+raft_state_t raft;
+
+void handle_commit(raft_state_t *raft, raft_transaction_entry_t data[MAX_TRANSACTION_ENTRIES]) {}
+
+void become_leader(int term) {
+    mcslock_acquire(&raft.lock);
+    Raft_convert_to_follower(&raft, term);
+    Raft_convert_to_leader(&raft); // releases the lock
+}
+
+void respond(int id, int term, int match_index) {
+    raft_response_packet_t response;
+    bzero(&response, sizeof(raft_response_packet_t));
+    response.id = id;
+    response.term = term;
+    response.success = 1;
+    response.match_index = match_index;
+    response.last_log_index = match_index;
+    response.request_id = 1;
+    response.commit_index = -1;
+    // straight to the leader: Raft_handle_response would drop a response of an earlier term itself
+    Raft_handle_append_response(&raft, &response);
+}
+
+int match_index(int id) {
+    spinlock_acquire(&raft.progress[id].lock);
+    int index = raft.progress[id].match_index;
+    spinlock_release(&raft.progress[id].lock);
+    return index;
+}
+
+// the commit index itself: the view only publishes it once the applier (not running here) has applied the entries
+int commit_index() {
+    mcslock_acquire(&raft.lock);
+    int index = raft.commit_index;
+    mcslock_release(&raft.lock);
+    return index;
+}
+
+int main(int argc, char* argv[]) {
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    char files_dir[256];
+    strcpy(files_dir, config.servers[0].file_directory);
+    Raft_server_init(&raft, config, files_dir, handle_commit, config.servers[0].id, ntohs(config.servers[0].raft_socket.sin_port));
+    int follower_1 = config.servers[1].id, follower_2 = config.servers[2].id, follower_3 = config.servers[3].id;
+
+    become_leader(2);
+    become_leader(4);
+    int last_index = raft.log_count - 1; // the entries of both terms
+    printf("leader of term %i, log up to %i\n", raft.current_term, last_index);
+
+    respond(follower_1, 2, last_index);
+    assert(match_index(follower_1) == -1);
+    printf("the response of term 2 is dropped\n");
+
+    respond(-1, 4, last_index);
+    respond(MAX_SERVER_ID + 1, 4, last_index);
+    printf("the responses with unknown ids are dropped\n");
+
+    // a progress left from term 2 does not count for the majority either
+    spinlock_acquire(&raft.progress[follower_2].lock);
+    raft.progress[follower_2].term = 2;
+    raft.progress[follower_2].match_index = last_index;
+    spinlock_release(&raft.progress[follower_2].lock);
+    respond(follower_1, 4, last_index);
+    assert(match_index(follower_1) == last_index);
+    assert(commit_index() < last_index);
+    printf("two of five acknowledgements of term 4: nothing is committed\n");
+
+    respond(follower_3, 4, last_index);
+    assert(commit_index() == last_index);
+    printf("three of five acknowledgements of term 4: committed up to %i\n", last_index);
+
+    exit(0);
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client_rpc.h"
+
+#include "./server_cluster.c"
+
+// a reader holds the lock shared while the leadership is handed over: the new leader takes the shared holder over
+// from the replicated state, so a writer that asks it for the lock waits until the reader releases it there.
+// the writer waits parked: the servers take almost no cpu time meanwhile
+
+#define WRITER_WAIT_MSEC 300
+
+raft_configuration_t config;
+rpc_conn_t reader_rpc, writer_rpc, admin_rpc;
+
+volatile int released = 0;
+volatile int writer_state = 0;
+
+// msec of cpu time the servers took so far
+long servers_cpu_msec() {
+    long total = 0;
+    for(int i = 0; i < N_SERVERS; ++i) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%i/stat", server_pid[i]);
+	FILE *f = fopen(path, "r");
+	if(f == NULL) continue;
+	long utime = 0, stime = 0;
+	fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %li %li", &utime, &stime);
+	fclose(f);
+	total += (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+    }
+    return total;
+}
+
+void* writer(void *arg) {
+    RPC_init(&writer_rpc, 2, 2001, config);
+    writer_state = 1;
+    assert(RPC_acquire_lock(&writer_rpc) == 0);
+    assert(released); // the new leader must not grant the lock while the reader holds it
+    printf("writer: lock acquired after the reader released it\n");
+    char buffer[BUFFER_SIZE] = "A";
+    assert(RPC_append_file(&writer_rpc, "file_0", buffer) == 0);
+    assert(RPC_release_lock(&writer_rpc) == 0);
+    writer_state = 2;
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    start_server_cluster(0);
+
+    FILE *f = fopen("./raft_config", "rb");
+    fread(&config, sizeof(raft_configuration_t), 1, f);
+    fclose(f);
+
+    RPC_init(&reader_rpc, 1, 2000, config);
+    RPC_init(&admin_rpc, 3, 2002, config);
+    assert(RPC_acquire_shared_lock(&reader_rpc) == 0);
+    printf("reader: lock acquired shared\n");
+
+    assert(RPC_transfer_leadership(&admin_rpc, -1) == 0);
+    printf("leadership handed over by server %i\n", admin_rpc.current_leader_index+1);
+
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, NULL, writer, NULL);
+    while(writer_state == 0) usleep(1000);
+    long cpu_start = servers_cpu_msec(), start = now_msec();
+    usleep(WRITER_WAIT_MSEC * 1000);
+    long cpu = servers_cpu_msec() - cpu_start, elapsed = now_msec() - start;
+    assert(writer_state == 1);
+    printf("writer waiting for %li ms, the servers took %li ms of cpu time\n", elapsed, cpu);
+    assert(cpu < elapsed / 2);
+
+    released = 1;
+    assert(RPC_release_lock(&reader_rpc) == 0); // the new leader knows the reader holds the lock
+    printf("reader: lock released on the new leader\n");
+    pthread_join(writer_thread, NULL);
+    assert(writer_state == 2);
+
+    kill_all_servers();
+    exit(0);
+}
@@ -1,57 +1,212 @@
 #include "timer.h"
-#include "spinlock.h"
 #include <pthread.h>
 #include <time.h>
-#include <signal.h>
 
-void* timer_thread(void* arg) {
-    timer_t *timer = (timer_t*) arg;
-    while(1) {
-	spinlock_acquire(&timer->lock);
-	if(timer->state == 1) {
-	    clock_t time_diff = clock() - timer->start_time;
-	    int time_diff_msec = time_diff * 1000 / CLOCKS_PER_SEC;
-	    if(time_diff_msec >= timer->duration) {
-		timer->state = 0;
-		timer->handle_timer(timer->handler_arg);
-	    }
-	} 
-	spinlock_release(&timer->lock);
-	sched_yield();
-    }
-    pthread_exit(0);
-}
-
-void timer_init(timer_t *timer, int duration, void (*timer_handler)(), void* handler_arg) {
-    timer->duration = duration;
-    timer->state = 0;
-    spinlock_init(&timer->lock);
-    timer->handle_timer = timer_handler;
-    timer->handler_arg = handler_arg;
-    pthread_create(&timer->thread_id, NULL, timer_thread, timer);
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_MAX_TICKS ((1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef struct timer_wheel {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	long start_time; // msec; tick 0
+	unsigned long current_tick; // the next tick to be run
+	unsigned long wake_tick; // the tick the wheel thread sleeps until
+	int sleeping;
+	int n_pending;
+	wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+	pthread_t thread_id;
+} timer_wheel_t;
+
+static timer_wheel_t wheel;
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+long timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+unsigned long _timer_now_tick() {
+    return (timer_now() - wheel.start_time) / TIMER_TICK;
+}
+
+// the wheel lock must be held
+void _timer_link(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+// the wheel lock must be held
+void _timer_unlink(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+// add()
+// puts the timer to the slot of the lowest level whose turn still covers the expiration tick; the wheel lock must be held
+void _timer_add(wheel_timer_t *timer) {
+    unsigned long expires = timer->expires;
+    if(expires < wheel.current_tick) expires = wheel.current_tick; // run on the next tick
+    unsigned long delta = expires - wheel.current_tick;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (1UL << (TIMER_WHEEL_BITS * (level + 1)))) level ++;
+    int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    _timer_link(&wheel.slots[level][slot], timer);
+}
+
+// cascade(level)
+// moves the timers of the current slot of the level down to the lower levels; returns the index of the slot
+int _timer_cascade(int level) {
+    int slot = (wheel.current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    wheel_timer_t *head = &wheel.slots[level][slot];
+    while(head->next != head) {
+	wheel_timer_t *timer = head->next;
+	_timer_unlink(timer);
+	_timer_add(timer);
+    }
+    return slot;
+}
+
+// run_tick()
+// runs the handlers of the timers expiring at current_tick; the wheel lock must be held (it is released while a handler runs)
+void _timer_run_tick() {
+    int slot = wheel.current_tick & TIMER_WHEEL_MASK;
+    if(slot == 0) {
+	// the lower wheel turned around: move down the next group of ticks of each level
+	for(int level = 1; level < TIMER_WHEEL_LEVELS && _timer_cascade(level) == 0; ++level);
+    }
+    wheel.current_tick ++;
+
+    // the expired timers are moved to a list of their own, so that a handler can cancel or set any of them
+    wheel_timer_t expired;
+    expired.next = expired.prev = &expired;
+    wheel_timer_t *head = &wheel.slots[0][slot];
+    while(head->next != head) {
+	wheel_timer_t *timer = head->next;
+	_timer_unlink(timer);
+	_timer_link(&expired, timer);
+    }
+    while(expired.next != &expired) {
+	wheel_timer_t *timer = expired.next;
+	_timer_unlink(timer);
+	wheel.n_pending --;
+	pthread_mutex_unlock(&wheel.mutex);
+	timer->handle_timer(timer->handler_arg);
+	pthread_mutex_lock(&wheel.mutex);
+    }
 }
 
-void timer_reset(timer_t *timer) {
-    spinlock_acquire(&timer->lock);
-    timer->start_time = clock();
-    timer->state ++;
-    spinlock_release(&timer->lock);
+// next_tick()
+// returns the first tick that has something to do: a timer in the lower wheel, or the turn of the lower wheel
+unsigned long _timer_next_tick() {
+    unsigned long tick = wheel.current_tick;
+    if((tick & TIMER_WHEEL_MASK) == 0) return tick; // the higher levels are cascaded at this tick
+    do {
+	wheel_timer_t *head = &wheel.slots[0][tick & TIMER_WHEEL_MASK];
+	if(head->next != head) return tick;
+	tick ++;
+    } while(tick & TIMER_WHEEL_MASK);
+    return tick;
+}
+
+void* _timer_wheel_thread(void *arg) {
+    pthread_mutex_lock(&wheel.mutex);
+    while(1) {
+	if(wheel.n_pending == 0) {
+	    wheel.sleeping = 1;
+	    wheel.wake_tick = TIMER_MAX_TICKS;
+	    pthread_cond_wait(&wheel.cond, &wheel.mutex);
+	    wheel.sleeping = 0;
+	    continue;
+	}
+	unsigned long now_tick = _timer_now_tick();
+	while(wheel.current_tick <= now_tick && wheel.n_pending > 0) _timer_run_tick();
+	if(wheel.n_pending == 0) {
+	    // nothing left to run until a timer is set: skip the empty ticks
+	    if(wheel.current_tick <= now_tick) wheel.current_tick = now_tick + 1;
+	    continue;
+	}
+
+	wheel.wake_tick = _timer_next_tick();
+	if(wheel.wake_tick <= now_tick) continue;
+	long wake_time = wheel.start_time + wheel.wake_tick * TIMER_TICK;
+	struct timespec ts = {wake_time / 1000, (wake_time % 1000) * 1000000};
+	wheel.sleeping = 1;
+	pthread_cond_timedwait(&wheel.cond, &wheel.mutex, &ts);
+	wheel.sleeping = 0;
+    }
+    return NULL;
 }
 
-void timer_disable(timer_t *timer) {
-    spinlock_acquire(&timer->lock);
-    timer->state --;
-    spinlock_release(&timer->lock);
+void _timer_wheel_init() {
+    pthread_mutex_init(&wheel.mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    wheel.start_time = timer_now();
+    wheel.current_tick = 0;
+    wheel.wake_tick = TIMER_MAX_TICKS;
+    wheel.sleeping = 0;
+    wheel.n_pending = 0;
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+	for(int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+	    wheel.slots[level][slot].next = wheel.slots[level][slot].prev = &wheel.slots[level][slot];
+	}
+    }
+    pthread_create(&wheel.thread_id, NULL, _timer_wheel_thread, NULL);
 }
 
-void timer_resume(timer_t *timer) {
-    spinlock_acquire(&timer->lock);
-    timer->state ++;
-    spinlock_release(&timer->lock);
+void timer_init(wheel_timer_t *timer, void (*timer_handler)(void *arg), void *handler_arg) {
+    pthread_once(&wheel_once, _timer_wheel_init);
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->handle_timer = timer_handler;
+    timer->handler_arg = handler_arg;
 }
 
+void timer_set(wheel_timer_t *timer, int msec) {
+    if(msec < 0) msec = 0;
+    pthread_mutex_lock(&wheel.mutex);
+    if(timer->prev != NULL) {
+	_timer_unlink(timer);
+	wheel.n_pending --;
+    }
+    unsigned long now_tick = _timer_now_tick();
+    // the wheel is empty: there are no ticks to catch up on
+    if(wheel.n_pending == 0 && wheel.current_tick < now_tick) wheel.current_tick = now_tick;
+    unsigned long ticks = (msec + TIMER_TICK - 1) / TIMER_TICK;
+    if(ticks > TIMER_MAX_TICKS) ticks = TIMER_MAX_TICKS;
+    timer->expires = now_tick + ticks;
+    _timer_add(timer);
+    wheel.n_pending ++;
+    // the wheel thread only has to be woken up if it sleeps past the new timer
+    if(wheel.sleeping && timer->expires < wheel.wake_tick) {
+	wheel.wake_tick = timer->expires;
+	pthread_cond_signal(&wheel.cond);
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+}
 
-void timer_terminate(timer_t *timer) {
-    pthread_kill(timer->thread_id, SIGKILL);
+int timer_cancel(wheel_timer_t *timer) {
+    pthread_mutex_lock(&wheel.mutex);
+    int rc = -1;
+    if(timer->prev != NULL) {
+	_timer_unlink(timer);
+	wheel.n_pending --;
+	rc = 0;
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+    return rc;
 }
 
+int timer_pending(wheel_timer_t *timer) {
+    pthread_mutex_lock(&wheel.mutex);
+    int pending = timer->prev != NULL;
+    pthread_mutex_unlock(&wheel.mutex);
+    return pending;
+}
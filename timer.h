@@ -1,24 +1,44 @@
-#include "spinlock.h"
-#include <time.h>
+#ifndef __TIMER_h__
+#define __TIMER_h__
+
 #include <pthread.h>
 
-typedef struct timer {
-	spinlock_t lock;
-	clock_t start_time;
-	int duration;
-	int state;
-	pthread_t thread_id;
-	void (*handle_timer)(void* arg);
-	void* handler_arg;
-} timer_t;
+#define TIMER_TICK 1 // msec
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // the wheels cover 2^32 ticks; later deadlines are clamped
+
+// timing wheel
+// all the timers of the process are kept by a single hierarchical timing wheel on CLOCK_MONOTONIC.
+// a timer sits in the slot of the tick it expires at (level 0), or of the group of ticks it expires in (higher levels);
+// the slots of a higher level are moved down a level when the lower wheel turns around.
+// setting and cancelling a timer are O(1): timers are linked into the slots, no memory is allocated.
+// the wheel thread sleeps until the next tick with a timer (or the next turn of the lower wheel),
+// and runs the handlers of the expired timers one by one, without holding the wheel lock:
+// a handler can set any timer again, including its own.
+
+typedef struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer *prev; // NULL if the timer is not pending
+	unsigned long expires; // tick
+	void (*handle_timer)(void *arg);
+	void *handler_arg;
+} wheel_timer_t;
 
-void timer_init(timer_t *timer, int duration, void (*timer_handler)(), void* handler_arg);
+void timer_init(wheel_timer_t *timer, void (*timer_handler)(void *arg), void *handler_arg);
 
-void timer_reset(timer_t *timer);
+// set()
+// (re)starts the timer: the handler is called on the wheel thread after msec
+void timer_set(wheel_timer_t *timer, int msec);
 
-void timer_disable(timer_t *timer);
+// cancel()
+// returns 0 if the timer was pending, -1 if it was not (or its handler already started)
+int timer_cancel(wheel_timer_t *timer);
 
-void timer_resume(timer_t *timer);
+int timer_pending(wheel_timer_t *timer);
 
-void timer_terminate(timer_t *timer);
+// now()
+// msec on CLOCK_MONOTONIC
+long timer_now();
 
+#endif
@@ -1,66 +1,261 @@
 #include "tmdspinlock.h"
 
+// the lock must be held
+int _tmdspinlock_holds(tmdspinlock_t *lock, int id) {
+    return id >= 0 && id < MAX_ID && lock->holders[id].mode != -1 && !lock->holders[id].expiring;
+}
+
+// the lock must be held
+void _tmdspinlock_add_holder(tmdspinlock_t *lock, int id, int mode) {
+    tmdspinlock_holder_t *holder = &lock->holders[id];
+    holder->mode = mode;
+    holder->paused = 0;
+    holder->expiring = 0;
+    holder->lease_end = timer_now() + CLIENT_TIMEOUT;
+    timer_set(&holder->lease_timer, CLIENT_TIMEOUT);
+    if(mode == LOCK_EXCLUSIVE) {
+	lock->exclusive_id = id;
+    } else {
+	lock->n_shared ++;
+    }
+}
+
+// the lock must be held
+void _tmdspinlock_remove_holder(tmdspinlock_t *lock, int id) {
+    tmdspinlock_holder_t *holder = &lock->holders[id];
+    if(holder->mode == LOCK_EXCLUSIVE) {
+	lock->exclusive_id = -1;
+    } else if(holder->mode == LOCK_SHARED) {
+	lock->n_shared --;
+    }
+    holder->mode = -1;
+    holder->expiring = 0;
+    timer_cancel(&holder->lease_timer);
+}
+
+// can_grant()
+// checks whether the waiter can be given the lock now; the lock must be held
+int _tmdspinlock_can_grant(tmdspinlock_t *lock, tmdspinlock_waiter_t *waiter) {
+    if(lock->holders[waiter->id].mode != -1) return 0; // the previous lock of the id is still being expired
+    if(lock->exclusive_id != -1) return 0;
+    if(waiter->mode == LOCK_EXCLUSIVE && lock->n_shared > 0) return 0;
+
+    int ahead = 1;
+    for(tmdspinlock_waiter_t *other = lock->queue_head; other != NULL; other = other->next) {
+	if(other == waiter) {
+	    ahead = 0;
+	    continue;
+	}
+	switch(lock->policy) {
+	    case WRITER_PREFERENCE:
+		// a writer only waits for the writers before it, a reader waits for all the writers
+		if(other->mode == LOCK_EXCLUSIVE && (ahead || waiter->mode == LOCK_SHARED)) return 0;
+		break;
+	    case READER_PREFERENCE:
+		// a reader never waits, a writer waits for all the readers and the writers before it
+		if(waiter->mode == LOCK_EXCLUSIVE && (other->mode == LOCK_SHARED || ahead)) return 0;
+		break;
+	    case FIFO_ORDER:
+		if(ahead && (other->mode == LOCK_EXCLUSIVE || waiter->mode == LOCK_EXCLUSIVE)) return 0;
+		break;
+	}
+    }
+    return 1;
+}
+
 int tmdspinlock_pause_if_owner(tmdspinlock_t *lock, int id) {
+    spinlock_acquire(&lock->lock);
     // if we don't hold a lock, immediately return -1;
-    if(lock->holder_id != id) {
-	return -1;
-    }
-    // disabling the timer
-    timer_disable(&lock->timer);
-    // while we were waiting for the timer to disable, 
-    // the timer could've triggered and released our lock -- so need to check once again
-    if(lock->holder_id != id) {
-	timer_resume(&lock->timer); // if lock was released, continue timer
+    if(!_tmdspinlock_holds(lock, id)) {
+	spinlock_release(&lock->lock);
 	return -1;
     }
+    tmdspinlock_holder_t *holder = &lock->holders[id];
+    // the lease timer might already be running its handler: it checks paused before withdrawing the lock
+    if(holder->paused ++ == 0) timer_cancel(&holder->lease_timer);
+    spinlock_release(&lock->lock);
     return 0;
 }
 
 int tmdspinlock_reset_if_owner(tmdspinlock_t *lock, int id) {
-    if(lock->holder_id != id) {
+    spinlock_acquire(&lock->lock);
+    if(!_tmdspinlock_holds(lock, id)) {
+	spinlock_release(&lock->lock);
 	return -1;
     }
-    timer_reset(&lock->timer);
+    tmdspinlock_holder_t *holder = &lock->holders[id];
+    if(holder->paused > 0) holder->paused --;
+    holder->lease_end = timer_now() + CLIENT_TIMEOUT;
+    if(holder->paused == 0) timer_set(&holder->lease_timer, CLIENT_TIMEOUT);
+    spinlock_release(&lock->lock);
     return 0;
 }
 
-int tmdspinlock_acquire(tmdspinlock_t *lock, int id) {
-    if(lock->holder_id == id) {
+int tmdspinlock_holder_mode(tmdspinlock_t *lock, int id) {
+    spinlock_acquire(&lock->lock);
+    int mode = _tmdspinlock_holds(lock, id) ? lock->holders[id].mode : -1;
+    spinlock_release(&lock->lock);
+    return mode;
+}
+
+int tmdspinlock_acquire(tmdspinlock_t *lock, int id, int mode) {
+    tmdspinlock_waiter_t waiter = {id, mode, NULL};
+
+    spinlock_acquire(&lock->lock);
+    if(_tmdspinlock_holds(lock, id)) {
+	spinlock_release(&lock->lock);
 	return E_LOCK;
     }
+    // join the wait queue
+    if(lock->queue_tail == NULL) {
+	lock->queue_head = &waiter;
+    } else {
+	lock->queue_tail->next = &waiter;
+    }
+    lock->queue_tail = &waiter;
 
-    while(!__sync_bool_compare_and_swap(&lock->lock_flag, 0, 1));
-    lock->holder_id = id;
-    timer_reset(&lock->timer);
+    while(!_tmdspinlock_can_grant(lock, &waiter)) {
+	// every change of the holders or the queue is made under the spinlock and signaled after it
+	unsigned int key = eventcount_prepare(&lock->changed);
+	spinlock_release(&lock->lock);
+	eventcount_wait(&lock->changed, key, -1);
+	spinlock_acquire(&lock->lock);
+    }
+
+    // leave the wait queue
+    tmdspinlock_waiter_t *prev = NULL;
+    for(tmdspinlock_waiter_t *other = lock->queue_head; other != &waiter; other = other->next) prev = other;
+    if(prev == NULL) {
+	lock->queue_head = waiter.next;
+    } else {
+	prev->next = waiter.next;
+    }
+    if(lock->queue_tail == &waiter) lock->queue_tail = prev;
+
+    _tmdspinlock_add_holder(lock, id, mode);
+    spinlock_release(&lock->lock);
+    eventcount_signal(&lock->changed); // the waiters behind it might be granted now (e.g. the next shared ones)
     return 0;
 }
 
 int tmdspinlock_release(tmdspinlock_t *lock, int id) {
-    if(tmdspinlock_pause_if_owner(lock, id) != 0) {
+    spinlock_acquire(&lock->lock);
+    if(!_tmdspinlock_holds(lock, id)) {
+	spinlock_release(&lock->lock);
 	return E_LOCK_EXP;
     }
-    lock->holder_id = -1;
-
-    __sync_bool_compare_and_swap(&lock->lock_flag, 1, 0);
+    _tmdspinlock_remove_holder(lock, id);
+    spinlock_release(&lock->lock);
+    eventcount_signal(&lock->changed);
     return 0;
 }
 
-void _tmdspinlock_handle_timer(void *arg) {
+void tmdspinlock_set_holders(tmdspinlock_t *lock, int exclusive_id, int *shared_ids, int n_shared) {
+    spinlock_acquire(&lock->lock);
+    for(int i = 0; i < MAX_ID; ++i) {
+	// a holder being expired is removed by its lease timer
+	if(lock->holders[i].mode != -1 && !lock->holders[i].expiring) _tmdspinlock_remove_holder(lock, i);
+    }
+    if(exclusive_id != -1 || n_shared > 0) {
+	// the previous holders might still be expiring: wait until they are removed
+	while(lock->exclusive_id != -1 || lock->n_shared > 0) {
+	    unsigned int key = eventcount_prepare(&lock->changed);
+	    spinlock_release(&lock->lock);
+	    eventcount_wait(&lock->changed, key, -1);
+	    spinlock_acquire(&lock->lock);
+	}
+	if(exclusive_id != -1) _tmdspinlock_add_holder(lock, exclusive_id, LOCK_EXCLUSIVE);
+	for(int i = 0; i < n_shared; ++i) _tmdspinlock_add_holder(lock, shared_ids[i], LOCK_SHARED);
+    }
+    spinlock_release(&lock->lock);
+    eventcount_signal(&lock->changed);
+}
+
+// handle_lease_timer()
+// withdraws the lock from the holder if its lease ran out
+void _tmdspinlock_handle_lease_timer(void *arg) {
+    tmdspinlock_holder_t *holder = (tmdspinlock_holder_t*)arg;
+    tmdspinlock_t *lock = holder->lock;
+    spinlock_acquire(&lock->lock);
+    // the lease could have been paused or renewed while the timer was expiring
+    if(!_tmdspinlock_holds(lock, holder->id) || holder->paused > 0) {
+	spinlock_release(&lock->lock);
+	return;
+    }
+    long now = timer_now();
+    if(holder->lease_end > now) {
+	timer_set(&holder->lease_timer, holder->lease_end - now);
+	spinlock_release(&lock->lock);
+	return;
+    }
+    holder->expiring = 1; // no new requests of the holder are handled from now on
+    if(lock->handle_expire == NULL) {
+	_tmdspinlock_remove_holder(lock, holder->id);
+	spinlock_release(&lock->lock);
+	eventcount_signal(&lock->changed);
+	return;
+    }
+    // the holder keeps the lock while the handler runs, so nobody else gets it before the handler is done
+    holder->next_expired = NULL;
+    if(lock->expired_tail == NULL) {
+	lock->expired_head = holder;
+    } else {
+	lock->expired_tail->next_expired = holder;
+    }
+    lock->expired_tail = holder;
+    spinlock_release(&lock->lock);
+    eventcount_signal(&lock->expired_event);
+}
+
+// expire_thread()
+// runs the expire handler for the holders whose leases ran out, and withdraws the lock from them after it
+void* _tmdspinlock_expire_thread(void *arg) {
     tmdspinlock_t *lock = (tmdspinlock_t*)arg;
-    assert(lock->holder_id != -1);
-    lock->holder_id = -1;
+    while(1) {
+	unsigned int key = eventcount_prepare(&lock->expired_event);
+	spinlock_acquire(&lock->lock);
+	tmdspinlock_holder_t *holder = lock->expired_head;
+	if(holder != NULL) {
+	    lock->expired_head = holder->next_expired;
+	    if(lock->expired_head == NULL) lock->expired_tail = NULL;
+	}
+	spinlock_release(&lock->lock);
+	if(holder == NULL) {
+	    eventcount_wait(&lock->expired_event, key, -1);
+	    continue;
+	}
 
-    __sync_bool_compare_and_swap(&lock->lock_flag, 1, 0);
+	lock->handle_expire(lock, holder->id, holder->mode); // the mode does not change until the holder is removed
+	spinlock_acquire(&lock->lock);
+	_tmdspinlock_remove_holder(lock, holder->id);
+	spinlock_release(&lock->lock);
+	eventcount_signal(&lock->changed);
+    }
+    return NULL;
 }
 
-void tmdspinlock_init(tmdspinlock_t *lock) {
-    lock->lock_flag = 0;
-    lock->holder_id = -1;
-    timer_init(&lock->timer, CLIENT_TIMEOUT, _tmdspinlock_handle_timer, lock);
+void tmdspinlock_init(tmdspinlock_t *lock, tmdspinlock_policy_t policy, void (*expire_handler)(tmdspinlock_t *lock, int holder_id, int mode)) {
+    spinlock_init(&lock->lock);
+    lock->exclusive_id = -1;
+    lock->n_shared = 0;
+    for(int i = 0; i < MAX_ID; ++i) {
+	lock->holders[i].mode = -1;
+	lock->holders[i].expiring = 0;
+	lock->holders[i].lock = lock;
+	lock->holders[i].id = i;
+	timer_init(&lock->holders[i].lease_timer, _tmdspinlock_handle_lease_timer, &lock->holders[i]);
+    }
+    lock->queue_head = NULL;
+    lock->queue_tail = NULL;
+    lock->policy = policy;
+    lock->handle_expire = expire_handler;
+    eventcount_init(&lock->changed);
+    lock->expired_head = NULL;
+    lock->expired_tail = NULL;
+    eventcount_init(&lock->expired_event);
+    if(expire_handler != NULL) pthread_create(&lock->expire_thread, NULL, _tmdspinlock_expire_thread, lock);
 }
 
 void tmdspinlock_terminate(tmdspinlock_t *lock)  {
-    timer_disable(&lock->timer);
-    timer_terminate(&lock->timer);
+    for(int i = 0; i < MAX_ID; ++i) timer_cancel(&lock->holders[i].lease_timer);
 }
-
@@ -4,63 +4,111 @@
 #include "server_rpc.h"
 #include "spinlock.h"
 #include "timer.h"
-#include <stdatomic.h>
 
 #define CLIENT_TIMEOUT 1000
 
+// order in which the waiting requests are granted
+typedef enum tmdspinlock_policy {
+	WRITER_PREFERENCE, // a shared request waits while an exclusive one is waiting (readers cannot starve the writers)
+	READER_PREFERENCE, // a shared request is granted whenever the lock is not held exclusively
+	FIFO_ORDER // requests are granted in the order they came (consecutive shared requests together)
+} tmdspinlock_policy_t;
+
+// lease of a holder of the lock
+typedef struct tmdspinlock_holder {
+	int mode; // -1 if the id does not hold the lock
+	int paused; // requests of the holder being handled; the lease does not run out while there are any
+	int expiring; // the expire handler is running: the lock is already withdrawn from the holder
+	long lease_end; // msec (CLOCK_MONOTONIC)
+	wheel_timer_t lease_timer; // pending while the lease runs (not while it is paused)
+	struct tmdspinlock_holder *next_expired;
+	struct tmdspinlock *lock;
+	int id;
+} tmdspinlock_holder_t;
+
+// request waiting for the lock; stored on the stack of the waiting thread
+typedef struct tmdspinlock_waiter {
+	int id;
+	int mode;
+	struct tmdspinlock_waiter *next;
+} tmdspinlock_waiter_t;
+
 // timed spinlock
-// this is a version of the spinlock that tracks the current holder ID,
-// and releases the lock after a certain timeout wtthout updates from the holding ID.
+// this is a version of the spinlock that tracks its holders, and releases the lock of a holder
+// after a certain timeout without updates from its ID.
+// the lock is held either exclusively by one ID, or shared by any number of IDs (LOCK_SHARED).
 //
 // main invariants:
-//		1. holder_id is modified only by the thread that is currently holding the lock and by the timer thread
-//			however, holder_id can be read by any process in any time. 
-//		2. only the thread with the certain corr. ID can set holder_id to its own ID value
-//		3. when the lock is not held, timer is always disabled -- no notifications called when the lock is free
+//		1. all the fields are protected by the spinlock
+//		2. either exclusive_id is -1 or n_shared is 0
+//		3. a holder is given the lock only after all the waiters the policy puts in front of it
 typedef struct tmdspinlock {
-	int lock_flag;
-	atomic_int holder_id;
-	timer_t timer;
+	spinlock_t lock;
+	int exclusive_id; // -1 if not held exclusively
+	int n_shared;
+	tmdspinlock_holder_t holders[MAX_ID];
+	tmdspinlock_waiter_t *queue_head;
+	tmdspinlock_waiter_t *queue_tail;
+	tmdspinlock_policy_t policy;
+	eventcount_t changed; // signaled when a holder or a waiter leaves; the waiters park on it
+	void (*handle_expire)(struct tmdspinlock *lock, int holder_id, int mode);
+	// the holders whose leases ran out, in order, until the expire thread has run handle_expire for them
+	tmdspinlock_holder_t *expired_head;
+	tmdspinlock_holder_t *expired_tail;
+	eventcount_t expired_event;
+	pthread_t expire_thread;
 } tmdspinlock_t;
 
 // pause_if_owner(id)
 // this function checks whether the specified id holds the lock
-// if the id holds the lock, disables the timer and returns 0,
-// otherwise returns -1 without disabling the timer
+// if the id holds the lock, stops its lease from running out and returns 0,
+// otherwise returns -1
 //
 // if returns 0, it is guaranteed that the id holds a lock, and the lock
-// will not be withdrawn by the timer until the reset_if_owner function is called for this id
+// will not be withdrawn by its lease timer until the reset_if_owner function is called for this id
 //
 // the main idea behind this function is that when we want to access the resource protected by the lock,
-// we don't want the timer to wthdraw the lock from us during the execution -- so when we access the resource,
+// we don't want the lock to be withdrawn from us during the execution -- so when we access the resource,
 // we first need to call pause_if_owner, and after we complete the request we call reset_if_owner
 int tmdspinlock_pause_if_owner(tmdspinlock_t *lock, int id);
 
 // reset_if_owner(id)
 // this function checks whether the specified id holds the lock
-// if the id holds the lock, resets the timer to start counting from 0 and returns 0
+// if the id holds the lock, renews its lease to start counting from 0 and returns 0
 // otherwise, returns -1
 //
 // must be called only after pause_if_owner returned 0 for the client!!!
 int tmdspinlock_reset_if_owner(tmdspinlock_t *lock, int id);
 
+// holder_mode(id)
+// returns the mode in which the id holds the lock, or -1 if it does not hold it
+int tmdspinlock_holder_mode(tmdspinlock_t *lock, int id);
 
-// acquire(id)
-// this function acquires the lock for the specified id and resets the timer 
-// to start from 0 after the lock is acquired
-int tmdspinlock_acquire(tmdspinlock_t *lock, int id);
+
+// acquire(id, mode)
+// this function parks until the lock can be given to the specified id in the mode (LOCK_EXCLUSIVE or LOCK_SHARED),
+// acquires it and starts the lease of the id. returns E_LOCK if the id already holds the lock
+int tmdspinlock_acquire(tmdspinlock_t *lock, int id, int mode);
 
 // release(id)
-// this function releases the lock for the given id if it was not already released by the timer
+// this function releases the lock for the given id if it was not already released by its lease timer
 int tmdspinlock_release(tmdspinlock_t *lock, int id);
 
+// set_holders(exclusive_id, shared_ids, n_shared)
+// this function makes exclusive_id the exclusive holder of the lock (none if it is -1) and the n_shared ids its shared
+// holders, whoever held it before, and starts their leases. it is used when the holders are known from elsewhere
+// (e.g. from the replicated state on a new leader)
+void tmdspinlock_set_holders(tmdspinlock_t *lock, int exclusive_id, int *shared_ids, int n_shared);
+
 // init()
 // this function initializes the new tmdspinlock object.
-// it starts a new thread for the timer and initializes the lock
-void tmdspinlock_init(tmdspinlock_t *lock);
+// the leases are timers of the timing wheel (timer.h): no thread is polling them.
+// expire_handler (if not NULL) is called when the lock is withdrawn from a holder, before it is given to anyone else.
+// it runs on an expire thread of the lock, not on the wheel thread, so it may block (e.g. on the log writes)
+void tmdspinlock_init(tmdspinlock_t *lock, tmdspinlock_policy_t policy, void (*expire_handler)(tmdspinlock_t *lock, int holder_id, int mode));
 
 // terminate()
-// this function terminates the timer thread.
+// this function cancels the leases of the holders.
 void tmdspinlock_terminate(tmdspinlock_t *lock);
 
 #endif
@@ -62,6 +62,16 @@ int UDP_SetReceiveTimeout(int fd, int timeout) {
     return 0;
 }
 
+// enlarge socket buffers so that bursts of large datagrams are not dropped
+int UDP_SetBufferSize(int fd, int size) {
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+	perror("error setting buffer size");
+	return -1;
+    }
+    return 0;
+}
+
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     if(packet_loss && ((rand() % 100) < fail_prob)) {
 	printf("PACKET LOSS\n");
@@ -35,6 +35,7 @@ int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
 
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 int UDP_SetReceiveTimeout(int fd, int timeout);
+int UDP_SetBufferSize(int fd, int size);
 
 void UDP_SimulatePacketLoss(int fp);
 